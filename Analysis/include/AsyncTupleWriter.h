@@ -0,0 +1,212 @@
+/*! Filling of the output tuples on a dedicated writer thread.
+The processing thread only copies the entries into staging buffers. Full buffers are handed over to the writer thread
+through a bounded queue, and are returned to the processing thread after they are written, so that their memory is
+reused. With ROOT implicit multi-threading enabled, baskets flushed by the writer thread are compressed in parallel.
+A file that is written by a writer thread should not be used by other threads until the writer is finished.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <TROOT.h>
+#include "AnalysisTools/Core/include/exception.h"
+
+namespace analysis {
+
+// Bounded queue of items between the processing thread and a consumer running on a separate thread.
+// Items are processed in the order of Push. At most max_pending items wait in the queue, Push blocks until there
+// is space. An exception thrown by the consumer stops the processing and is rethrown by the next Push or Close.
+template<typename Item>
+class AsyncPipeline {
+public:
+    using Consumer = std::function<void(Item&)>;
+
+    AsyncPipeline(const Consumer& _consumer, size_t _max_pending) :
+        consumer(_consumer), max_pending(_max_pending), closed(false)
+    {
+        if(!max_pending)
+            throw exception("Number of pending items should be positive.");
+        thread = std::thread(&AsyncPipeline::Run, this);
+    }
+
+    AsyncPipeline(const AsyncPipeline&) = delete;
+    AsyncPipeline& operator=(const AsyncPipeline&) = delete;
+
+    // Items that were not processed before the destruction are discarded.
+    ~AsyncPipeline()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            pending.clear();
+        }
+        cond_var.notify_all();
+        if(thread.joinable())
+            thread.join();
+    }
+
+    // Item to be filled by the processing thread: either an item processed earlier, or a new one.
+    std::unique_ptr<Item> Acquire()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(processed.empty())
+            return std::make_unique<Item>();
+        std::unique_ptr<Item> item = std::move(processed.back());
+        processed.pop_back();
+        return item;
+    }
+
+    void Push(std::unique_ptr<Item>&& item)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if(closed)
+                throw exception("Item is pushed into the closed pipeline.");
+            cond_var.wait(lock, [&] { return error || pending.size() < max_pending; });
+            if(error)
+                std::rethrow_exception(error);
+            pending.push_back(std::move(item));
+        }
+        cond_var.notify_all();
+    }
+
+    // Waits until all pushed items are processed.
+    void Close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        cond_var.notify_all();
+        if(thread.joinable())
+            thread.join();
+        if(error)
+            std::rethrow_exception(error);
+    }
+
+private:
+    void Run()
+    {
+        while(true) {
+            std::unique_ptr<Item> item;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond_var.wait(lock, [&] { return closed || !pending.empty(); });
+                if(pending.empty()) return;
+                item = std::move(pending.front());
+                pending.pop_front();
+            }
+            cond_var.notify_all();
+            try {
+                consumer(*item);
+            } catch(...) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    error = std::current_exception();
+                    pending.clear();
+                }
+                cond_var.notify_all();
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            processed.push_back(std::move(item));
+        }
+    }
+
+private:
+    const Consumer consumer;
+    const size_t max_pending;
+    bool closed;
+    std::deque<std::unique_ptr<Item>> pending;
+    std::vector<std::unique_ptr<Item>> processed;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable cond_var;
+    std::thread thread;
+};
+
+// Wrapper of a SmartTree output that fills it on a writer thread. Entries are staged in batches: operator() gives
+// the entry to be assigned, and Fill commits it. As for the tuple itself, the staged entry can contain the values of
+// an entry filled earlier, so it should be assigned completely. The staged data are swapped with the data of the tuple
+// before the fill, therefore the addresses of the branches are unchanged.
+// Finish should be called before the tuple is written.
+template<typename Tuple>
+class AsyncTupleWriter {
+public:
+    using Data = typename std::decay<decltype(std::declval<Tuple&>()())>::type;
+    static constexpr size_t default_batch_size = 100;
+    static constexpr size_t default_max_pending_batches = 2;
+
+    explicit AsyncTupleWriter(const std::shared_ptr<Tuple>& _tuple, size_t _batch_size = default_batch_size,
+                              size_t max_pending_batches = default_max_pending_batches) :
+        tuple(_tuple), batch_size(_batch_size), n_entries(0),
+        pipeline([this](Batch& b) { WriteBatch(b); }, max_pending_batches)
+    {
+        if(!batch_size)
+            throw exception("Batch size should be positive.");
+        ROOT::EnableThreadSafety();
+        NextBatch();
+    }
+
+    Data& operator()() { return batch->entries[batch->size]; }
+
+    void Fill()
+    {
+        ++n_entries;
+        if(++batch->size == batch_size) {
+            pipeline.Push(std::move(batch));
+            NextBatch();
+        }
+    }
+
+    // Number of the filled entries, including the entries that are not yet written into the tuple.
+    Long64_t GetEntries() const { return n_entries; }
+
+    // Waits until all filled entries are written into the tuple.
+    void Finish()
+    {
+        if(batch && batch->size)
+            pipeline.Push(std::move(batch));
+        batch.reset();
+        pipeline.Close();
+    }
+
+private:
+    struct Batch {
+        std::vector<Data> entries;
+        size_t size{0};
+    };
+
+    void NextBatch()
+    {
+        batch = pipeline.Acquire();
+        batch->entries.resize(batch_size);
+        batch->size = 0;
+    }
+
+    void WriteBatch(Batch& b)
+    {
+        for(size_t n = 0; n < b.size; ++n) {
+            std::swap((*tuple)(), b.entries[n]);
+            tuple->Fill();
+        }
+    }
+
+private:
+    std::shared_ptr<Tuple> tuple;
+    const size_t batch_size;
+    Long64_t n_entries;
+    std::unique_ptr<Batch> batch;
+    AsyncPipeline<Batch> pipeline;
+};
+
+} // namespace analysis
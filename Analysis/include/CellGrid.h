@@ -0,0 +1,298 @@
+/*! Definition of the grid of cells in (eta, phi) around the tau that is used to prepare the training inputs.
+*/
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <limits>
+#include <cmath>
+#include "AnalysisTools/Core/include/exception.h"
+
+namespace analysis {
+
+enum class CellObjectType { PfCand_electron, PfCand_muon, PfCand_chargedHadron, PfCand_neutralHadron,
+                            PfCand_gamma, Electron, Muon };
+constexpr size_t NumberOfCellObjectTypes = 7;
+
+// Number of objects of the given type inside the cell and the object with the highest pt.
+struct CellObjectAccumulator {
+    size_t n_total{0}, best_index{0};
+    float best_pt{std::numeric_limits<float>::lowest()};
+
+    void Add(size_t index, float pt)
+    {
+        ++n_total;
+        if(pt > best_pt) {
+            best_pt = pt;
+            best_index = index;
+        }
+    }
+};
+
+class Cell {
+public:
+    bool IsEmpty() const { return n_total == 0; }
+    const CellObjectAccumulator& at(CellObjectType type) const { return objects[static_cast<size_t>(type)]; }
+
+    void Add(CellObjectType type, size_t index, float pt)
+    {
+        objects[static_cast<size_t>(type)].Add(index, pt);
+        ++n_total;
+    }
+
+    void Reset() { *this = Cell(); }
+
+private:
+    std::array<CellObjectAccumulator, NumberOfCellObjectTypes> objects;
+    size_t n_total{0};
+};
+
+struct CellIndex {
+    int eta, phi;
+
+    constexpr bool operator==(const CellIndex& other) const { return eta == other.eta && phi == other.phi; }
+    constexpr bool operator<(const CellIndex& other) const
+    {
+        if(eta != other.eta) return eta < other.eta;
+        return phi < other.phi;
+    }
+};
+
+namespace detail {
+
+constexpr size_t GetFlatCellIndex(const CellIndex& cellIndex, int maxEtaIndex, int maxPhiIndex)
+{
+    const unsigned shiftedEta = static_cast<unsigned>(cellIndex.eta + maxEtaIndex);
+    const unsigned shiftedPhi = static_cast<unsigned>(cellIndex.phi + maxPhiIndex);
+    return shiftedEta * static_cast<unsigned>(2 * maxPhiIndex + 1) + shiftedPhi;
+}
+
+// Order in which the cells are stored: by increasing |eta_index| + |phi_index|, then by eta_index, then by phi_index.
+template<typename Order>
+constexpr size_t FillTraversalOrder(int maxEtaIndex, int maxPhiIndex, Order& order)
+{
+    const int maxDistance = maxEtaIndex + maxPhiIndex;
+    size_t n = 0;
+    for(int distance = 0; distance <= maxDistance; ++distance) {
+        const int maxEtaDistance = maxEtaIndex < distance ? maxEtaIndex : distance;
+        for(int eta = -maxEtaDistance; eta <= maxEtaDistance; ++eta) {
+            const int maxPhiDistance = distance - (eta < 0 ? -eta : eta);
+            if(maxPhiDistance > maxPhiIndex) continue;
+            order[n++] = CellIndex{eta, -maxPhiDistance};
+            if(maxPhiDistance)
+                order[n++] = CellIndex{eta, maxPhiDistance};
+        }
+    }
+    return n;
+}
+
+template<typename Order>
+constexpr bool IsValidTraversalOrder(const Order& order, size_t nFilled, int maxEtaIndex, int maxPhiIndex)
+{
+    const size_t nTotal = static_cast<size_t>((2 * maxEtaIndex + 1) * (2 * maxPhiIndex + 1));
+    if(nFilled != nTotal) return false;
+    for(size_t n = 0; n < nTotal; ++n) {
+        for(size_t k = n + 1; k < nTotal; ++k) {
+            if(order[n] == order[k]) return false;
+        }
+    }
+    return true;
+}
+
+template<unsigned NCellsEta, unsigned NCellsPhi>
+constexpr std::array<CellIndex, NCellsEta * NCellsPhi> MakeStaticTraversalOrder()
+{
+    std::array<CellIndex, NCellsEta * NCellsPhi> order{};
+    FillTraversalOrder((NCellsEta - 1) / 2, (NCellsPhi - 1) / 2, order);
+    return order;
+}
+
+template<unsigned NCellsEta, unsigned NCellsPhi>
+constexpr std::array<size_t, NCellsEta * NCellsPhi> MakeStaticTraversalFlatIndices()
+{
+    const auto order = MakeStaticTraversalOrder<NCellsEta, NCellsPhi>();
+    std::array<size_t, NCellsEta * NCellsPhi> flatIndices{};
+    for(size_t n = 0; n < order.size(); ++n)
+        flatIndices[n] = GetFlatCellIndex(order[n], (NCellsEta - 1) / 2, (NCellsPhi - 1) / 2);
+    return flatIndices;
+}
+
+template<unsigned NCellsEta, unsigned NCellsPhi>
+constexpr bool CheckStaticTraversalOrder()
+{
+    std::array<CellIndex, NCellsEta * NCellsPhi> order{};
+    const size_t nFilled = FillTraversalOrder((NCellsEta - 1) / 2, (NCellsPhi - 1) / 2, order);
+    return IsValidTraversalOrder(order, nFilled, (NCellsEta - 1) / 2, (NCellsPhi - 1) / 2);
+}
+
+} // namespace detail
+
+// Grid geometry with the number of cells fixed at compile time. Traversal order and flat indices are constexpr tables.
+template<unsigned NCellsEta, unsigned NCellsPhi>
+class StaticCellGridLayout {
+    static_assert(NCellsEta % 2 == 1 && NCellsPhi % 2 == 1, "Number of cells should be odd.");
+
+public:
+    static constexpr int maxEtaIndex = static_cast<int>((NCellsEta - 1) / 2);
+    static constexpr int maxPhiIndex = static_cast<int>((NCellsPhi - 1) / 2);
+    static constexpr size_t nTotal = NCellsEta * NCellsPhi;
+
+    using Order = std::array<CellIndex, nTotal>;
+    using FlatIndices = std::array<size_t, nTotal>;
+    template<typename T>
+    using Storage = std::array<T, nTotal>;
+
+    static constexpr bool Matches(unsigned nCellsEta, unsigned nCellsPhi)
+    {
+        return nCellsEta == NCellsEta && nCellsPhi == NCellsPhi;
+    }
+
+    StaticCellGridLayout(unsigned nCellsEta, unsigned nCellsPhi)
+    {
+        if(!Matches(nCellsEta, nCellsPhi))
+            throw exception("Number of cells %1%x%2% doesn't match the static grid layout %3%x%4%.")
+                  % nCellsEta % nCellsPhi % NCellsEta % NCellsPhi;
+    }
+
+    static constexpr unsigned NEta() { return NCellsEta; }
+    static constexpr unsigned NPhi() { return NCellsPhi; }
+    static constexpr size_t NTotal() { return nTotal; }
+    static constexpr int MaxEtaIndex() { return maxEtaIndex; }
+    static constexpr int MaxPhiIndex() { return maxPhiIndex; }
+    static constexpr const Order& TraversalOrder() { return traversalOrder; }
+    static constexpr const FlatIndices& TraversalFlatIndices() { return traversalFlatIndices; }
+    static constexpr size_t GetFlatIndex(int eta, int phi)
+    {
+        return detail::GetFlatCellIndex(CellIndex{eta, phi}, maxEtaIndex, maxPhiIndex);
+    }
+
+    template<typename T>
+    static void InitStorage(Storage<T>& /*storage*/) {}
+
+private:
+    static_assert(detail::CheckStaticTraversalOrder<NCellsEta, NCellsPhi>(),
+                  "Invalid traversal order of the cell grid.");
+
+    static constexpr Order traversalOrder = detail::MakeStaticTraversalOrder<NCellsEta, NCellsPhi>();
+    static constexpr FlatIndices traversalFlatIndices = detail::MakeStaticTraversalFlatIndices<NCellsEta, NCellsPhi>();
+};
+
+// Grid geometry for an arbitrary number of cells. Tables are computed once at construction.
+class DynamicCellGridLayout {
+public:
+    using Order = std::vector<CellIndex>;
+    using FlatIndices = std::vector<size_t>;
+    template<typename T>
+    using Storage = std::vector<T>;
+
+    static constexpr bool Matches(unsigned /*nCellsEta*/, unsigned /*nCellsPhi*/) { return true; }
+
+    DynamicCellGridLayout(unsigned _nCellsEta, unsigned _nCellsPhi) :
+        nCellsEta(_nCellsEta), nCellsPhi(_nCellsPhi), nTotal(nCellsEta * nCellsPhi),
+        maxEtaIndex(static_cast<int>((nCellsEta - 1) / 2)), maxPhiIndex(static_cast<int>((nCellsPhi - 1) / 2)),
+        traversalOrder(nTotal), traversalFlatIndices(nTotal)
+    {
+        if(nCellsEta % 2 != 1 || nCellsEta < 1)
+            throw exception("Invalid number of eta cells.");
+        if(nCellsPhi % 2 != 1 || nCellsPhi < 1)
+            throw exception("Invalid number of phi cells.");
+        const size_t nFilled = detail::FillTraversalOrder(maxEtaIndex, maxPhiIndex, traversalOrder);
+        if(!detail::IsValidTraversalOrder(traversalOrder, nFilled, maxEtaIndex, maxPhiIndex))
+            throw exception("Invalid traversal order of the cell grid.");
+        for(size_t n = 0; n < nTotal; ++n)
+            traversalFlatIndices[n] = detail::GetFlatCellIndex(traversalOrder[n], maxEtaIndex, maxPhiIndex);
+    }
+
+    unsigned NEta() const { return nCellsEta; }
+    unsigned NPhi() const { return nCellsPhi; }
+    size_t NTotal() const { return nTotal; }
+    int MaxEtaIndex() const { return maxEtaIndex; }
+    int MaxPhiIndex() const { return maxPhiIndex; }
+    const Order& TraversalOrder() const { return traversalOrder; }
+    const FlatIndices& TraversalFlatIndices() const { return traversalFlatIndices; }
+    size_t GetFlatIndex(int eta, int phi) const
+    {
+        return detail::GetFlatCellIndex(CellIndex{eta, phi}, maxEtaIndex, maxPhiIndex);
+    }
+
+    template<typename T>
+    void InitStorage(Storage<T>& storage) const { storage.resize(nTotal); }
+
+private:
+    unsigned nCellsEta, nCellsPhi;
+    size_t nTotal;
+    int maxEtaIndex, maxPhiIndex;
+    Order traversalOrder;
+    FlatIndices traversalFlatIndices;
+};
+
+template<typename _Layout>
+class CellGrid {
+public:
+    using Layout = _Layout;
+
+    CellGrid(const Layout& _layout, double _cellSizeEta, double _cellSizePhi) :
+        layout(_layout), cellSizeEta(_cellSizeEta), cellSizePhi(_cellSizePhi),
+        maxDeltaEta(cellSizeEta * (0.5 + layout.MaxEtaIndex())), maxDeltaPhi(cellSizePhi * (0.5 + layout.MaxPhiIndex()))
+    {
+        if(cellSizeEta <= 0 || cellSizePhi <= 0)
+            throw exception("Invalid cell size.");
+        layout.InitStorage(cells);
+        filledCells.reserve(layout.NTotal());
+    }
+
+    const Layout& GetLayout() const { return layout; }
+    double MaxDeltaEta() const { return maxDeltaEta; }
+    double MaxDeltaPhi() const { return maxDeltaPhi; }
+
+    bool TryGetFlatIndex(double deltaEta, double deltaPhi, size_t& flatIndex) const
+    {
+        int etaIndex, phiIndex;
+        if(!TryGetIndex(deltaEta, maxDeltaEta, cellSizeEta, layout.MaxEtaIndex(), etaIndex)
+                || !TryGetIndex(deltaPhi, maxDeltaPhi, cellSizePhi, layout.MaxPhiIndex(), phiIndex))
+            return false;
+        flatIndex = layout.GetFlatIndex(etaIndex, phiIndex);
+        return true;
+    }
+
+    const Cell& at(size_t flatIndex) const { return cells[flatIndex]; }
+
+    void Add(size_t flatIndex, CellObjectType type, size_t index, float pt)
+    {
+        Cell& cell = cells[flatIndex];
+        if(cell.IsEmpty())
+            filledCells.push_back(flatIndex);
+        cell.Add(type, index, pt);
+    }
+
+    // Only the cells that were filled since the previous reset are cleared.
+    void Reset()
+    {
+        for(size_t flatIndex : filledCells)
+            cells[flatIndex].Reset();
+        filledCells.clear();
+    }
+
+private:
+    static bool TryGetIndex(double x, double maxX, double size, int maxIndex, int& index)
+    {
+        const double absX = std::abs(x);
+        if(absX > maxX) return false;
+        const double absIndex = std::floor(absX / size + 0.5);
+        if(absIndex > maxIndex) return false;
+        index = static_cast<int>(std::copysign(absIndex, x));
+        return true;
+    }
+
+private:
+    Layout layout;
+    double cellSizeEta, cellSizePhi, maxDeltaEta, maxDeltaPhi;
+    typename Layout::template Storage<Cell> cells;
+    std::vector<size_t> filledCells;
+};
+
+using InnerCellGridLayout = StaticCellGridLayout<11, 11>;
+using OuterCellGridLayout = StaticCellGridLayout<21, 21>;
+
+} // namespace analysis
@@ -0,0 +1,418 @@
+/*! Reduced precision encodings of the normalized training features.
+Features with a bounded normalized range are stored either as IEEE 754 half-precision floats or as 16-bit fixed-point
+values with a per-feature scale. Scales are powers of two, so 0, 1 and all other multiples of the scale inside the
+range are stored exactly.
+Flags and features with a few integer raw values can be stored exactly in one byte with the compact encoding.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include "AnalysisTools/Core/include/EnumNameMap.h"
+#include "TauML/Analysis/include/FeatureNormalization.h"
+#include "TauML/Analysis/include/NpyFile.h"
+
+namespace analysis {
+
+enum class FeatureStorage { Float = 0, Half = 1, Fixed = 2 };
+ENUM_NAMES(FeatureStorage) = {
+    { FeatureStorage::Float, "float32" }, { FeatureStorage::Half, "float16" }, { FeatureStorage::Fixed, "fixed16" }
+};
+
+struct HalfFloat {
+    uint16_t bits;
+};
+
+template<> struct NpyTypeDescr<HalfFloat> { static constexpr const char* value = "<f2"; };
+
+// Rounds to the nearest half-precision value. Values outside of the half-precision range, including infinities and
+// NaNs, are saturated to the largest finite value with the same sign.
+inline uint16_t FloatToHalf(float value)
+{
+    static constexpr uint32_t overflow_threshold = 0x477FF000u; // 65520, the first value that rounds to infinity
+    static constexpr uint32_t min_normal = 0x38800000u; // 2^-14
+    static constexpr uint32_t exponent_shift = 0x38000000u; // (127 - 15) << 23
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000u);
+    const uint32_t abs_bits = bits & 0x7FFFFFFFu;
+    if(abs_bits >= overflow_threshold)
+        return sign | 0x7BFFu;
+    if(abs_bits < min_normal) {
+        float abs_value;
+        std::memcpy(&abs_value, &abs_bits, sizeof(abs_value));
+        return sign | static_cast<uint16_t>(std::nearbyint(abs_value * 16777216.f)); // 2^24
+    }
+    const uint32_t rounded = abs_bits + 0xFFFu + ((abs_bits >> 13) & 1u);
+    return sign | static_cast<uint16_t>((rounded - exponent_shift) >> 13);
+}
+
+inline float HalfToFloat(uint16_t half)
+{
+    const uint32_t sign = static_cast<uint32_t>(half & 0x8000u) << 16;
+    const uint32_t exponent = (half >> 10) & 0x1Fu, mantissa = half & 0x3FFu;
+    if(exponent == 0) {
+        const float abs_value = static_cast<float>(mantissa) / 16777216.f; // 2^24
+        return sign ? -abs_value : abs_value;
+    }
+    const uint32_t bits = sign | (exponent == 0x1Fu ? 0x7F800000u : (exponent + 112u) << 23) | (mantissa << 13);
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Largest power of two scale, such that all values in [-bound, bound] can be stored as 16-bit fixed-point values.
+inline float FixedPointScale(float bound)
+{
+    if(!(bound > 0))
+        throw exception("Fixed-point range should be positive.");
+    return std::ldexp(1.f, -static_cast<int>(std::floor(std::log2(32767.f / bound))));
+}
+
+// Output range of the normalized feature, or zero if the output is not bounded.
+inline float NormalizedFeatureBound(const FeatureNormalization& norm)
+{
+    switch(norm.transform) {
+        case FeatureTransform::Norm:
+            return norm.max_sigma;
+        case FeatureTransform::Linear:
+        case FeatureTransform::LinearSymmetric:
+            return 1.f;
+        default:
+            return 0.f;
+    }
+}
+
+// Encodes row-major matrices of features into 16-bit values. Features with a positive scale are stored as
+// fixed-point values, features with the zero scale as half-precision floats.
+class FeatureEncoder {
+public:
+    explicit FeatureEncoder(const std::vector<float>& _scales) : scales(_scales)
+    {
+        for(float scale : scales)
+            inverseScales.push_back(scale > 0 ? 1.f / scale : 0.f);
+    }
+
+    // Scales for the given columns derived from the bounds of the normalized features.
+    static std::vector<float> GetScales(const std::vector<std::string>& columns,
+                                        const FeatureNormalizationSpec::FeatureMap& features)
+    {
+        std::vector<float> scales;
+        for(const std::string& column : columns) {
+            auto iter = features.find(column);
+            const float bound = iter != features.end() ? NormalizedFeatureBound(iter->second) : 0.f;
+            scales.push_back(bound > 0 ? FixedPointScale(bound) : 0.f);
+        }
+        return scales;
+    }
+
+    const std::vector<float>& Scales() const { return scales; }
+
+    void Encode(const float* values, size_t n_values, uint16_t* encoded) const
+    {
+        const size_t n_columns = scales.size();
+        if(!n_columns || n_values % n_columns != 0)
+            throw exception("Number of values is not compatible with the number of encoded features.");
+        for(size_t n = 0; n < n_values; ++n) {
+            const size_t column = n % n_columns;
+            encoded[n] = scales[column] > 0 ? EncodeFixed(values[n], inverseScales[column]) : FloatToHalf(values[n]);
+        }
+    }
+
+    void Decode(const uint16_t* encoded, size_t n_values, float* values) const
+    {
+        const size_t n_columns = scales.size();
+        for(size_t n = 0; n < n_values; ++n) {
+            const size_t column = n % n_columns;
+            values[n] = scales[column] > 0 ? static_cast<int16_t>(encoded[n]) * scales[column]
+                                           : HalfToFloat(encoded[n]);
+        }
+    }
+
+private:
+    static uint16_t EncodeFixed(float value, float inverse_scale)
+    {
+        const float q = std::nearbyint(value * inverse_scale);
+        return static_cast<uint16_t>(static_cast<int16_t>(std::min(std::max(q, -32767.f), 32767.f)));
+    }
+
+private:
+    std::vector<float> scales, inverseScales;
+};
+
+// Npy array with the features in the last dimension. With the float32 storage all features are stored in the array.
+// With the float16 and fixed16 storages, only the features with a bounded normalized range, i.e. with a positive
+// scale, are stored in the array with the reduced precision. Other features, e.g. weights or indices, are stored as
+// float32 in the <name>_float.npy array with the same leading dimensions.
+class DenseFeatureFile {
+public:
+    DenseFeatureFile(const std::string& file_name, const std::vector<size_t>& item_shape, FeatureStorage storage,
+                     const std::vector<float>& scales)
+    {
+        if(item_shape.empty() || item_shape.back() != scales.size())
+            throw exception("Number of feature scales is not compatible with the item shape of '%1%'.") % file_name;
+        std::vector<float> main_scales;
+        for(size_t n = 0; n < scales.size(); ++n) {
+            if(storage == FeatureStorage::Float || scales[n] > 0) {
+                mainColumns.push_back(n);
+                main_scales.push_back(storage == FeatureStorage::Fixed ? scales[n] : 0.f);
+            } else {
+                floatColumns.push_back(n);
+            }
+        }
+        if(mainColumns.empty())
+            throw exception("None of the features of '%1%' can be stored with the reduced precision.") % file_name;
+        encoder = std::make_unique<FeatureEncoder>(main_scales);
+        std::vector<size_t> shape = item_shape;
+        shape.back() = mainColumns.size();
+        if(storage == FeatureStorage::Float)
+            mainFloatFile = std::make_unique<NpyFileWriter<float>>(file_name, shape);
+        else if(storage == FeatureStorage::Half)
+            halfFile = std::make_unique<NpyFileWriter<HalfFloat>>(file_name, shape);
+        else if(storage == FeatureStorage::Fixed)
+            fixedFile = std::make_unique<NpyFileWriter<int16_t>>(file_name, shape);
+        else
+            throw exception("Unsupported feature storage '%1%'.") % storage;
+        if(!floatColumns.empty()) {
+            shape.back() = floatColumns.size();
+            floatFile = std::make_unique<NpyFileWriter<float>>(GetFloatFileName(file_name), shape);
+        }
+    }
+
+    static std::string GetFloatFileName(const std::string& file_name)
+    {
+        static const std::string suffix = ".npy";
+        const bool has_suffix = file_name.size() >= suffix.size()
+                && file_name.compare(file_name.size() - suffix.size(), suffix.size(), suffix) == 0;
+        return file_name.substr(0, file_name.size() - (has_suffix ? suffix.size() : 0)) + "_float" + suffix;
+    }
+
+    // Scales of the features stored in the main array, in the fixed16 storage.
+    const std::vector<float>& Scales() const { return encoder->Scales(); }
+    // Indices of the features stored in the float32 array.
+    const std::vector<size_t>& FloatColumns() const { return floatColumns; }
+
+    void Write(const std::vector<float>& values)
+    {
+        const size_t n_features = mainColumns.size() + floatColumns.size();
+        if(values.size() % n_features != 0)
+            throw exception("Number of values is not compatible with the number of features.");
+        if(floatColumns.empty() && mainFloatFile) {
+            mainFloatFile->Write(values);
+            return;
+        }
+        Split(values, mainColumns, mainValues);
+        if(floatFile) {
+            Split(values, floatColumns, floatValues);
+            floatFile->Write(floatValues);
+        }
+        if(mainFloatFile) {
+            mainFloatFile->Write(mainValues);
+            return;
+        }
+        encoded.resize(mainValues.size());
+        encoder->Encode(mainValues.data(), mainValues.size(), encoded.data());
+        const size_t item_size = halfFile ? halfFile->ItemSize() : fixedFile->ItemSize();
+        if(item_size == 0 || encoded.size() % item_size != 0)
+            throw exception("Size of the data is not compatible with the item shape.");
+        if(halfFile)
+            halfFile->Write(reinterpret_cast<const HalfFloat*>(encoded.data()), encoded.size() / item_size);
+        else
+            fixedFile->Write(reinterpret_cast<const int16_t*>(encoded.data()), encoded.size() / item_size);
+    }
+
+    void Close()
+    {
+        if(mainFloatFile) mainFloatFile->Close();
+        if(halfFile) halfFile->Close();
+        if(fixedFile) fixedFile->Close();
+        if(floatFile) floatFile->Close();
+    }
+
+private:
+    void Split(const std::vector<float>& values, const std::vector<size_t>& columns, std::vector<float>& output) const
+    {
+        const size_t n_features = mainColumns.size() + floatColumns.size(), n_rows = values.size() / n_features;
+        output.resize(n_rows * columns.size());
+        for(size_t row = 0; row < n_rows; ++row) {
+            for(size_t n = 0; n < columns.size(); ++n)
+                output[row * columns.size() + n] = values[row * n_features + columns[n]];
+        }
+    }
+
+private:
+    std::vector<size_t> mainColumns, floatColumns;
+    std::unique_ptr<FeatureEncoder> encoder;
+    std::unique_ptr<NpyFileWriter<float>> mainFloatFile, floatFile;
+    std::unique_ptr<NpyFileWriter<HalfFloat>> halfFile;
+    std::unique_ptr<NpyFileWriter<int16_t>> fixedFile;
+    std::vector<float> mainValues, floatValues;
+    std::vector<uint16_t> encoded;
+};
+
+// Compact encoding of the flags and of the small integer features of a row, one byte per flag group or feature.
+// Bit n of the byte of a flag group is set if the n-th flag of the group is non-zero. An integer feature with raw
+// values in [min_value, max_value] is stored as a code: code 0 is the zero value, code c > 0 is the output of the
+// normalization for the raw value min_value + c - 1. Values beyond the range of the table saturate to the code of the
+// closest end of the range. The decoding tables are part of the layout description, so the decoding does not depend on
+// the normalization configuration.
+template<typename Row>
+class CompactFeatureEncoder {
+public:
+    using FlagGroup = std::vector<std::string>;
+
+    struct CodedFeature {
+        std::string name;
+        int min_value, max_value;
+    };
+
+    CompactFeatureEncoder(const FeatureColumns<Row>& columns, const FeatureNormalizationSpec::FeatureMap& features,
+                          const std::vector<FlagGroup>& flag_groups, const std::vector<CodedFeature>& coded_features)
+    {
+        for(const FlagGroup& group : flag_groups) {
+            if(group.empty() || group.size() > 8)
+                throw exception("Group of compact flags should have from 1 to 8 flags.");
+            flagGroups.emplace_back();
+            for(const std::string& name : group)
+                flagGroups.back().push_back(Flag{ name, columns.Get(name) });
+        }
+        for(const CodedFeature& feature : coded_features) {
+            if(feature.max_value < feature.min_value || feature.max_value - feature.min_value >= 255)
+                throw exception("Invalid range of the compact feature '%1%'.") % feature.name;
+            Code code;
+            code.name = feature.name;
+            code.column = columns.Get(feature.name);
+            code.values.push_back(0.f);
+            for(int raw_value = feature.min_value; raw_value <= feature.max_value; ++raw_value)
+                code.values.push_back(static_cast<float>(raw_value));
+            auto iter = features.find(feature.name);
+            if(iter != features.end())
+                NormalizeFeatureColumn(iter->second.GetCoefficients(), code.values.data() + 1, code.values.size() - 1);
+            // Iterating backwards, so that the smallest code is used for the values that are produced several times.
+            for(size_t c = code.values.size(); c-- > 0;)
+                code.codes[ValueBits(code.values[c])] = static_cast<uint8_t>(c);
+            const auto low = std::min_element(code.values.begin() + 1, code.values.end());
+            const auto high = std::max_element(code.values.begin() + 1, code.values.end());
+            code.lowCode = code.codes.at(ValueBits(*low));
+            code.highCode = code.codes.at(ValueBits(*high));
+            codedFeatures.push_back(code);
+        }
+    }
+
+    size_t NumberOfBytes() const { return flagGroups.size() + codedFeatures.size(); }
+
+    std::vector<std::string> FeatureNames() const
+    {
+        std::vector<std::string> names;
+        for(const auto& group : flagGroups) {
+            for(const Flag& flag : group)
+                names.push_back(flag.name);
+        }
+        for(const Code& code : codedFeatures)
+            names.push_back(code.name);
+        return names;
+    }
+
+    // Encodes the rows into the row-major matrix with NumberOfBytes() columns.
+    void Encode(const Row* rows, size_t n_rows, std::vector<float>& workspace, uint8_t* encoded) const
+    {
+        const size_t n_bytes = NumberOfBytes();
+        workspace.resize(n_rows);
+        float* values = workspace.data();
+        for(size_t g = 0; g < flagGroups.size(); ++g) {
+            for(size_t i = 0; i < n_rows; ++i)
+                encoded[i * n_bytes + g] = 0;
+            for(size_t bit = 0; bit < flagGroups[g].size(); ++bit) {
+                const Flag& flag = flagGroups[g][bit];
+                flag.column->Gather(rows, n_rows, values);
+                for(size_t i = 0; i < n_rows; ++i) {
+                    if(values[i] != 0.f && values[i] != 1.f)
+                        throw exception("Value %1% of the flag '%2%' can not be stored in the compact form.")
+                              % values[i] % flag.name;
+                    encoded[i * n_bytes + g] |= static_cast<uint8_t>(values[i] != 0.f) << bit;
+                }
+            }
+        }
+        for(size_t n = 0; n < codedFeatures.size(); ++n) {
+            const Code& code = codedFeatures[n];
+            const size_t index = flagGroups.size() + n;
+            code.column->Gather(rows, n_rows, values);
+            for(size_t i = 0; i < n_rows; ++i) {
+                if(values[i] == 0.f) {
+                    encoded[i * n_bytes + index] = 0;
+                    continue;
+                }
+                auto iter = code.codes.find(ValueBits(values[i]));
+                if(iter != code.codes.end())
+                    encoded[i * n_bytes + index] = iter->second;
+                else if(values[i] > code.values[code.highCode])
+                    encoded[i * n_bytes + index] = code.highCode;
+                else if(values[i] < code.values[code.lowCode])
+                    encoded[i * n_bytes + index] = code.lowCode;
+                else
+                    throw exception("Value %1% of the feature '%2%' can not be stored in the compact form.")
+                          % values[i] % code.name;
+            }
+        }
+    }
+
+    // JSON description of the flag groups and of the decoding tables.
+    std::string Describe() const
+    {
+        std::ostringstream ss;
+        ss << std::setprecision(9) << "{ \"n_bytes\": " << NumberOfBytes() << ", \"flags\": [";
+        for(size_t g = 0; g < flagGroups.size(); ++g) {
+            ss << (g ? ", " : "") << "[";
+            for(size_t n = 0; n < flagGroups[g].size(); ++n)
+                ss << (n ? ", " : "") << "\"" << flagGroups[g][n].name << "\"";
+            ss << "]";
+        }
+        ss << "], \"codes\": [";
+        for(size_t n = 0; n < codedFeatures.size(); ++n) {
+            const Code& code = codedFeatures[n];
+            ss << (n ? ", " : "") << "{ \"name\": \"" << code.name << "\", \"values\": [";
+            for(size_t c = 0; c < code.values.size(); ++c)
+                ss << (c ? ", " : "") << code.values[c];
+            ss << "] }";
+        }
+        ss << "] }";
+        return ss.str();
+    }
+
+private:
+    using ColumnPtr = std::shared_ptr<const FeatureColumn<Row>>;
+
+    struct Flag {
+        std::string name;
+        ColumnPtr column;
+    };
+
+    struct Code {
+        std::string name;
+        ColumnPtr column;
+        std::vector<float> values;
+        std::unordered_map<uint32_t, uint8_t> codes;
+        uint8_t lowCode, highCode;
+    };
+
+    static uint32_t ValueBits(float value)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+private:
+    std::vector<std::vector<Flag>> flagGroups;
+    std::vector<Code> codedFeatures;
+};
+
+} // namespace analysis
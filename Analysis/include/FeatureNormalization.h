@@ -0,0 +1,306 @@
+/*! Table-driven normalization of the training inputs.
+The normalization is defined in a configuration file, where each item has the form
+    <scope>.<feature>: transform=<value|norm|linear|linear_symmetric> [parameters] [valid=<gate feature>]
+The parameters are mean, sigma and max_sigma (default: 5) for norm, and min, max for linear transforms. For linear
+transforms, fit_range=true marks the range as measured from the data rather than fixed by design.
+Non-normal input values are replaced by zero before the transformation. If a gate feature is specified, the output
+is set to zero for all rows where the gate has a non-positive value before the normalization.
+*/
+
+#pragma once
+
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include "AnalysisTools/Core/include/PropertyConfigReader.h"
+#include "AnalysisTools/Core/include/EnumNameMap.h"
+
+namespace analysis {
+
+enum class FeatureTransform { Value = 0, Norm = 1, Linear = 2, LinearSymmetric = 3 };
+ENUM_NAMES(FeatureTransform) = {
+    { FeatureTransform::Value, "value" }, { FeatureTransform::Norm, "norm" },
+    { FeatureTransform::Linear, "linear" }, { FeatureTransform::LinearSymmetric, "linear_symmetric" }
+};
+
+// All transforms are expressed as y = clamp((clamp(x, in_min, in_max) - shift) / scale, out_min, out_max)
+//                                         * post_factor - post_shift
+struct FeatureTransformCoefficients {
+    float in_min, in_max, shift, scale, out_min, out_max, post_factor, post_shift;
+};
+
+struct FeatureNormalization {
+    FeatureTransform transform{FeatureTransform::Value};
+    float mean{0.f}, sigma{1.f}, max_sigma{5.f}, min_value{0.f}, max_value{1.f};
+    bool fit_range{false};
+    std::string gate;
+
+    FeatureTransformCoefficients GetCoefficients() const
+    {
+        static constexpr float inf = std::numeric_limits<float>::infinity();
+        switch(transform) {
+            case FeatureTransform::Value:
+                return { -inf, inf, 0.f, 1.f, -inf, inf, 1.f, 0.f };
+            case FeatureTransform::Norm:
+                return { -inf, inf, mean, sigma, -max_sigma, max_sigma, 1.f, 0.f };
+            case FeatureTransform::Linear:
+                return { min_value, max_value, min_value, max_value - min_value, -inf, inf, 1.f, 0.f };
+            case FeatureTransform::LinearSymmetric:
+                return { min_value, max_value, min_value, max_value - min_value, -inf, inf, 2.f, 1.f };
+        }
+        throw exception("Unknown feature transform.");
+    }
+};
+
+class FeatureNormalizationSpec {
+public:
+    using FeatureMap = std::map<std::string, FeatureNormalization>;
+
+    explicit FeatureNormalizationSpec(const std::string& cfg_file_name)
+    {
+        PropertyConfigReader reader;
+        reader.Parse(cfg_file_name);
+        for(const auto& item_entry : reader.GetItems()) {
+            const auto& item = item_entry.second;
+            const size_t split_pos = item.name.find('.');
+            if(split_pos == std::string::npos || split_pos == 0 || split_pos + 1 == item.name.size())
+                throw exception("Invalid feature name '%1%' in '%2%'. Expected <scope>.<feature>.")
+                      % item.name % cfg_file_name;
+            const std::string scope = item.name.substr(0, split_pos), feature = item.name.substr(split_pos + 1);
+            scopes[scope][feature] = ParseItem(item);
+        }
+    }
+
+    // Features of the scope. Features of the fallback scope are included, if they are not defined in the scope.
+    FeatureMap GetFeatures(const std::string& scope, const std::string& fallback_scope = "") const
+    {
+        FeatureMap features;
+        auto iter = scopes.find(scope);
+        if(iter != scopes.end())
+            features = iter->second;
+        if(!fallback_scope.empty()) {
+            auto fallback_iter = scopes.find(fallback_scope);
+            if(fallback_iter != scopes.end())
+                features.insert(fallback_iter->second.begin(), fallback_iter->second.end());
+        }
+        return features;
+    }
+
+    // Features with the value transform and the same gates. Applying them only replaces non-normal values and
+    // values of invalid objects by zero, so that the normalization itself can be applied later.
+    static FeatureMap GetRawFeatures(const FeatureMap& features)
+    {
+        FeatureMap raw_features;
+        for(const auto& feature : features) {
+            FeatureNormalization& norm = raw_features[feature.first];
+            norm.gate = feature.second.gate;
+        }
+        return raw_features;
+    }
+
+private:
+    static FeatureNormalization ParseItem(const PropertyConfigReader::Item& item)
+    {
+        FeatureNormalization norm;
+        norm.transform = item.Get<FeatureTransform>("transform");
+        if(norm.transform == FeatureTransform::Norm) {
+            norm.mean = item.Get<float>("mean");
+            norm.sigma = item.Get<float>("sigma");
+            if(item.Has("max_sigma"))
+                norm.max_sigma = item.Get<float>("max_sigma");
+            if(!(norm.sigma > 0) || !(norm.max_sigma > 0))
+                throw exception("Invalid normalization parameters for '%1%'.") % item.name;
+        } else if(norm.transform == FeatureTransform::Linear || norm.transform == FeatureTransform::LinearSymmetric) {
+            norm.min_value = item.Get<float>("min");
+            norm.max_value = item.Get<float>("max");
+            if(!(norm.max_value > norm.min_value))
+                throw exception("Invalid range for '%1%'.") % item.name;
+            if(item.Has("fit_range"))
+                norm.fit_range = item.Get<bool>("fit_range");
+        }
+        if(item.Has("valid"))
+            norm.gate = item.Get<std::string>("valid");
+        return norm;
+    }
+
+private:
+    std::map<std::string, FeatureMap> scopes;
+};
+
+// Transforms n contiguous values in place. The loop body has no branches, so that the compiler can vectorize it.
+inline void NormalizeFeatureColumn(const FeatureTransformCoefficients& c, float* values, size_t n)
+{
+    static constexpr uint32_t exponent_mask = 0x7F800000u;
+    for(size_t i = 0; i < n; ++i) {
+        uint32_t bits;
+        std::memcpy(&bits, values + i, sizeof(bits));
+        const uint32_t exponent = bits & exponent_mask;
+        const bool is_normal = exponent != 0u && exponent != exponent_mask;
+        float y = is_normal ? values[i] : 0.f;
+        y = std::min(std::max(y, c.in_min), c.in_max);
+        y = (y - c.shift) / c.scale;
+        y = std::min(std::max(y, c.out_min), c.out_max);
+        values[i] = y * c.post_factor - c.post_shift;
+    }
+}
+
+inline void ApplyFeatureGate(const float* gate, float* values, size_t n)
+{
+    for(size_t i = 0; i < n; ++i)
+        values[i] = gate[i] > 0.f ? values[i] : 0.f;
+}
+
+// Access to a member of the row structure as a column of float values.
+template<typename Row>
+class FeatureColumn {
+public:
+    virtual ~FeatureColumn() {}
+    virtual bool IsWritable() const = 0;
+    virtual void Gather(const Row* rows, size_t n, float* values) const = 0;
+    virtual void Scatter(const float* values, size_t n, Row* rows) const = 0;
+};
+
+template<typename Row, typename T>
+class MemberFeatureColumn : public FeatureColumn<Row> {
+public:
+    explicit MemberFeatureColumn(T Row::* _member) : member(_member) {}
+
+    bool IsWritable() const override { return std::is_same<T, float>::value; }
+
+    void Gather(const Row* rows, size_t n, float* values) const override
+    {
+        for(size_t i = 0; i < n; ++i)
+            values[i] = static_cast<float>(rows[i].*member);
+    }
+
+    void Scatter(const float* values, size_t n, Row* rows) const override
+    {
+        if(!IsWritable())
+            throw exception("Feature column is not writable.");
+        for(size_t i = 0; i < n; ++i)
+            rows[i].*member = static_cast<T>(values[i]);
+    }
+
+private:
+    T Row::* member;
+};
+
+// All arithmetic members of the row structure, in the order of declaration.
+template<typename Row>
+class FeatureColumns {
+public:
+    using ColumnPtr = std::shared_ptr<const FeatureColumn<Row>>;
+
+    template<typename T>
+    void Add(const std::string& name, T Row::* member)
+    {
+        if constexpr(std::is_arithmetic<T>::value) {
+            columns[name] = std::make_shared<MemberFeatureColumn<Row, T>>(member);
+            names.push_back(name);
+        }
+    }
+
+    bool Has(const std::string& name) const { return columns.count(name); }
+
+    const ColumnPtr& Get(const std::string& name) const
+    {
+        auto iter = columns.find(name);
+        if(iter == columns.end())
+            throw exception("Unknown feature '%1%'.") % name;
+        return iter->second;
+    }
+
+    const std::vector<std::string>& Names() const { return names; }
+
+private:
+    std::map<std::string, ColumnPtr> columns;
+    std::vector<std::string> names;
+};
+
+// Buffers that can be reused between batches.
+struct FeatureNormalizationWorkspace {
+    std::vector<float> values, gates;
+};
+
+// Normalizes a batch of rows column by column. Gates are read before any column is modified.
+template<typename Row>
+class FeatureNormalizer {
+public:
+    using Workspace = FeatureNormalizationWorkspace;
+
+    FeatureNormalizer(const FeatureNormalizationSpec::FeatureMap& features, const FeatureColumns<Row>& columns)
+    {
+        std::map<std::string, size_t> gate_indices;
+        for(const auto& feature : features) {
+            Entry entry;
+            entry.column = columns.Get(feature.first);
+            if(!entry.column->IsWritable())
+                throw exception("Feature '%1%' can not be normalized, because it is not stored as float.")
+                      % feature.first;
+            entry.coefficients = feature.second.GetCoefficients();
+            entry.gate_index = no_gate;
+            const std::string& gate = feature.second.gate;
+            if(!gate.empty()) {
+                if(!gate_indices.count(gate)) {
+                    gate_indices[gate] = gateColumns.size();
+                    gateColumns.push_back(columns.Get(gate));
+                }
+                entry.gate_index = gate_indices.at(gate);
+            }
+            entries.push_back(entry);
+        }
+    }
+
+    void Apply(Row* rows, size_t n_rows, Workspace& workspace) const
+    {
+        if(!n_rows) return;
+        workspace.values.resize(n_rows);
+        workspace.gates.resize(gateColumns.size() * n_rows);
+        for(size_t n = 0; n < gateColumns.size(); ++n)
+            gateColumns[n]->Gather(rows, n_rows, workspace.gates.data() + n * n_rows);
+        float* values = workspace.values.data();
+        for(const Entry& entry : entries) {
+            entry.column->Gather(rows, n_rows, values);
+            NormalizeFeatureColumn(entry.coefficients, values, n_rows);
+            if(entry.gate_index != no_gate)
+                ApplyFeatureGate(workspace.gates.data() + entry.gate_index * n_rows, values, n_rows);
+            entry.column->Scatter(values, n_rows, rows);
+        }
+    }
+
+    void Apply(std::vector<Row>& rows, Workspace& workspace) const { Apply(rows.data(), rows.size(), workspace); }
+
+private:
+    using ColumnPtr = std::shared_ptr<const FeatureColumn<Row>>;
+    static constexpr size_t no_gate = std::numeric_limits<size_t>::max();
+
+    struct Entry {
+        ColumnPtr column;
+        FeatureTransformCoefficients coefficients;
+        size_t gate_index;
+    };
+
+private:
+    std::vector<Entry> entries;
+    std::vector<ColumnPtr> gateColumns;
+};
+
+} // namespace analysis
+
+#define ADD_FEATURE_COLUMN(name) columns.Add(#name, &ColumnDataClass::name);
+#define DECLARE_FEATURE_COLUMNS(ns, DataClass, DATA) \
+    namespace ns { \
+    inline const ::analysis::FeatureColumns<DataClass>& Get##DataClass##Columns() \
+    { \
+        static const ::analysis::FeatureColumns<DataClass> all_columns = [] { \
+            using ColumnDataClass = DataClass; \
+            ::analysis::FeatureColumns<DataClass> columns; \
+            DATA() \
+            return columns; \
+        }(); \
+        return all_columns; \
+    } \
+    } \
+    /**/
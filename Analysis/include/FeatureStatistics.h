@@ -0,0 +1,258 @@
+/*! Streaming statistics of the training inputs that are used to derive the normalization constants.
+All accumulators can be filled independently in several threads and merged afterwards.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include "TauML/Analysis/include/FeatureNormalization.h"
+
+namespace analysis {
+
+// Mean and variance computed with the Welford algorithm. Two accumulators are merged using the parallel
+// formulation of Chan et al.
+class RunningMoments {
+public:
+    void Add(double x)
+    {
+        ++n;
+        const double delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+    }
+
+    void Merge(const RunningMoments& other)
+    {
+        if(!other.n) return;
+        const double n_total = static_cast<double>(n + other.n);
+        const double delta = other.mean - mean;
+        mean += delta * other.n / n_total;
+        m2 += other.m2 + delta * delta * n * other.n / n_total;
+        n += other.n;
+    }
+
+    uint64_t Count() const { return n; }
+    double Mean() const { return mean; }
+    double Variance() const { return n > 1 ? m2 / (n - 1) : 0.; }
+    double StdDev() const { return std::sqrt(Variance()); }
+
+private:
+    uint64_t n{0};
+    double mean{0.}, m2{0.};
+};
+
+// Quantile sketch with relative accuracy: values are counted in logarithmic buckets with bounds gamma^(i-1) and
+// gamma^i, where gamma = (1 + accuracy) / (1 - accuracy). Merging is an addition of the bucket counts.
+// Values with the absolute value below min_value are counted as zeros, values above max_value are clamped.
+class QuantileSketch {
+public:
+    static constexpr double accuracy = 0.01, min_value = 1e-9, max_value = 1e12;
+
+    QuantileSketch() : positive(NumberOfBuckets(), 0), negative(NumberOfBuckets(), 0) {}
+
+    void Add(double x)
+    {
+        const double abs_x = std::abs(x);
+        if(abs_x < min_value) {
+            ++n_zeros;
+        } else if(x > 0) {
+            ++positive.at(BucketIndex(abs_x));
+        } else {
+            ++negative.at(BucketIndex(abs_x));
+        }
+        ++n;
+    }
+
+    void Merge(const QuantileSketch& other)
+    {
+        for(size_t i = 0; i < positive.size(); ++i) {
+            positive[i] += other.positive[i];
+            negative[i] += other.negative[i];
+        }
+        n_zeros += other.n_zeros;
+        n += other.n;
+    }
+
+    uint64_t Count() const { return n; }
+
+    double Quantile(double q) const
+    {
+        if(!n)
+            throw exception("Quantile of an empty sketch is not defined.");
+        const double rank = std::clamp(q, 0., 1.) * (n - 1);
+        uint64_t cumulative = 0;
+        for(size_t i = negative.size(); i > 0; --i) {
+            cumulative += negative[i - 1];
+            if(cumulative > rank)
+                return -BucketValue(i - 1);
+        }
+        cumulative += n_zeros;
+        if(cumulative > rank)
+            return 0.;
+        for(size_t i = 0; i < positive.size(); ++i) {
+            cumulative += positive[i];
+            if(cumulative > rank)
+                return BucketValue(i);
+        }
+        return BucketValue(positive.size() - 1);
+    }
+
+private:
+    static double Gamma() { return (1 + accuracy) / (1 - accuracy); }
+    static int MinIndex() { return static_cast<int>(std::ceil(std::log(min_value) / std::log(Gamma()))); }
+    static int MaxIndex() { return static_cast<int>(std::ceil(std::log(max_value) / std::log(Gamma()))); }
+    static size_t NumberOfBuckets() { return static_cast<size_t>(MaxIndex() - MinIndex() + 1); }
+
+    static size_t BucketIndex(double abs_x)
+    {
+        static const double log_gamma = std::log(Gamma());
+        static const int min_index = MinIndex(), max_index = MaxIndex();
+        const int index = static_cast<int>(std::ceil(std::log(abs_x) / log_gamma));
+        return static_cast<size_t>(std::clamp(index, min_index, max_index) - min_index);
+    }
+
+    // Value with the relative error below the accuracy for all values inside the bucket.
+    static double BucketValue(size_t bucket)
+    {
+        const int index = static_cast<int>(bucket) + MinIndex();
+        return 2 * std::pow(Gamma(), index) / (Gamma() + 1);
+    }
+
+private:
+    std::vector<uint64_t> positive, negative;
+    uint64_t n_zeros{0}, n{0};
+};
+
+struct FeatureStatistics {
+    RunningMoments moments;
+    QuantileSketch sketch;
+    uint64_t n_non_finite{0};
+
+    void Add(float x)
+    {
+        if(!std::isfinite(x)) {
+            ++n_non_finite;
+            return;
+        }
+        moments.Add(x);
+        sketch.Add(x);
+    }
+
+    void Merge(const FeatureStatistics& other)
+    {
+        moments.Merge(other.moments);
+        sketch.Merge(other.sketch);
+        n_non_finite += other.n_non_finite;
+    }
+};
+
+// Statistics of the raw features listed in the normalization spec. Rows for which the gate of a feature is not
+// positive are not included in the statistics of that feature.
+template<typename Row>
+class FeatureStatisticsCollector {
+public:
+    using FeatureMap = FeatureNormalizationSpec::FeatureMap;
+
+    FeatureStatisticsCollector(const FeatureMap& _features, const FeatureColumns<Row>& columns) :
+        features(_features)
+    {
+        for(const auto& feature : features) {
+            columnEntries.push_back(columns.Get(feature.first));
+            gateEntries.push_back(feature.second.gate.empty() ? nullptr : columns.Get(feature.second.gate));
+        }
+        statistics.resize(features.size());
+    }
+
+    void Fill(const Row* rows, size_t n_rows, FeatureNormalizationWorkspace& workspace)
+    {
+        if(!n_rows) return;
+        workspace.values.resize(n_rows);
+        workspace.gates.resize(n_rows);
+        for(size_t n = 0; n < columnEntries.size(); ++n) {
+            columnEntries[n]->Gather(rows, n_rows, workspace.values.data());
+            if(gateEntries[n])
+                gateEntries[n]->Gather(rows, n_rows, workspace.gates.data());
+            FeatureStatistics& stat = statistics[n];
+            for(size_t i = 0; i < n_rows; ++i) {
+                if(!gateEntries[n] || workspace.gates[i] > 0.f)
+                    stat.Add(workspace.values[i]);
+            }
+        }
+    }
+
+    void Fill(const std::vector<Row>& rows, FeatureNormalizationWorkspace& workspace)
+    {
+        Fill(rows.data(), rows.size(), workspace);
+    }
+
+    void Merge(const FeatureStatisticsCollector& other)
+    {
+        if(other.statistics.size() != statistics.size())
+            throw exception("Unable to merge statistics of different features.");
+        for(size_t n = 0; n < statistics.size(); ++n)
+            statistics[n].Merge(other.statistics[n]);
+    }
+
+    // Writes the normalization of all features in the format of FeatureNormalizationSpec. The transform and the gate
+    // of each feature are taken from the input spec. For norm transforms, the mean and sigma are replaced by the
+    // measured values. For linear transforms with fit_range, the range is set to the [q, 1 - q] quantiles of the
+    // measured values, and for linear_symmetric to the symmetric range that contains both quantiles. Ranges without
+    // fit_range are fixed by design and are kept, as well as parameters of features with not enough statistics.
+    void WriteNormalization(std::ostream& os, const std::string& scope, double q) const
+    {
+        const auto precision = os.precision(7);
+        size_t n = 0;
+        for(const auto& feature : features) {
+            FeatureNormalization norm = feature.second;
+            const FeatureStatistics& stat = statistics.at(n++);
+            const std::string name = scope + "." + feature.first;
+            if(norm.transform == FeatureTransform::Norm) {
+                if(stat.moments.Count() > 1 && stat.moments.StdDev() > 0) {
+                    norm.mean = static_cast<float>(stat.moments.Mean());
+                    norm.sigma = static_cast<float>(stat.moments.StdDev());
+                } else {
+                    std::cerr << "WARNING: not enough statistics to compute mean and sigma of '" << name
+                              << "'. The input values are used." << std::endl;
+                }
+            } else if(norm.fit_range) {
+                double min_value = stat.sketch.Count() ? stat.sketch.Quantile(q) : 0.;
+                double max_value = stat.sketch.Count() ? stat.sketch.Quantile(1 - q) : 0.;
+                if(norm.transform == FeatureTransform::LinearSymmetric) {
+                    max_value = std::max(std::abs(min_value), std::abs(max_value));
+                    min_value = -max_value;
+                }
+                if(max_value > min_value) {
+                    norm.min_value = static_cast<float>(min_value);
+                    norm.max_value = static_cast<float>(max_value);
+                } else {
+                    std::cerr << "WARNING: not enough statistics to compute the range of '" << name
+                              << "'. The input values are used." << std::endl;
+                }
+            }
+            os << name << ": transform=" << norm.transform;
+            if(norm.transform == FeatureTransform::Norm) {
+                os << " mean=" << norm.mean << " sigma=" << norm.sigma;
+                if(norm.max_sigma != FeatureNormalization().max_sigma)
+                    os << " max_sigma=" << norm.max_sigma;
+            } else if(norm.transform != FeatureTransform::Value) {
+                os << " min=" << norm.min_value << " max=" << norm.max_value;
+                if(norm.fit_range)
+                    os << " fit_range=true";
+            }
+            if(!norm.gate.empty())
+                os << " valid=" << norm.gate;
+            os << "\n";
+        }
+        os.precision(precision);
+    }
+
+private:
+    FeatureMap features;
+    std::vector<std::shared_ptr<const FeatureColumn<Row>>> columnEntries, gateEntries;
+    std::vector<FeatureStatistics> statistics;
+};
+
+} // namespace analysis
@@ -0,0 +1,165 @@
+/*! Batch kinematic kernels over contiguous float arrays.
+The AVX-512 or AVX2 implementation is selected at compile time from the target instruction set, otherwise the scalar
+implementation is used. The default build targets the baseline instruction set, the vector implementations are
+enabled by the TAUML_SIMD_FLAGS option of cmake, e.g. "-mavx2 -mfma". Vector implementations process the tails with
+masked loads, so all elements of an array are computed by the same code. Delta phi and the cone selection are
+identical in all implementations. Delta R^2 can differ in the last bit between builds, if the compiler contracts it
+into a fused multiply-add.
+*/
+
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace analysis {
+namespace kinematics {
+
+constexpr float pi = 3.14159265358979323846f;
+constexpr float two_pi = 2 * pi;
+
+// phi1 - phi2 moved into (-pi, pi], for the angles in [-pi, pi].
+inline float DeltaPhi(float phi1, float phi2)
+{
+    float dphi = phi1 - phi2;
+    if(dphi > pi)
+        dphi -= two_pi;
+    else if(dphi <= -pi)
+        dphi += two_pi;
+    return dphi;
+}
+
+namespace detail {
+
+#if defined(__AVX512F__)
+
+constexpr size_t width = 16;
+
+inline __mmask16 TailMask(size_t n) { return n >= width ? __mmask16(0xFFFF) : __mmask16((1u << n) - 1u); }
+
+inline __m512 DeltaPhi(__m512 phi, __m512 ref_phi)
+{
+    const __m512 dphi = _mm512_sub_ps(phi, ref_phi);
+    const __mmask16 above = _mm512_cmp_ps_mask(dphi, _mm512_set1_ps(pi), _CMP_GT_OQ);
+    const __mmask16 below = _mm512_cmp_ps_mask(dphi, _mm512_set1_ps(-pi), _CMP_LE_OQ);
+    const __m512 shifted = _mm512_mask_sub_ps(dphi, above, dphi, _mm512_set1_ps(two_pi));
+    return _mm512_mask_add_ps(shifted, below, dphi, _mm512_set1_ps(two_pi));
+}
+
+#elif defined(__AVX2__)
+
+constexpr size_t width = 8;
+
+inline __m256i TailMask(size_t n)
+{
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    return _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(n < width ? n : width)), lanes);
+}
+
+inline __m256 DeltaPhi(__m256 phi, __m256 ref_phi)
+{
+    const __m256 dphi = _mm256_sub_ps(phi, ref_phi);
+    const __m256 above = _mm256_cmp_ps(dphi, _mm256_set1_ps(pi), _CMP_GT_OQ);
+    const __m256 below = _mm256_cmp_ps(dphi, _mm256_set1_ps(-pi), _CMP_LE_OQ);
+    const __m256 shifted = _mm256_blendv_ps(dphi, _mm256_sub_ps(dphi, _mm256_set1_ps(two_pi)), above);
+    return _mm256_blendv_ps(shifted, _mm256_add_ps(dphi, _mm256_set1_ps(two_pi)), below);
+}
+
+#endif
+
+} // namespace detail
+
+// dphi[i] = DeltaPhi(phi[i], ref_phi)
+inline void DeltaPhi(const float* phi, size_t n, float ref_phi, float* dphi)
+{
+#if defined(__AVX512F__)
+    const __m512 ref = _mm512_set1_ps(ref_phi);
+    for(size_t i = 0; i < n; i += detail::width) {
+        const __mmask16 mask = detail::TailMask(n - i);
+        _mm512_mask_storeu_ps(dphi + i, mask, detail::DeltaPhi(_mm512_maskz_loadu_ps(mask, phi + i), ref));
+    }
+#elif defined(__AVX2__)
+    const __m256 ref = _mm256_set1_ps(ref_phi);
+    for(size_t i = 0; i < n; i += detail::width) {
+        const __m256i mask = detail::TailMask(n - i);
+        _mm256_maskstore_ps(dphi + i, mask, detail::DeltaPhi(_mm256_maskload_ps(phi + i, mask), ref));
+    }
+#else
+    for(size_t i = 0; i < n; ++i)
+        dphi[i] = DeltaPhi(phi[i], ref_phi);
+#endif
+}
+
+// Positions relative to the reference direction: deta, dphi and dR2 = deta^2 + dphi^2.
+inline void DeltaR2(const float* eta, const float* phi, size_t n, float ref_eta, float ref_phi, float* deta,
+                    float* dphi, float* dR2)
+{
+#if defined(__AVX512F__)
+    const __m512 ref_eta_v = _mm512_set1_ps(ref_eta), ref_phi_v = _mm512_set1_ps(ref_phi);
+    for(size_t i = 0; i < n; i += detail::width) {
+        const __mmask16 mask = detail::TailMask(n - i);
+        const __m512 de = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, eta + i), ref_eta_v);
+        const __m512 dp = detail::DeltaPhi(_mm512_maskz_loadu_ps(mask, phi + i), ref_phi_v);
+        _mm512_mask_storeu_ps(deta + i, mask, de);
+        _mm512_mask_storeu_ps(dphi + i, mask, dp);
+        _mm512_mask_storeu_ps(dR2 + i, mask, _mm512_add_ps(_mm512_mul_ps(de, de), _mm512_mul_ps(dp, dp)));
+    }
+#elif defined(__AVX2__)
+    const __m256 ref_eta_v = _mm256_set1_ps(ref_eta), ref_phi_v = _mm256_set1_ps(ref_phi);
+    for(size_t i = 0; i < n; i += detail::width) {
+        const __m256i mask = detail::TailMask(n - i);
+        const __m256 de = _mm256_sub_ps(_mm256_maskload_ps(eta + i, mask), ref_eta_v);
+        const __m256 dp = detail::DeltaPhi(_mm256_maskload_ps(phi + i, mask), ref_phi_v);
+        _mm256_maskstore_ps(deta + i, mask, de);
+        _mm256_maskstore_ps(dphi + i, mask, dp);
+        _mm256_maskstore_ps(dR2 + i, mask, _mm256_add_ps(_mm256_mul_ps(de, de), _mm256_mul_ps(dp, dp)));
+    }
+#else
+    for(size_t i = 0; i < n; ++i) {
+        deta[i] = eta[i] - ref_eta;
+        dphi[i] = DeltaPhi(phi[i], ref_phi);
+        dR2[i] = deta[i] * deta[i] + dphi[i] * dphi[i];
+    }
+#endif
+}
+
+// Indices of the elements that are not outside of the cone, i.e. !(dR2[i] >= max_dR2), in increasing order.
+// indices should have space for n elements. Returns the number of selected elements.
+inline size_t ConeIndices(const float* dR2, size_t n, float max_dR2, uint32_t* indices)
+{
+    size_t n_selected = 0;
+#if defined(__AVX512F__)
+    const __m512 max_v = _mm512_set1_ps(max_dR2);
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    for(size_t i = 0; i < n; i += detail::width) {
+        const __mmask16 tail = detail::TailMask(n - i);
+        const __mmask16 inside = _mm512_mask_cmp_ps_mask(tail, _mm512_maskz_loadu_ps(tail, dR2 + i), max_v,
+                                                         _CMP_NGE_UQ);
+        const __m512i index = _mm512_add_epi32(lanes, _mm512_set1_epi32(static_cast<int>(i)));
+        _mm512_mask_compressstoreu_epi32(indices + n_selected, inside, index);
+        n_selected += static_cast<size_t>(__builtin_popcount(inside));
+    }
+#elif defined(__AVX2__)
+    const __m256 max_v = _mm256_set1_ps(max_dR2);
+    for(size_t i = 0; i < n; i += detail::width) {
+        const __m256i tail = detail::TailMask(n - i);
+        const __m256 inside = _mm256_and_ps(_mm256_cmp_ps(_mm256_maskload_ps(dR2 + i, tail), max_v, _CMP_NGE_UQ),
+                                            _mm256_castsi256_ps(tail));
+        for(unsigned bits = static_cast<unsigned>(_mm256_movemask_ps(inside)); bits; bits &= bits - 1)
+            indices[n_selected++] = static_cast<uint32_t>(i) + static_cast<uint32_t>(__builtin_ctz(bits));
+    }
+#else
+    for(size_t i = 0; i < n; ++i) {
+        if(!(dR2[i] >= max_dR2))
+            indices[n_selected++] = static_cast<uint32_t>(i);
+    }
+#endif
+    return n_selected;
+}
+
+} // namespace kinematics
+} // namespace analysis
@@ -0,0 +1,128 @@
+/*! Sequential writer of arrays in the numpy .npy format (version 1.0).
+The header has a fixed size that is reserved when the file is created, so the array can be written item by item
+and the final shape is filled in on Close. The data starts at a 64-byte aligned offset, so the file can be opened
+without copying using numpy.load(file_name, mmap_mode='r').
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <vector>
+#include "AnalysisTools/Core/include/exception.h"
+
+namespace analysis {
+
+template<typename T> struct NpyTypeDescr;
+template<> struct NpyTypeDescr<float> { static constexpr const char* value = "<f4"; };
+template<> struct NpyTypeDescr<double> { static constexpr const char* value = "<f8"; };
+template<> struct NpyTypeDescr<int8_t> { static constexpr const char* value = "|i1"; };
+template<> struct NpyTypeDescr<uint8_t> { static constexpr const char* value = "|u1"; };
+template<> struct NpyTypeDescr<int16_t> { static constexpr const char* value = "<i2"; };
+template<> struct NpyTypeDescr<uint16_t> { static constexpr const char* value = "<u2"; };
+template<> struct NpyTypeDescr<int32_t> { static constexpr const char* value = "<i4"; };
+template<> struct NpyTypeDescr<uint32_t> { static constexpr const char* value = "<u4"; };
+template<> struct NpyTypeDescr<int64_t> { static constexpr const char* value = "<i8"; };
+template<> struct NpyTypeDescr<uint64_t> { static constexpr const char* value = "<u8"; };
+
+// Array with shape (n_items, item_shape...), where n_items grows with each call to Write.
+template<typename T>
+class NpyFileWriter {
+public:
+    static constexpr size_t alignment = 64;
+
+    NpyFileWriter(const std::string& _file_name, const std::vector<size_t>& _item_shape) :
+        file_name(_file_name), item_shape(_item_shape), item_size(1), n_items(0),
+        file(file_name, std::ios::binary | std::ios::trunc)
+    {
+        if(!file.is_open())
+            throw exception("Unable to create '%1%'.") % file_name;
+        for(size_t dim : item_shape)
+            item_size *= dim;
+        const size_t max_header_size = 10 + GetDescription(std::numeric_limits<size_t>::max()).size() + 1;
+        header_size = (max_header_size + alignment - 1) / alignment * alignment;
+        WriteHeader();
+    }
+
+    NpyFileWriter(const NpyFileWriter&) = delete;
+    NpyFileWriter& operator=(const NpyFileWriter&) = delete;
+
+    ~NpyFileWriter()
+    {
+        try {
+            Close();
+        } catch(std::exception& e) {
+            std::cerr << "ERROR: " << e.what() << std::endl;
+        }
+    }
+
+    const std::string& FileName() const { return file_name; }
+    size_t ItemSize() const { return item_size; }
+    size_t NumberOfItems() const { return n_items; }
+
+    // Writes n items, each of them consisting of ItemSize() values.
+    void Write(const T* data, size_t n)
+    {
+        if(!file.is_open())
+            throw exception("Npy file '%1%' is already closed.") % file_name;
+        file.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(n * item_size * sizeof(T)));
+        if(!file.good())
+            throw exception("Error while writing into '%1%'.") % file_name;
+        n_items += n;
+    }
+
+    void Write(const std::vector<T>& data)
+    {
+        if(item_size == 0 || data.size() % item_size != 0)
+            throw exception("Size of the data is not compatible with the item shape of '%1%'.") % file_name;
+        Write(data.data(), data.size() / item_size);
+    }
+
+    void Close()
+    {
+        if(!file.is_open()) return;
+        file.seekp(0);
+        WriteHeader();
+        file.close();
+        if(file.fail())
+            throw exception("Error while closing '%1%'.") % file_name;
+    }
+
+private:
+    std::string GetDescription(size_t n) const
+    {
+        std::ostringstream ss;
+        ss << "{'descr': '" << NpyTypeDescr<T>::value << "', 'fortran_order': False, 'shape': (" << n << ",";
+        for(size_t dim : item_shape)
+            ss << " " << dim << ",";
+        ss << "), }";
+        return ss.str();
+    }
+
+    void WriteHeader()
+    {
+        std::string description = GetDescription(n_items);
+        description.resize(header_size - 10 - 1, ' ');
+        description.push_back('\n');
+        const uint16_t description_size = static_cast<uint16_t>(description.size());
+        const char preamble[] = { '\x93', 'N', 'U', 'M', 'P', 'Y', '\x01', '\x00',
+                                  static_cast<char>(description_size & 0xFF),
+                                  static_cast<char>(description_size >> 8) };
+        file.write(preamble, sizeof(preamble));
+        file.write(description.data(), static_cast<std::streamsize>(description.size()));
+        if(!file.good())
+            throw exception("Error while writing the header of '%1%'.") % file_name;
+        file.seekp(0, std::ios::end);
+    }
+
+private:
+    std::string file_name;
+    std::vector<size_t> item_shape;
+    size_t item_size, n_items, header_size;
+    std::ofstream file;
+};
+
+} // namespace analysis
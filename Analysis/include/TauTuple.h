@@ -246,6 +246,16 @@ DECLARE_TREE(tau_tuple, Tau, TauTuple, TAU_DATA, "taus")
 #define VAR(type, name) ADD_DATA_TREE_BRANCH(name)
 INITIALIZE_TREE(tau_tuple, TauTuple, TAU_DATA)
 #undef VAR
+
+#define VAR(type, name) #name,
+namespace tau_tuple {
+inline const std::set<std::string>& GetTauTupleBranches()
+{
+    static const std::set<std::string> branches = { TAU_DATA() };
+    return branches;
+}
+} // namespace tau_tuple
+#undef VAR
 #undef VAR2
 #undef VAR3
 #undef VAR4
@@ -275,6 +285,18 @@ constexpr int DefaultFillValue<int>() { return -999; }
 
 enum class ComponenetType { Gamma = 0, ChargedHadronCandidate = 1, NeutralHadronCandidate = 2};
 
+// Checks that all names are branches of the tau tuple. Tools pass the set of branches they read as the enabled
+// branches of the TauTuple, so that the baskets of all other branches are not read.
+inline std::set<std::string> CheckTauTupleBranches(const std::set<std::string>& names)
+{
+    const auto& all_branches = GetTauTupleBranches();
+    for(const std::string& name : names) {
+        if(!all_branches.count(name))
+            throw analysis::exception("'%1%' is not a branch of the tau tuple.") % name;
+    }
+    return names;
+}
+
 struct TauTupleEntryId {
     UInt_t run;
     UInt_t lumi;
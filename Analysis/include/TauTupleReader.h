@@ -0,0 +1,94 @@
+/*! Two-phase reader of the tau tuple with the selection pushed down to a subset of branches.
+Entries are processed in blocks. For each block, only the branches used by the selection are read first. All other
+enabled branches are read only for the entries accepted by the selection.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "AnalysisTools/Core/include/RootExt.h"
+#include "TauML/Analysis/include/TauTuple.h"
+
+namespace tau_tuple {
+
+class TwoPhaseTauTupleReader {
+public:
+    static constexpr Long64_t default_block_size = 1000;
+
+    // Selection is evaluated using only predicate_branches. If predicate_branches is empty, the selection is evaluated
+    // on the fully read entries. Empty enabled_branches means that all branches are read.
+    TwoPhaseTauTupleReader(const std::string& file_name, const std::string& tree_name,
+                           const std::set<std::string>& predicate_branches,
+                           const std::set<std::string>& enabled_branches = {},
+                           Long64_t _block_size = default_block_size) :
+        file(root_ext::OpenRootFile(file_name)),
+        tuple(tree_name, file.get(), true, {}, CheckTauTupleBranches(enabled_branches)), block_size(_block_size)
+    {
+        if(block_size <= 0)
+            throw analysis::exception("Block size should be positive.");
+        if(!predicate_branches.empty()) {
+            if(!enabled_branches.empty()) {
+                for(const std::string& name : predicate_branches) {
+                    if(!enabled_branches.count(name))
+                        throw analysis::exception("Selection branch '%1%' is not enabled.") % name;
+                }
+            }
+            // The predicate branches are read from a separate file instance, so that the two trees do not share
+            // the branch addresses.
+            predicateFile = root_ext::OpenRootFile(file_name);
+            predicateTuple = std::make_unique<TauTuple>(tree_name, predicateFile.get(), true, std::set<std::string>(),
+                                                        CheckTauTupleBranches(predicate_branches));
+        }
+        accepted.reserve(static_cast<size_t>(block_size));
+    }
+
+    Long64_t GetEntries() const { return tuple.GetEntries(); }
+
+    // Calls process(tau) for each entry in [begin, end) for which select(tau) is true. Inside select, only the
+    // predicate branches of tau are valid. select is called in the order of entries, and for the entries of a block
+    // it is called before process. Processing stops when process returns false.
+    // Returns the number of processed entries.
+    template<typename Select, typename Process>
+    Long64_t ForEach(Long64_t begin, Long64_t end, Select&& select, Process&& process)
+    {
+        return ForEach(begin, end, select, process, [] { return false; });
+    }
+
+    // Same as above, but processing also stops before a block when stop() is true. Unlike stopping from process,
+    // all entries accepted by select are processed.
+    template<typename Select, typename Process, typename Stop>
+    Long64_t ForEach(Long64_t begin, Long64_t end, Select&& select, Process&& process, Stop&& stop)
+    {
+        end = std::min(end, GetEntries());
+        Long64_t n_processed = 0;
+        for(Long64_t block_begin = begin; block_begin < end && !stop(); block_begin += block_size) {
+            const Long64_t block_end = std::min(block_begin + block_size, end);
+            accepted.clear();
+            for(Long64_t entry = block_begin; entry < block_end; ++entry) {
+                if(predicateTuple) {
+                    predicateTuple->GetEntry(entry);
+                    if(!select(predicateTuple->data())) continue;
+                }
+                accepted.push_back(entry);
+            }
+            for(Long64_t entry : accepted) {
+                tuple.GetEntry(entry);
+                if(!predicateTuple && !select(tuple.data())) continue;
+                ++n_processed;
+                if(!process(tuple.data())) return n_processed;
+            }
+        }
+        return n_processed;
+    }
+
+private:
+    std::shared_ptr<TFile> file, predicateFile;
+    TauTuple tuple;
+    std::unique_ptr<TauTuple> predicateTuple;
+    const Long64_t block_size;
+    std::vector<Long64_t> accepted;
+};
+
+} // namespace tau_tuple
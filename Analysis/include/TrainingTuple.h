@@ -5,6 +5,7 @@
 
 #include "AnalysisTools/Core/include/SmartTree.h"
 #include "TauML/Analysis/include/TauIdResults.h"
+#include "TauML/Analysis/include/FeatureNormalization.h"
 #include <Math/VectorUtil.h>
 
 #define TAU_ID(name, pattern, has_raw, wp_list) VAR(uint16_t, name) VAR(Float_t, name##raw)
@@ -152,10 +153,9 @@
     /**/
 
 #define TRAINING_CELL_DATA() \
-    /* Common variables */ \
+    /* Common variables. Tau-level inputs of the cells are not stored per cell, they are taken from the taus tree
+       by the data loader. */ \
     VAR2(Int_t, eta_index, phi_index) /* eta and phi index of the cell in the grid */ \
-    VAR(Float_t, tau_pt) /* pt of the tau */ \
-    VAR(Float_t, rho) /* fixed grid energy density */ \
     /* Electron PF candidates */ \
     CAND_VAR(Int_t, ele_n_total) /* total number of PF candidates in the cell */ \
     CAND_VAR(Float_t, ele_valid) /* the information in pfCand_ele branches is valid */ \
@@ -380,6 +380,23 @@
                        n_hits_RPC_4) /* number of valid and bad hits for the RPC subdetector stations */ \
     /**/
 
+#define TRAINING_CELL_RANGE_DATA() \
+    VAR2(Long64_t, innerCells_begin, innerCells_end) /* index of the first and of the next to the last inner cells */ \
+    VAR2(Long64_t, outerCells_begin, outerCells_end) /* index of the first and of the next to the last outer cells */ \
+    /**/
+
+#define TRAINING_CELL_OCCUPANCY_DATA() \
+    VAR(std::vector<ULong64_t>, innerCells_occupancy) /* occupancy bitmap of the inner cells: bit n % 64 of the word
+                                                         n / 64 is set if the n-th cell in the traversal order of the
+                                                         grid is stored */ \
+    VAR(std::vector<ULong64_t>, outerCells_occupancy) /* occupancy bitmap of the outer cells */ \
+    /**/
+
+#define TRAINING_COMPACT_CELL_DATA() \
+    VAR(std::vector<UChar_t>, features) /* flags and small integer features of the cell in the compact form, the
+                                           layout is described by the compact_cell_layout object of the file */ \
+    /**/
+
 #define VAR(type, name) DECLARE_BRANCH_VARIABLE(type, name)
 DECLARE_TREE(tau_tuple, TrainingTau, TrainingTauTuple, TRAINING_TAU_DATA, "taus")
 #undef VAR
@@ -396,10 +413,44 @@ DECLARE_TREE(tau_tuple, TrainingCell, TrainingCellTuple, TRAINING_CELL_DATA, "ce
 INITIALIZE_TREE(tau_tuple, TrainingCellTuple, TRAINING_CELL_DATA)
 #undef VAR
 
+#define VAR(type, name) DECLARE_BRANCH_VARIABLE(type, name)
+DECLARE_TREE(tau_tuple, TrainingCellRange, TrainingCellRangeTuple, TRAINING_CELL_RANGE_DATA, "cell_ranges")
+#undef VAR
+
+#define VAR(type, name) ADD_DATA_TREE_BRANCH(name)
+INITIALIZE_TREE(tau_tuple, TrainingCellRangeTuple, TRAINING_CELL_RANGE_DATA)
+#undef VAR
+
+#define VAR(type, name) DECLARE_BRANCH_VARIABLE(type, name)
+DECLARE_TREE(tau_tuple, TrainingCellOccupancy, TrainingCellOccupancyTuple, TRAINING_CELL_OCCUPANCY_DATA,
+             "cell_occupancy")
+#undef VAR
+
+#define VAR(type, name) ADD_DATA_TREE_BRANCH(name)
+INITIALIZE_TREE(tau_tuple, TrainingCellOccupancyTuple, TRAINING_CELL_OCCUPANCY_DATA)
+#undef VAR
+
+#define VAR(type, name) DECLARE_BRANCH_VARIABLE(type, name)
+DECLARE_TREE(tau_tuple, TrainingCompactCell, TrainingCompactCellTuple, TRAINING_COMPACT_CELL_DATA, "compact_cells")
+#undef VAR
+
+#define VAR(type, name) ADD_DATA_TREE_BRANCH(name)
+INITIALIZE_TREE(tau_tuple, TrainingCompactCellTuple, TRAINING_COMPACT_CELL_DATA)
+#undef VAR
+
+#define VAR(type, name) ADD_FEATURE_COLUMN(name)
+DECLARE_FEATURE_COLUMNS(tau_tuple, TrainingTau, TRAINING_TAU_DATA)
+DECLARE_FEATURE_COLUMNS(tau_tuple, TrainingCell, TRAINING_CELL_DATA)
+#undef VAR
+
 #undef VAR2
 #undef VAR3
 #undef VAR4
 #undef TRAINING_TAU_DATA
+#undef TRAINING_CELL_RANGE_DATA
+#undef TRAINING_CELL_OCCUPANCY_DATA
+#undef TRAINING_COMPACT_CELL_DATA
+#undef TRAINING_CHUNK_DATA
 #undef TRAINING_OBJECT_DATA
 #undef CAND_VAR
 #undef CAND_VAR2
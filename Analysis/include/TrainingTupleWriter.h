@@ -0,0 +1,600 @@
+/*! Chunks of the training tuple and the writer of the root training tuple.
+*/
+
+#pragma once
+
+#include <fstream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <TBranch.h>
+#include <TNamed.h>
+#include <boost/algorithm/string.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include "AnalysisTools/Core/include/RootExt.h"
+#include "AnalysisTools/Core/include/TextIO.h"
+#include "TauML/Analysis/include/TrainingTuple.h"
+#include "TauML/Analysis/include/FeatureEncoding.h"
+
+namespace analysis {
+
+enum class CellEncoding { Index = 1, Bitmap = 2 };
+ENUM_NAMES(CellEncoding) = {
+    { CellEncoding::Index, "index" },
+    { CellEncoding::Bitmap, "bitmap" }
+};
+
+// Geometry of the inner and outer cell grids.
+struct CellGridConfig {
+    std::string label;
+    unsigned n_inner_cells, n_outer_cells;
+    double inner_cell_size, outer_cell_size;
+
+    // Suffix of the names of the outputs that correspond to the grid. The main grid has no label.
+    std::string Suffix() const { return label.empty() ? "" : "_" + label; }
+
+    // Parses the list of "label:n_inner_cells:inner_cell_size:n_outer_cells:outer_cell_size" items.
+    static std::vector<CellGridConfig> ParseList(const std::string& list_str)
+    {
+        std::vector<CellGridConfig> configs;
+        std::set<std::string> labels;
+        for(const std::string& item : SplitValueList(list_str, false, " ;", true)) {
+            if(item.empty()) continue;
+            const auto split = SplitValueList(item, true, ":", false);
+            if(split.size() != 5 || split.at(0).empty())
+                throw exception("Invalid grid configuration '%1%'."
+                                " Expected label:n_inner_cells:inner_cell_size:n_outer_cells:outer_cell_size.") % item;
+            CellGridConfig config;
+            config.label = split.at(0);
+            config.n_inner_cells = Parse<unsigned>(split.at(1));
+            config.inner_cell_size = Parse<double>(split.at(2));
+            config.n_outer_cells = Parse<unsigned>(split.at(3));
+            config.outer_cell_size = Parse<double>(split.at(4));
+            if(!labels.insert(config.label).second)
+                throw exception("Duplicated grid label '%1%'.") % config.label;
+            configs.push_back(config);
+        }
+        return configs;
+    }
+};
+
+// Cells of an additional grid configuration. The cell ranges of the taus are relative to the chunk.
+// Occupancy bitmaps are filled only with the bitmap cell encoding.
+struct TrainingGridCells {
+    std::vector<tau_tuple::TrainingCellRange> ranges;
+    std::vector<tau_tuple::TrainingCellOccupancy> occupancy;
+    std::vector<tau_tuple::TrainingCell> innerCells, outerCells;
+};
+
+// Output of a single chunk of input entries. The cell ranges of the taus are relative to the chunk.
+// Occupancy bitmaps are filled only with the bitmap cell encoding.
+struct TrainingTupleChunk {
+    std::vector<tau_tuple::TrainingTau> taus;
+    std::vector<tau_tuple::TrainingCellOccupancy> occupancy;
+    std::vector<tau_tuple::TrainingCell> innerCells, outerCells;
+    std::vector<TrainingGridCells> extraGrids;
+    size_t chunk_id{0}, n_processed{0};
+};
+
+// Destination of the processed chunks. Chunks are written in the order of the input entries.
+class TrainingTupleWriter {
+public:
+    virtual ~TrainingTupleWriter() {}
+    virtual void Write(const TrainingTupleChunk& chunk) = 0;
+    virtual void Finalize() = 0;
+};
+
+// Record of the settings and of the input entries of the root training tuple, stored as the manifest object in the
+// output file. It allows to append new inputs to the existing output.
+struct TrainingTupleManifest {
+    using Config = std::map<std::string, std::string>;
+
+    struct Input {
+        std::string file_name;
+        Long64_t begin, end, n_taus;
+    };
+
+    static constexpr const char* object_name = "manifest";
+
+    Config config;
+    std::vector<Input> inputs;
+
+    static TrainingTupleManifest Read(const std::string& file_name)
+    {
+        auto file = root_ext::OpenRootFile(file_name);
+        TNamed* object = root_ext::TryReadObject<TNamed>(*file, object_name);
+        if(!object)
+            throw exception("'%1%' has no manifest, so taus can not be appended to it.") % file_name;
+        return Parse(object->GetTitle());
+    }
+
+    // Each line is either "config <key> <value>" or "input <begin> <end> <n_taus> <file_name>".
+    static TrainingTupleManifest Parse(const std::string& text)
+    {
+        TrainingTupleManifest manifest;
+        std::istringstream ss(text);
+        std::string line;
+        while(std::getline(ss, line)) {
+            if(line.empty()) continue;
+            std::istringstream line_ss(line);
+            std::string tag, value;
+            line_ss >> tag;
+            if(tag == "config") {
+                std::string key;
+                line_ss >> key;
+                std::getline(line_ss, value);
+                manifest.config[key] = boost::trim_copy(value);
+            } else if(tag == "input") {
+                Input input;
+                line_ss >> input.begin >> input.end >> input.n_taus;
+                std::getline(line_ss, input.file_name);
+                boost::trim(input.file_name);
+                manifest.inputs.push_back(input);
+            }
+            if(line_ss.fail())
+                throw exception("Invalid manifest line '%1%'.") % line;
+        }
+        return manifest;
+    }
+
+    std::string ToString() const
+    {
+        std::ostringstream ss;
+        for(const auto& item : config)
+            ss << "config " << item.first << " " << item.second << "\n";
+        for(const Input& input : inputs)
+            ss << "input " << input.begin << " " << input.end << " " << input.n_taus << " " << input.file_name << "\n";
+        return ss.str();
+    }
+
+    void CheckConfig(const Config& current) const
+    {
+        Config all = config;
+        all.insert(current.begin(), current.end());
+        for(const auto& item : all) {
+            const auto stored = config.find(item.first), requested = current.find(item.first);
+            const std::string stored_value = stored != config.end() ? stored->second : "";
+            const std::string requested_value = requested != current.end() ? requested->second : "";
+            if(stored_value != requested_value)
+                throw exception("The output was produced with %1% = '%2%', while the current value is '%3%'.")
+                        % item.first % stored_value % requested_value;
+        }
+    }
+
+    // Part of the entries [begin, end) of the input that is not yet stored in the output. Entries that are already
+    // stored can only precede the new entries.
+    std::pair<Long64_t, Long64_t> GetNewEntries(const std::string& file_name, Long64_t begin, Long64_t end) const
+    {
+        for(bool updated = true; updated;) {
+            updated = false;
+            for(const Input& input : inputs) {
+                if(input.file_name == file_name && input.begin <= begin && begin < input.end) {
+                    begin = input.end;
+                    updated = true;
+                }
+            }
+        }
+        if(begin >= end)
+            return std::make_pair(end, end);
+        for(const Input& input : inputs) {
+            if(input.file_name == file_name && input.begin < end && begin < input.end)
+                throw exception("Entries [%1%, %2%) of '%3%' are already stored in the output. Use start-entry and"
+                                " end-entry to select only the new entries.") % input.begin % input.end % file_name;
+        }
+        return std::make_pair(begin, end);
+    }
+};
+
+using CompactCellEncoder = CompactFeatureEncoder<tau_tuple::TrainingCell>;
+
+// Storage of the cells in the root format. If the compact encoders are set, the features that they encode are
+// stored in the compact cell trees instead of the cell trees.
+struct RootCellLayout {
+    CellEncoding encoding;
+    std::shared_ptr<const CompactCellEncoder> innerCompact, outerCompact;
+
+    explicit RootCellLayout(CellEncoding _encoding = CellEncoding::Index) : encoding(_encoding) {}
+};
+
+// Cells of an additional grid are stored in the inner_cells_<label> and outer_cells_<label> trees. The cell ranges
+// of the taus are stored in the cell_ranges_<label> tree, which has one entry per tau.
+// With the bitmap cell encoding, the cells are stored without eta_index and phi_index, and the occupancy bitmaps are
+// stored in the cell_occupancy and cell_occupancy_<label> trees, which have one entry per tau.
+// With the compact cell schema, the features of the compact encoders are stored in the compact_inner_cells and
+// compact_outer_cells trees (with the _<label> suffix for additional grids), which are aligned with the cell trees.
+// Their layouts are described by the compact_cell_layout object.
+class RootTrainingTupleWriter : public TrainingTupleWriter {
+public:
+    using TrainingTau = tau_tuple::TrainingTau;
+    using TrainingCell = tau_tuple::TrainingCell;
+    using TrainingCellTuple = tau_tuple::TrainingCellTuple;
+    using TrainingCellOccupancyTuple = tau_tuple::TrainingCellOccupancyTuple;
+    using TrainingCompactCellTuple = tau_tuple::TrainingCompactCellTuple;
+
+    static constexpr const char* compact_layout_name = "compact_cell_layout";
+
+    // If cluster_size is positive, all trees are flushed after each cluster_size taus, so that each cluster of the
+    // cell trees contains exactly the cells of the taus in the corresponding cluster of the taus tree.
+    // If manifest is set, it is stored in the output with the number of written taus set for its last input.
+    // In the append mode, the output file is opened in the update mode. The tuples read its trees and bind their
+    // branches to the tuple data, then all branches are enabled for writing. Each branch of the existing trees should
+    // be bound, so that the appended entries are complete. The trees are written back explicitly at the end.
+    // Cell ranges continue the existing cell entries.
+    RootTrainingTupleWriter(const std::string& file_name, const std::vector<CellGridConfig>& extra_grids,
+                            const RootCellLayout& cell_layout, Long64_t cluster_size = 0,
+                            std::unique_ptr<TrainingTupleManifest> _manifest = nullptr, bool append = false) :
+        outputFile(OpenOutputFile(file_name, append)), tauTuple(outputFile.get(), append),
+        innerCellTuple("inner_cells", outputFile.get(), append,
+                       CellDisabledBranches(cell_layout.encoding, cell_layout.innerCompact.get())),
+        outerCellTuple("outer_cells", outputFile.get(), append,
+                       CellDisabledBranches(cell_layout.encoding, cell_layout.outerCompact.get())),
+        manifest(std::move(_manifest)), indexFileName(file_name + ".index.json"), clusterSize(cluster_size),
+        firstTau(tauTuple.GetEntries()), updateMode(append)
+    {
+        if(!cell_layout.innerCompact != !cell_layout.outerCompact)
+            throw exception("Compact encoders should be set for both inner and outer cells.");
+        const bool bitmap = cell_layout.encoding == CellEncoding::Bitmap;
+        treeNames = { "taus", "inner_cells", "outer_cells" };
+        if(bitmap) {
+            occupancyTuple = std::make_unique<TrainingCellOccupancyTuple>(outputFile.get(), append);
+            treeNames.push_back("cell_occupancy");
+        }
+        innerCompact = MakeCompactOutput("compact_inner_cells", cell_layout.innerCompact, append);
+        outerCompact = MakeCompactOutput("compact_outer_cells", cell_layout.outerCompact, append);
+        for(const auto& grid : extra_grids) {
+            extraGridTuples.emplace_back();
+            auto& tuples = extraGridTuples.back();
+            tuples.ranges = std::make_unique<tau_tuple::TrainingCellRangeTuple>("cell_ranges" + grid.Suffix(),
+                                                                                outputFile.get(), append);
+            tuples.inner = std::make_unique<TrainingCellTuple>("inner_cells" + grid.Suffix(), outputFile.get(),
+                append, CellDisabledBranches(cell_layout.encoding, cell_layout.innerCompact.get()));
+            tuples.outer = std::make_unique<TrainingCellTuple>("outer_cells" + grid.Suffix(), outputFile.get(),
+                append, CellDisabledBranches(cell_layout.encoding, cell_layout.outerCompact.get()));
+            for(const char* name : { "cell_ranges", "inner_cells", "outer_cells" })
+                treeNames.push_back(name + grid.Suffix());
+            if(bitmap) {
+                tuples.occupancy = std::make_unique<TrainingCellOccupancyTuple>("cell_occupancy" + grid.Suffix(),
+                                                                                outputFile.get(), append);
+                treeNames.push_back("cell_occupancy" + grid.Suffix());
+            }
+            tuples.innerCompact = MakeCompactOutput("compact_inner_cells" + grid.Suffix(), cell_layout.innerCompact,
+                                                    append);
+            tuples.outerCompact = MakeCompactOutput("compact_outer_cells" + grid.Suffix(), cell_layout.outerCompact,
+                                                    append);
+        }
+        for(const std::string& name : treeNames) {
+            TTree* tree = dynamic_cast<TTree*>(outputFile->Get(name.c_str()));
+            if(!tree)
+                throw exception("Tree '%1%' is not found in the output file.") % name;
+            if(updateMode)
+                EnableForUpdate(*tree);
+            trees.push_back(tree);
+        }
+        if(clusterSize > 0) {
+            for(TTree* tree : trees) {
+                tree->SetAutoFlush(0);
+                clusterBegin.push_back(tree->GetEntries());
+            }
+            clusterBytesBegin = outputFile->GetEND();
+            if(firstTau > 0) {
+                clusters = ReadClusterIndex(indexFileName, treeNames, clusterSize);
+                if(clusters.empty() || clusters.back().entries_end != clusterBegin)
+                    throw exception("Cluster index '%1%' does not match the trees of the existing output.")
+                          % indexFileName;
+            }
+        }
+    }
+
+    void Write(const TrainingTupleChunk& chunk) override
+    {
+        if(chunk.extraGrids.size() != extraGridTuples.size())
+            throw exception("Inconsistent number of grid configurations.");
+        const Long64_t inner_offset = innerCellTuple.GetEntries();
+        const Long64_t outer_offset = outerCellTuple.GetEntries();
+        std::vector<std::pair<Long64_t, Long64_t>> grid_offsets;
+        for(const GridTuples& tuples : extraGridTuples)
+            grid_offsets.emplace_back(tuples.inner->GetEntries(), tuples.outer->GetEntries());
+        for(size_t tau_index = 0; tau_index < chunk.taus.size(); ++tau_index) {
+            const TrainingTau& tau = chunk.taus[tau_index];
+            FillCells(innerCellTuple, innerCompact, chunk.innerCells, inner_offset, tau.innerCells_begin,
+                      tau.innerCells_end);
+            FillCells(outerCellTuple, outerCompact, chunk.outerCells, outer_offset, tau.outerCells_begin,
+                      tau.outerCells_end);
+            tauTuple() = tau;
+            ShiftCellRange(tauTuple(), inner_offset, outer_offset);
+            tauTuple.Fill();
+            if(occupancyTuple) {
+                (*occupancyTuple)() = chunk.occupancy.at(tau_index);
+                occupancyTuple->Fill();
+            }
+            for(size_t n = 0; n < extraGridTuples.size(); ++n) {
+                const TrainingGridCells& grid = chunk.extraGrids.at(n);
+                const auto& range = grid.ranges.at(tau_index);
+                GridTuples& tuples = extraGridTuples.at(n);
+                const auto& offsets = grid_offsets.at(n);
+                FillCells(*tuples.inner, tuples.innerCompact, grid.innerCells, offsets.first, range.innerCells_begin,
+                          range.innerCells_end);
+                FillCells(*tuples.outer, tuples.outerCompact, grid.outerCells, offsets.second,
+                          range.outerCells_begin, range.outerCells_end);
+                (*tuples.ranges)() = range;
+                ShiftCellRange((*tuples.ranges)(), offsets.first, offsets.second);
+                tuples.ranges->Fill();
+                if(tuples.occupancy) {
+                    (*tuples.occupancy)() = grid.occupancy.at(tau_index);
+                    tuples.occupancy->Fill();
+                }
+            }
+            if(clusterSize > 0 && tauTuple.GetEntries() - clusterBegin.at(0) >= clusterSize)
+                FlushCluster();
+        }
+    }
+
+    void Finalize() override
+    {
+        if(clusterSize > 0) {
+            if(tauTuple.GetEntries() > clusterBegin.at(0))
+                FlushCluster();
+            WriteClusterIndex();
+        }
+        if(updateMode) {
+            for(TTree* tree : trees)
+                outputFile->WriteTObject(tree, tree->GetName(), "Overwrite");
+        } else {
+            tauTuple.Write();
+            innerCellTuple.Write();
+            outerCellTuple.Write();
+            if(occupancyTuple)
+                occupancyTuple->Write();
+            WriteCompactOutput(innerCompact);
+            WriteCompactOutput(outerCompact);
+            for(auto& tuples : extraGridTuples) {
+                tuples.ranges->Write();
+                tuples.inner->Write();
+                tuples.outer->Write();
+                if(tuples.occupancy)
+                    tuples.occupancy->Write();
+                WriteCompactOutput(tuples.innerCompact);
+                WriteCompactOutput(tuples.outerCompact);
+            }
+        }
+        if(innerCompact.tuple) {
+            const std::string layout = "{ \"inner\": " + innerCompact.encoder->Describe() + ", \"outer\": "
+                                       + outerCompact.encoder->Describe() + " }";
+            TNamed object(compact_layout_name, layout.c_str());
+            outputFile->WriteTObject(&object, compact_layout_name, "Overwrite");
+        }
+        if(manifest) {
+            if(!manifest->inputs.empty())
+                manifest->inputs.back().n_taus = tauTuple.GetEntries() - firstTau;
+            TNamed object(TrainingTupleManifest::object_name, manifest->ToString().c_str());
+            outputFile->WriteTObject(&object, TrainingTupleManifest::object_name, "Overwrite");
+        }
+    }
+
+    template<typename Range>
+    static void ShiftCellRange(Range& range, Long64_t inner_offset, Long64_t outer_offset)
+    {
+        range.innerCells_begin += inner_offset;
+        range.innerCells_end += inner_offset;
+        range.outerCells_begin += outer_offset;
+        range.outerCells_end += outer_offset;
+    }
+
+    // With the bitmap encoding, the cell positions are given by the occupancy bitmaps. The features of the compact
+    // encoder are stored in the compact cell trees.
+    static std::set<std::string> CellDisabledBranches(CellEncoding cell_encoding,
+                                                      const CompactCellEncoder* compact_encoder = nullptr)
+    {
+        std::set<std::string> disabled;
+        if(cell_encoding == CellEncoding::Bitmap)
+            disabled = { "eta_index", "phi_index" };
+        if(compact_encoder) {
+            for(const std::string& name : compact_encoder->FeatureNames())
+                disabled.insert(name);
+        }
+        return disabled;
+    }
+
+private:
+    struct CompactCellOutput {
+        std::unique_ptr<TrainingCompactCellTuple> tuple;
+        std::shared_ptr<const CompactCellEncoder> encoder;
+    };
+
+    struct GridTuples {
+        std::unique_ptr<tau_tuple::TrainingCellRangeTuple> ranges;
+        std::unique_ptr<TrainingCellTuple> inner, outer;
+        std::unique_ptr<TrainingCellOccupancyTuple> occupancy;
+        CompactCellOutput innerCompact, outerCompact;
+    };
+
+    struct ClusterLocation {
+        std::vector<Long64_t> entries_begin, entries_end;
+        Long64_t bytes_begin, bytes_end;
+    };
+
+    static std::shared_ptr<TFile> OpenOutputFile(const std::string& file_name, bool append)
+    {
+        if(!append)
+            return root_ext::CreateRootFile(file_name, ROOT::kLZ4, 4);
+        std::shared_ptr<TFile> file(TFile::Open(file_name.c_str(), "UPDATE"));
+        if(!file || file->IsZombie())
+            throw exception("Unable to open '%1%' for appending.") % file_name;
+        return file;
+    }
+
+    // Enables all branches of the existing tree, so that they are filled, and checks that all of them are bound.
+    static void EnableForUpdate(TTree& tree)
+    {
+        tree.SetBranchStatus("*", true);
+        TIter next(tree.GetListOfBranches());
+        while(TBranch* branch = dynamic_cast<TBranch*>(next())) {
+            if(!branch->GetAddress())
+                throw exception("Branch '%1%' of the existing tree '%2%' is not bound to the tuple data.")
+                      % branch->GetName() % tree.GetName();
+        }
+    }
+
+    CompactCellOutput MakeCompactOutput(const std::string& name,
+                                        const std::shared_ptr<const CompactCellEncoder>& encoder, bool append)
+    {
+        CompactCellOutput output;
+        if(encoder) {
+            output.tuple = std::make_unique<TrainingCompactCellTuple>(name, outputFile.get(), append);
+            output.encoder = encoder;
+            treeNames.push_back(name);
+        }
+        return output;
+    }
+
+    static void WriteCompactOutput(CompactCellOutput& output)
+    {
+        if(output.tuple)
+            output.tuple->Write();
+    }
+
+    // Cells [begin, end) of the chunk, where the cells of the chunk are stored starting from the offset.
+    void FillCells(TrainingCellTuple& tuple, CompactCellOutput& compact, const std::vector<TrainingCell>& cells,
+                   Long64_t offset, Long64_t begin, Long64_t end)
+    {
+        if(tuple.GetEntries() != offset + begin)
+            throw exception("Cells of the taus are not stored contiguously.");
+        if(begin > end || end > static_cast<Long64_t>(cells.size()))
+            throw exception("Cell range [%1%, %2%) is out of the chunk.") % begin % end;
+        const size_t n_cells = static_cast<size_t>(end - begin);
+        const size_t n_bytes = compact.encoder ? compact.encoder->NumberOfBytes() : 0;
+        if(compact.tuple) {
+            compactFeatures.resize(n_cells * n_bytes);
+            compact.encoder->Encode(cells.data() + begin, n_cells, compactWorkspace, compactFeatures.data());
+        }
+        for(size_t n = 0; n < n_cells; ++n) {
+            tuple() = cells[static_cast<size_t>(begin) + n];
+            tuple.Fill();
+            if(compact.tuple) {
+                const auto first = compactFeatures.begin() + static_cast<std::ptrdiff_t>(n * n_bytes);
+                (*compact.tuple)().features.assign(first, first + static_cast<std::ptrdiff_t>(n_bytes));
+                compact.tuple->Fill();
+            }
+        }
+    }
+
+    // Flushes the baskets of all trees. The baskets written since the previous flush occupy the byte range
+    // [bytes_begin, bytes_end) of the output file.
+    void FlushCluster()
+    {
+        ClusterLocation cluster;
+        cluster.entries_begin = clusterBegin;
+        for(size_t n = 0; n < trees.size(); ++n) {
+            trees[n]->FlushBaskets();
+            cluster.entries_end.push_back(trees[n]->GetEntries());
+        }
+        cluster.bytes_begin = clusterBytesBegin;
+        cluster.bytes_end = outputFile->GetEND();
+        clusterBegin = cluster.entries_end;
+        clusterBytesBegin = cluster.bytes_end;
+        clusters.push_back(cluster);
+    }
+
+    // Clusters of the existing index. The index should describe the same trees with the same cluster size.
+    static std::vector<ClusterLocation> ReadClusterIndex(const std::string& file_name,
+                                                         const std::vector<std::string>& tree_names,
+                                                         Long64_t cluster_size)
+    {
+        namespace pt = boost::property_tree;
+        pt::ptree index;
+        try {
+            pt::read_json(file_name, index);
+        } catch(pt::json_parser_error& e) {
+            throw exception("Unable to read the cluster index of the existing output: %1%") % e.what();
+        }
+        std::vector<ClusterLocation> clusters;
+        try {
+            if(index.get<Long64_t>("cluster_size") != cluster_size)
+                throw exception("Cluster size of '%1%' is different from %2%.") % file_name % cluster_size;
+            std::vector<std::string> trees;
+            for(const auto& item : index.get_child("trees"))
+                trees.push_back(item.second.get_value<std::string>());
+            if(trees != tree_names)
+                throw exception("Trees of the cluster index '%1%' are different from the trees of the output.")
+                      % file_name;
+            for(const auto& item : index.get_child("clusters")) {
+                const pt::ptree& node = item.second;
+                if(node.get<size_t>("id") != clusters.size())
+                    throw exception("Unexpected id of the cluster %1% in '%2%'.") % clusters.size() % file_name;
+                ClusterLocation cluster;
+                for(const auto& range_item : node.get_child("entries")) {
+                    const auto range = ReadClusterRange(range_item.second);
+                    cluster.entries_begin.push_back(range.first);
+                    cluster.entries_end.push_back(range.second);
+                }
+                if(cluster.entries_begin.size() != tree_names.size())
+                    throw exception("Unexpected number of entry ranges of the cluster %1% in '%2%'.")
+                          % clusters.size() % file_name;
+                std::tie(cluster.bytes_begin, cluster.bytes_end) = ReadClusterRange(node.get_child("bytes"));
+                clusters.push_back(cluster);
+            }
+        } catch(pt::ptree_error& e) {
+            throw exception("Malformed cluster index '%1%': %2%") % file_name % e.what();
+        }
+        return clusters;
+    }
+
+    // [begin, end) range stored as a JSON array with two numbers.
+    static std::pair<Long64_t, Long64_t> ReadClusterRange(const boost::property_tree::ptree& node)
+    {
+        std::vector<Long64_t> values;
+        for(const auto& item : node) {
+            if(!item.first.empty())
+                throw exception("Range of the cluster index should be an array.");
+            values.push_back(item.second.get_value<Long64_t>());
+        }
+        if(values.size() != 2 || values.at(0) > values.at(1))
+            throw exception("Invalid range of the cluster index.");
+        return { values.at(0), values.at(1) };
+    }
+
+    void WriteClusterIndex() const
+    {
+        std::ofstream json(indexFileName);
+        if(!json.is_open())
+            throw exception("Unable to create '%1%'.") % indexFileName;
+        json << "{\n    \"cluster_size\": " << clusterSize << ",\n    \"trees\": [";
+        for(size_t n = 0; n < treeNames.size(); ++n)
+            json << (n ? ", " : "") << "\"" << treeNames.at(n) << "\"";
+        json << "],\n    \"clusters\": [\n";
+        for(size_t id = 0; id < clusters.size(); ++id) {
+            const ClusterLocation& cluster = clusters.at(id);
+            json << "        { \"id\": " << id << ", \"entries\": [";
+            for(size_t n = 0; n < cluster.entries_begin.size(); ++n)
+                json << (n ? ", " : "") << "[" << cluster.entries_begin.at(n) << ", " << cluster.entries_end.at(n)
+                     << "]";
+            json << "], \"bytes\": [" << cluster.bytes_begin << ", " << cluster.bytes_end << "] }"
+                 << (id + 1 == clusters.size() ? "" : ",") << "\n";
+        }
+        json << "    ]\n}\n";
+        if(!json.good())
+            throw exception("Error while writing '%1%'.") % indexFileName;
+    }
+
+private:
+    std::shared_ptr<TFile> outputFile;
+    tau_tuple::TrainingTauTuple tauTuple;
+    TrainingCellTuple innerCellTuple, outerCellTuple;
+    std::unique_ptr<TrainingCellOccupancyTuple> occupancyTuple;
+    CompactCellOutput innerCompact, outerCompact;
+    std::vector<GridTuples> extraGridTuples;
+    std::unique_ptr<TrainingTupleManifest> manifest;
+    const std::string indexFileName;
+    const Long64_t clusterSize, firstTau;
+    const bool updateMode;
+    std::vector<std::string> treeNames;
+    std::vector<TTree*> trees;
+    std::vector<Long64_t> clusterBegin;
+    Long64_t clusterBytesBegin{0};
+    std::vector<ClusterLocation> clusters;
+    std::vector<uint8_t> compactFeatures;
+    std::vector<float> compactWorkspace;
+};
+
+} // namespace analysis
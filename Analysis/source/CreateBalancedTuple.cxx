@@ -6,7 +6,8 @@
 #include "AnalysisTools/Core/include/RootExt.h"
 #include "AnalysisTools/Core/include/NumericPrimitives.h"
 #include "TauML/Analysis/include/AnalysisTypes.h"
-#include "TauML/Analysis/include/TauTuple.h"
+#include "TauML/Analysis/include/TauTupleReader.h"
+#include "TauML/Analysis/include/AsyncTupleWriter.h"
 
 namespace analysis {
 
@@ -20,6 +21,7 @@ struct Arguments {
     OPT_ARG(bool, take_only_odd_event_ids, false);
     OPT_ARG(bool, take_only_even_event_ids, false);
     OPT_ARG(bool, use_tau_p4, true);
+    OPT_ARG(unsigned, n_threads, 1);
 };
 
 
@@ -131,6 +133,8 @@ class CreateBalancedTuple {
 public:
     using Tau = tau_tuple::Tau;
     using TauTuple = tau_tuple::TauTuple;
+    using TwoPhaseTauTupleReader = tau_tuple::TwoPhaseTauTupleReader;
+    using TauTupleWriter = AsyncTupleWriter<TauTuple>;
     using BinRange = EntryCountMap::BinRange;
 
     static const std::vector<TauType> TauTypeList()
@@ -142,6 +146,9 @@ public:
     CreateBalancedTuple(const Arguments& _args) :
         args(_args)
     {
+        if(args.n_threads() > 1)
+            ROOT::EnableImplicitMT(args.n_threads());
+
         std::ifstream cfg(args.input_list());
         if(cfg.fail())
             throw exception("Failed to open config '%1%'.") % args.input_list();
@@ -165,17 +172,20 @@ public:
         std::cout << "Creating tuple with balanced (pt, eta) bins..." << std::endl;
         std::map<TauType, std::shared_ptr<TFile>> output_files;
         std::map<TauType, std::shared_ptr<TauTuple>> output_tuples;
+        std::map<TauType, std::shared_ptr<TauTupleWriter>> output_writers;
 
         for(TauType tau_type : TauTypeList()) {
             const std::string output_file_name = args.output_dir() + "/" + ToString(tau_type) + ".root";
             output_files[tau_type] = root_ext::CreateRootFile(output_file_name, ROOT::kLZ4, 5);
             output_tuples[tau_type] = std::make_shared<TauTuple>(args.tree_name(),
                     output_files.at(tau_type).get(), false);
+            output_writers[tau_type] = std::make_shared<TauTupleWriter>(output_tuples.at(tau_type));
         }
 
-        ProcessInputs(output_tuples);
+        ProcessInputs(output_writers);
 
         for(TauType tau_type : TauTypeList()) {
+            output_writers.at(tau_type)->Finish();
             output_tuples.at(tau_type)->Write();
             const auto hist = count_maps.at(tau_type)->ExportCounts();
             root_ext::WriteObject(hist, output_files.at(tau_type).get());
@@ -218,47 +228,48 @@ private:
         }
     }
 
-    void ProcessInputs(const std::map<TauType, std::shared_ptr<TauTuple>>& output_tuples)
+    void ProcessInputs(const std::map<TauType, std::shared_ptr<TauTupleWriter>>& output_writers)
     {
+        // Branches used by the selection. Other branches are read only for the accepted taus.
+        static const std::set<std::string> selection_branches = {
+            "evt", "tau_index", "lepton_gen_match", "sampleType", "tau_pt", "tau_eta", "jet_pt", "jet_eta"
+        };
+
         std::map<TauType, size_t> prev_counts;
         for(const auto& file_name : input_files) {
             std::cout << "Processing '" << file_name << "'..." << std::endl;
-            auto file = root_ext::OpenRootFile(file_name);
-            auto tuple = std::make_shared<TauTuple>(args.tree_name(), file.get(), true);
-            Long64_t n_processed = 0, n_total = tuple->GetEntries();
-            for(const auto& tau : *tuple) {
-                if(args.take_only_odd_event_ids() && tau.evt % 2 == 0) continue;
-                if(args.take_only_even_event_ids() && tau.evt % 2 != 0) continue;
-                if(args.use_tau_p4() && tau.tau_index < 0) continue;
-                const GenLeptonMatch gen_match = static_cast<GenLeptonMatch>(tau.lepton_gen_match);
-                const TauType tau_type = GenMatchToTauType(gen_match);
-                if(!output_tuples.count(tau_type)) continue;
+            TwoPhaseTauTupleReader reader(file_name, args.tree_name(), selection_branches);
+            Long64_t n_processed = 0, n_reported = 0, n_total = reader.GetEntries();
+            // Once the counts are complete, the remaining taus of the block are not counted, so each counted tau is
+            // stored.
+            const auto select = [&](const Tau& tau) {
+                ++n_processed;
+                if(AllComplete()) return false;
+                if(args.take_only_odd_event_ids() && tau.evt % 2 == 0) return false;
+                if(args.take_only_even_event_ids() && tau.evt % 2 != 0) return false;
+                if(args.use_tau_p4() && tau.tau_index < 0) return false;
+                const TauType tau_type = GetTauType(tau);
+                if(!output_writers.count(tau_type)) return false;
                 const float pt = args.use_tau_p4() ? tau.tau_pt : tau.jet_pt;
                 const float eta = args.use_tau_p4() ? tau.tau_eta : tau.jet_eta;
-                if(count_maps.at(tau_type)->AddEntry(pt, eta)) {
-                    (*output_tuples.at(tau_type))() = tau;
-                    output_tuples.at(tau_type)->Fill();
-
-                    bool all_complete = true;
-                    for(const auto& m : count_maps) {
-                        if(!m.second->IsComplete()) {
-                            all_complete = false;
-                            break;
-                        }
-                    }
-                    if(all_complete) return;
+                return count_maps.at(tau_type)->AddEntry(pt, eta);
+            };
+            const auto store = [&](const Tau& tau) {
+                auto& output_writer = *output_writers.at(GetTauType(tau));
+                output_writer() = tau;
+                output_writer.Fill();
+                return true;
+            };
+            // Called between the blocks, when all taus accepted so far are stored.
+            const auto stop = [&]() {
+                if(n_processed - n_reported >= 100000) {
+                    ReportProgress(n_processed, n_total);
+                    n_reported = n_processed;
                 }
-                if(++n_processed % 100000 == 0) {
-                    std::cout << "\tProcessed " << n_processed << " entries out of " << n_total
-                              << ". Number of accepted taus (";
-                    for(size_t n = 0; n < TauTypeList().size() - 1; ++n)
-                        std::cout << TauTypeList().at(n) << ", ";
-                    std::cout << TauTypeList().back() << "): ";
-                    for(size_t n = 0; n < TauTypeList().size() - 1; ++n)
-                        std::cout << count_maps.at(TauTypeList().at(n))->TotalCount() << ", ";
-                    std::cout << count_maps.at(TauTypeList().back())->TotalCount() << "." << std::endl;
-                }
-            }
+                return AllComplete();
+            };
+            reader.ForEach(0, n_total, select, store, stop);
+            if(AllComplete()) return;
             for(TauType tau_type : TauTypeList()) {
                 ReportStatus(tau_type, false, true, prev_counts[tau_type], static_cast<size_t>(n_total));
                 prev_counts[tau_type] = count_maps.at(tau_type)->TotalCount();
@@ -266,6 +277,33 @@ private:
         }
     }
 
+    static TauType GetTauType(const Tau& tau)
+    {
+        const GenLeptonMatch gen_match = static_cast<GenLeptonMatch>(tau.lepton_gen_match);
+        return GenMatchToTauType(gen_match, static_cast<SampleType>(tau.sampleType));
+    }
+
+    bool AllComplete() const
+    {
+        for(const auto& m : count_maps) {
+            if(!m.second->IsComplete())
+                return false;
+        }
+        return true;
+    }
+
+    void ReportProgress(Long64_t n_processed, Long64_t n_total) const
+    {
+        std::cout << "\tProcessed " << n_processed << " entries out of " << n_total
+                  << ". Number of accepted taus (";
+        for(size_t n = 0; n < TauTypeList().size() - 1; ++n)
+            std::cout << TauTypeList().at(n) << ", ";
+        std::cout << TauTypeList().back() << "): ";
+        for(size_t n = 0; n < TauTypeList().size() - 1; ++n)
+            std::cout << count_maps.at(TauTypeList().at(n))->TotalCount() << ", ";
+        std::cout << count_maps.at(TauTypeList().back())->TotalCount() << "." << std::endl;
+    }
+
 private:
     Arguments args;
     std::map<TauType, std::shared_ptr<EntryCountMap>> count_maps;
@@ -4,6 +4,7 @@
 #include "AnalysisTools/Run/include/program_main.h"
 #include "TauML/Analysis/include/TauTuple.h"
 #include "TauML/Analysis/include/SummaryTuple.h"
+#include "TauML/Analysis/include/AsyncTupleWriter.h"
 #include "AnalysisTools/Core/include/RootFilesMerger.h"
 
 struct Arguments {
@@ -31,20 +32,27 @@ public:
     MergeTuples(const Arguments& args) :
         RootFilesMerger(args.output(), args.input_dirs(), args.file_name_pattern(), args.exclude_list(),
                         args.exclude_dir_list(), args.n_threads(), ROOT::kZLIB, 9),
-        output_tauTuple("taus", output_file.get(), false), output_summaryTuple("summary", output_file.get(), false),
-        n_total_duplicates(0)
+        output_tauTuple(std::make_shared<TauTuple>("taus", output_file.get(), false)),
+        output_tauWriter(output_tauTuple),
+        output_summaryTuple("summary", output_file.get(), false), n_total_duplicates(0)
     {
+        output_summaryTuple().exeTime = 0;
+        output_summaryTuple().numberOfProcessedEvents = 0;
     }
 
     void Run()
     {
         Process(false, false);
 
-        output_tauTuple.Write();
+        // The total summary is filled after the taus are written, because both trees are stored in the same file.
+        output_tauWriter.Finish();
+        output_summaryTuple.Fill();
+
+        output_tauTuple->Write();
         output_summaryTuple.Write();
 
         std::cout << "All file has been merged. Number of files = " << input_files.size()
-                  << ". Number of output entries = " << output_tauTuple.GetEntries()
+                  << ". Number of output entries = " << output_tauTuple->GetEntries()
                   << ". Total number of duplicated entires = " << n_total_duplicates << "." << std::endl;
     }
 
@@ -60,22 +68,23 @@ private:
                 continue;
             }
             processed_entries.insert(entry_id);
-            output_tauTuple() = tau;
-            output_tauTuple.Fill();
+            output_tauWriter() = tau;
+            output_tauWriter.Fill();
         }
         n_total_duplicates += n_duplicates;
 
         SummaryTuple input_summaryTuple("summary", file.get(), true);
         for(const ProdSummary& summary : input_summaryTuple) {
-            output_summaryTuple() = summary;
-            output_summaryTuple.Fill();
+            output_summaryTuple().exeTime += summary.exeTime;
+            output_summaryTuple().numberOfProcessedEvents += summary.numberOfProcessedEvents;
         }
 
         std::cout << "\tn_entries = " << input_tauTuple.GetEntries() << ", n_duplicates = " << n_duplicates << ".\n";
     }
 
 private:
-    TauTuple output_tauTuple;
+    std::shared_ptr<TauTuple> output_tauTuple;
+    AsyncTupleWriter<TauTuple> output_tauWriter;
     SummaryTuple output_summaryTuple;
     EntryIdSet processed_entries;
     size_t n_total_duplicates;
@@ -1,9 +1,18 @@
 /*! Merges and shuffles input files into one.
 */
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <list>
+#include <mutex>
+#include <numeric>
 #include <random>
+#include <thread>
 #include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/regex.hpp>
 
 #include "AnalysisTools/Run/include/program_main.h"
@@ -11,6 +20,7 @@
 #include "AnalysisTools/Core/include/PropertyConfigReader.h"
 #include "AnalysisTools/Core/include/ProgressReporter.h"
 #include "TauML/Analysis/include/TauTuple.h"
+#include "TauML/Analysis/include/AsyncTupleWriter.h"
 
 namespace analysis {
 
@@ -34,25 +44,51 @@ struct Arguments {
     run::Argument<size_t> max_bin_occupancy{"max-bin-occupancy", "maximal occupancy of a bin",
                                             std::numeric_limits<size_t>::max()};
     run::Argument<unsigned> n_threads{"n-threads", "number of threads", 1};
+    run::Argument<unsigned> n_reader_threads{"n-reader-threads", "number of threads that read the input entries ahead"
+        " of their use. 0 - entries are read when they are sampled", 0};
+    run::Argument<size_t> prefetch_depth{"prefetch-depth", "maximal number of entries read ahead per source", 8};
+    run::Argument<size_t> max_open_files{"max-open-files", "maximal number of input files that are open at the same"
+        " time, split evenly between the shard workers. Files of the least recently read sources are closed and"
+        " reopened when needed. 0 - no limit", 0};
+    run::Argument<double> max_cache_memory{"max-cache-memory", "total size in MB of the read caches of the input"
+        " trees, shared between the sources in proportion to their sampling rate. 0 - default caches of ROOT", 0};
     run::Argument<unsigned> seed{"seed", "random seed to initialize the generator used for sampling", 1234567};
+    run::Argument<unsigned> n_shards{"n-shards", "number of files into which each output is split. Shard k contains"
+        " the k-th contiguous range of the output entries and is stored as <output>_<k>.root", 1};
+    run::Argument<int> shard{"shard", "index of the shard to write. -1 - all shards", -1};
+    run::Argument<unsigned> n_shard_workers{"n-shard-workers", "number of shards that are written in parallel", 1};
+    run::Argument<std::string> plan_file{"plan-file", "file with the sampling plan. If the file exists, the plan is"
+        " read from it, otherwise the computed plan is stored into it", ""};
+    run::Argument<bool> plan_only{"plan-only", "only compute the sampling plan and store it into the plan file",
+                                  false};
     run::Argument<std::string> disabled_branches{"disabled-branches",
                                                  "list of branches to disabled in the input tuples", ""};
 };
 
 namespace {
 
+class SourcePrefetcher;
+class SourceFilePool;
+
+// Input files of one configuration entry in one bin. Entries of the source are numbered consecutively through
+// the files, using the numbers of entries per file from the size list. Only the entries set by SetEntries are read.
 struct SourceDesc {
     using Tau = tau_tuple::Tau;
     using TauTuple = tau_tuple::TauTuple;
     using SampleType = analysis::SampleType;
 
-    SourceDesc(const std::string& _name, const std::vector<std::string>& _file_names, size_t _total_n_events,
-               double _weight, const std::set<std::string>& _disabled_branches, SampleType _sample_type) :
-        name(_name), file_names(_file_names), disabled_branches(_disabled_branches), weight(_weight),
-        sample_type(_sample_type), current_n_processed(0), total_n_processed(0), total_n_events(_total_n_events)
+    SourceDesc(const std::string& _name, const std::vector<std::string>& _file_names,
+               const std::vector<size_t>& _file_n_events, double _weight,
+               const std::set<std::string>& _disabled_branches, SampleType _sample_type) :
+        name(_name), file_names(_file_names), file_n_events(_file_n_events), disabled_branches(_disabled_branches),
+        weight(_weight), sample_type(_sample_type), current_file_begin(0), total_n_processed(0), n_read(0),
+        total_n_events(std::accumulate(file_n_events.begin(), file_n_events.end(), size_t(0))),
+        prefetcher(nullptr), prefetch_id(0), file_pool(nullptr), cache_size(-1), applied_cache_size(-1)
     {
         if(file_names.empty())
             throw analysis::exception("Empty list of files for the source '%1%'.") % name;
+        if(file_n_events.size() != file_names.size())
+            throw analysis::exception("Inconsistent number of entries per file for the source '%1%'.") % name;
         if(weight <= 0)
             throw analysis::exception("Invalid source weight for the source '%1%'.") % name;
         if(!total_n_events)
@@ -61,61 +97,555 @@ struct SourceDesc {
 
     SourceDesc(const SourceDesc&) = delete;
     SourceDesc& operator=(const SourceDesc&) = delete;
+    ~SourceDesc();
 
-    bool HasNextTau() const { return total_n_processed < total_n_events; }
-    const Tau& GetNextTau()
+    // Entries to be read, in increasing order.
+    void SetEntries(std::vector<size_t>&& _entries)
     {
-        if(!HasNextTau())
-            throw analysis::exception("No taus are available in the source '%1%' in bin '%2%'.") % name % bin_name;
-
-        while(!current_file_index || current_n_processed == current_tuple->GetEntries()) {
-            if(!current_file_index)
-                current_file_index = 0;
-            else
-                ++(*current_file_index);
-            if(*current_file_index >= file_names.size())
-                throw analysis::exception("The expected number of events = %1% is bigger than the actual number of"
-                                          " events in source '%2%'.") % total_n_events % name;
-            current_n_processed = 0;
-            const std::string& file_name = file_names.at(*current_file_index);
-            current_tuple.reset();
-            current_file = root_ext::OpenRootFile(file_name);
-            current_tuple = std::make_shared<TauTuple>("taus", current_file.get(), true, disabled_branches);
-        }
-        ++total_n_processed;
-        current_tuple->GetEntry(current_n_processed++);
+        if(total_n_processed || n_read)
+            throw analysis::exception("Entries of the source '%1%' have already been read.") % name;
+        const bool in_range = _entries.empty() || _entries.back() < total_n_events;
+        if(!in_range || !std::is_sorted(_entries.begin(), _entries.end()))
+            throw analysis::exception("Invalid list of entries for the source '%1%'.") % name;
+        entries = std::move(_entries);
+    }
+
+    size_t GetNumberOfPlannedEntries() const { return entries.size(); }
+    size_t GetNumberOfRemainingEntries() const { return entries.size() - total_n_processed; }
+    bool HasNextTau() const { return total_n_processed < entries.size(); }
+    const Tau& GetNextTau();
+
+    // Reads the next entry from the input files. With prefetching, it is called only by the reader threads.
+    // With the file pool, the source should be acquired from the pool.
+    Tau& ReadTau()
+    {
+        if(n_read >= entries.size())
+            throw analysis::exception("All planned entries of the source '%1%' have already been read.") % name;
+        const size_t entry = entries.at(n_read++);
+        if(!current_file_index) {
+            current_file_index = 0;
+            current_file_begin = 0;
+        }
+        size_t file_index = *current_file_index;
+        while(entry >= current_file_begin + file_n_events.at(file_index))
+            current_file_begin += file_n_events.at(file_index++);
+        if(file_index != *current_file_index || !current_tuple) {
+            current_file_index = file_index;
+            OpenCurrentFile();
+        }
+        ApplyCacheSize();
+        current_tuple->GetEntry(static_cast<Long64_t>(entry - current_file_begin));
         (*current_tuple)().sampleType = static_cast<int>(sample_type);
-        return current_tuple->data();
+        return (*current_tuple)();
+    }
+
+    // Closes the current file. The position in the input is kept, and the file is reopened by the next ReadTau.
+    void CloseFile()
+    {
+        current_tuple.reset();
+        current_file.reset();
+    }
+
+    // Size in bytes of the read cache of the input tree. It is applied by the thread that reads the source before
+    // the next entry is read. Negative size means the default cache of ROOT.
+    void SetCacheSize(Long64_t size) { cache_size = size; }
+
+    SourceFilePool* GetFilePool() const { return file_pool; }
+    void SetFilePool(SourceFilePool* _file_pool) { file_pool = _file_pool; }
+
+    void SetPrefetcher(SourcePrefetcher* _prefetcher, size_t _prefetch_id)
+    {
+        prefetcher = _prefetcher;
+        prefetch_id = _prefetch_id;
     }
 
     size_t GetNumberOfEvents() const { return total_n_events; }
     const std::string& GetName() const { return name; }
     const std::vector<std::string>& GetFileNames() const { return file_names; }
+    const std::vector<size_t>& GetFileNumberOfEvents() const { return file_n_events; }
     double GetWeight() const { return weight; }
+    SampleType GetSampleType() const { return sample_type; }
     const std::string& GetBinName() const { return bin_name; }
     void SetBinName(const std::string& _bin_name) { bin_name = _bin_name; }
 
 private:
     const std::string name;
     const std::vector<std::string> file_names;
+    const std::vector<size_t> file_n_events;
     const std::set<std::string> disabled_branches;
     const double weight;
     const SampleType sample_type;
     std::string bin_name;
+    std::vector<size_t> entries;
     boost::optional<size_t> current_file_index;
+    size_t current_file_begin;
     std::shared_ptr<TFile> current_file;
     std::shared_ptr<TauTuple> current_tuple;
-    Long64_t current_n_processed;
-    size_t total_n_processed, total_n_events;
+    size_t total_n_processed, n_read, total_n_events;
+    SourcePrefetcher* prefetcher;
+    size_t prefetch_id;
+    SourceFilePool* file_pool;
+    std::atomic<Long64_t> cache_size;
+    Long64_t applied_cache_size;
+
+    void OpenCurrentFile()
+    {
+        current_tuple.reset();
+        current_file = root_ext::OpenRootFile(file_names.at(*current_file_index));
+        current_tuple = std::make_shared<TauTuple>("taus", current_file.get(), true, disabled_branches);
+        const size_t n_entries = static_cast<size_t>(current_tuple->GetEntries());
+        if(n_entries != file_n_events.at(*current_file_index))
+            throw analysis::exception("Number of entries in '%1%' = %2% differs from the size list value = %3%.")
+                  % file_names.at(*current_file_index) % n_entries % file_n_events.at(*current_file_index);
+        applied_cache_size = -1;
+    }
+
+    void ApplyCacheSize()
+    {
+        const Long64_t size = cache_size;
+        if(size < 0 || size == applied_cache_size) return;
+        TTree* tree = dynamic_cast<TTree*>(current_file->Get("taus"));
+        if(!tree)
+            throw analysis::exception("Tree 'taus' is not found in '%1%'.") % file_names.at(*current_file_index);
+        tree->SetCacheSize(size);
+        applied_cache_size = size;
+    }
 };
 
-class EventBin {
+// Limits the number of sources with open files. A source is acquired before reading and released afterwards.
+// When the limit is exceeded, the files of the least recently acquired sources that are not in use are closed.
+// Sources in use are never closed, so the limit can be exceeded if all sources with open files are in use.
+class SourceFilePool {
+public:
+    explicit SourceFilePool(size_t _max_open_files) : max_open_files(_max_open_files)
+    {
+        if(!max_open_files)
+            throw analysis::exception("Maximal number of open files should be positive.");
+    }
+
+    void Acquire(SourceDesc& source)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = entries.find(&source);
+        if(iter == entries.end()) {
+            recent.push_front(&source);
+            iter = entries.emplace(&source, Entry{recent.begin(), 0}).first;
+        } else {
+            recent.splice(recent.begin(), recent, iter->second.position);
+        }
+        ++iter->second.n_users;
+        for(auto pos = recent.end(); recent.size() > max_open_files && pos != recent.begin();) {
+            --pos;
+            auto entry = entries.find(*pos);
+            if(entry->second.n_users) continue;
+            (*pos)->CloseFile();
+            entries.erase(entry);
+            pos = recent.erase(pos);
+        }
+    }
+
+    void Release(SourceDesc& source)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        --entries.at(&source).n_users;
+    }
+
+    // Forgets the source before it is destroyed.
+    void Remove(SourceDesc& source)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = entries.find(&source);
+        if(iter == entries.end()) return;
+        recent.erase(iter->second.position);
+        entries.erase(iter);
+    }
+
+private:
+    struct Entry {
+        std::list<SourceDesc*>::iterator position;
+        size_t n_users;
+    };
+
+    const size_t max_open_files;
+    std::list<SourceDesc*> recent;
+    std::map<SourceDesc*, Entry> entries;
+    std::mutex mutex;
+};
+
+// Keeps the source acquired from its file pool, if any, during the lifetime of the object.
+class SourceFileLease {
+public:
+    explicit SourceFileLease(SourceDesc& _source) : source(&_source)
+    {
+        if(source->GetFilePool())
+            source->GetFilePool()->Acquire(*source);
+    }
+
+    SourceFileLease(const SourceFileLease&) = delete;
+    SourceFileLease& operator=(const SourceFileLease&) = delete;
+
+    ~SourceFileLease()
+    {
+        if(source->GetFilePool())
+            source->GetFilePool()->Release(*source);
+    }
+
+private:
+    SourceDesc* source;
+};
+
+// Shared pool of reader threads that read the entries of the sources ahead of their use. Each source has a queue of
+// at most max_depth entries, which is refilled by one reader at a time, so the entries of a source are read in the
+// same order as without prefetching. Sources are refilled in the order of the expected time until their queue is
+// exhausted: the number of the queued entries divided by the remaining number of entries that will be sampled from
+// the source. Only the planned number of entries is read from each source.
+class SourcePrefetcher {
 public:
     using Tau = tau_tuple::Tau;
-    using TauTuple = tau_tuple::TauTuple;
+
+    SourcePrefetcher(size_t n_threads, size_t _max_depth) :
+        max_depth(_max_depth), stop(false)
+    {
+        if(!max_depth)
+            throw analysis::exception("Prefetch depth should be positive.");
+        ROOT::EnableThreadSafety();
+        for(size_t n = 0; n < n_threads; ++n)
+            threads.emplace_back(&SourcePrefetcher::Run, this);
+    }
+
+    SourcePrefetcher(const SourcePrefetcher&) = delete;
+    SourcePrefetcher& operator=(const SourcePrefetcher&) = delete;
+
+    ~SourcePrefetcher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cond_var.notify_all();
+        for(auto& thread : threads)
+            thread.join();
+    }
+
+    // Entries of the source should be set before it is added.
+    void AddSource(SourceDesc& source)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            source.SetPrefetcher(this, states.size());
+            states.push_back(std::make_unique<SourceState>(source, source.GetNumberOfPlannedEntries()));
+        }
+        cond_var.notify_all();
+    }
+
+    // The returned entry is valid until the next call for the same source.
+    const Tau& Pop(size_t prefetch_id)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        SourceState& state = *states.at(prefetch_id);
+        if(state.n_consumed >= state.n_planned)
+            throw analysis::exception("Number of entries sampled from the source '%1%' is above the planned %2%.")
+                  % state.source->GetName() % state.n_planned;
+        cond_var.wait(lock, [&] { return !state.ready.empty() || state.error; });
+        if(state.ready.empty())
+            std::rethrow_exception(state.error);
+        if(state.current)
+            state.unused.push_back(std::move(state.current));
+        state.current = std::move(state.ready.front());
+        state.ready.pop_front();
+        ++state.n_consumed;
+        lock.unlock();
+        cond_var.notify_all();
+        return *state.current;
+    }
+
+private:
+    struct SourceState {
+        SourceDesc* source;
+        const size_t n_planned;
+        size_t n_read{0}, n_consumed{0};
+        bool reading{false};
+        std::deque<std::unique_ptr<Tau>> ready;
+        std::vector<std::unique_ptr<Tau>> unused;
+        std::unique_ptr<Tau> current;
+        std::exception_ptr error;
+
+        SourceState(SourceDesc& _source, size_t _n_planned) : source(&_source), n_planned(_n_planned) {}
+    };
+
+    // The most urgent source that can be refilled, or nullptr.
+    SourceState* FindSourceToRead() const
+    {
+        SourceState* best = nullptr;
+        for(const auto& state : states) {
+            if(state->reading || state->error || state->n_read >= state->n_planned
+                    || state->ready.size() >= max_depth) continue;
+            const size_t n_remaining = state->n_planned - state->n_consumed;
+            if(!best || state->ready.size() * (best->n_planned - best->n_consumed)
+                        < best->ready.size() * n_remaining)
+                best = state.get();
+        }
+        return best;
+    }
+
+    void Run()
+    {
+        std::vector<std::unique_ptr<Tau>> taus;
+        while(true) {
+            SourceState* state = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond_var.wait(lock, [&] { return stop || (state = FindSourceToRead()) != nullptr; });
+                if(stop) return;
+                state->reading = true;
+                const size_t n_to_read = std::min(max_depth - state->ready.size(), state->n_planned - state->n_read);
+                for(size_t n = 0; n < n_to_read; ++n) {
+                    if(state->unused.empty()) {
+                        taus.push_back(std::make_unique<Tau>());
+                    } else {
+                        taus.push_back(std::move(state->unused.back()));
+                        state->unused.pop_back();
+                    }
+                }
+            }
+            std::exception_ptr error;
+            size_t n_read = 0;
+            try {
+                SourceFileLease lease(*state->source);
+                for(; n_read < taus.size(); ++n_read)
+                    std::swap(*taus.at(n_read), state->source->ReadTau());
+            } catch(...) {
+                error = std::current_exception();
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for(size_t n = 0; n < taus.size(); ++n) {
+                    if(n < n_read)
+                        state->ready.push_back(std::move(taus.at(n)));
+                    else
+                        state->unused.push_back(std::move(taus.at(n)));
+                }
+                state->n_read += n_read;
+                state->error = error;
+                state->reading = false;
+            }
+            taus.clear();
+            cond_var.notify_all();
+        }
+    }
+
+private:
+    const size_t max_depth;
+    bool stop;
+    std::vector<std::unique_ptr<SourceState>> states;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable cond_var;
+};
+
+SourceDesc::~SourceDesc()
+{
+    if(file_pool)
+        file_pool->Remove(*this);
+}
+
+const SourceDesc::Tau& SourceDesc::GetNextTau()
+{
+    if(!HasNextTau())
+        throw analysis::exception("No taus are available in the source '%1%' in bin '%2%'.") % name % bin_name;
+    ++total_n_processed;
+    if(prefetcher)
+        return prefetcher->Pop(prefetch_id);
+    // Without prefetching, files of the pool are closed only while reading, so the entry stays valid until the next
+    // read, as long as the pool is not shared with the sources consumed by other threads.
+    SourceFileLease lease(*this);
+    return ReadTau();
+}
+
+// Sampler of indices with probabilities proportional to integer weights. Weights are stored in a Fenwick tree,
+// so that both the draw and the update of a weight take O(log n).
+class WeightedIndexSampler {
+public:
     using Generator = std::mt19937_64;
     using Uniform = std::uniform_int_distribution<size_t>;
 
+    WeightedIndexSampler() : total_weight(0), top_step(0) {}
+
+    explicit WeightedIndexSampler(const std::vector<size_t>& _weights) :
+        weights(_weights), tree(weights.size() + 1, 0), total_weight(0), top_step(1)
+    {
+        const size_t n = weights.size();
+        for(size_t k = 1; k <= n; ++k) {
+            tree[k] += weights[k - 1];
+            const size_t parent = k + (k & (~k + 1));
+            if(parent <= n)
+                tree[parent] += tree[k];
+            total_weight += weights[k - 1];
+        }
+        while(top_step * 2 <= n)
+            top_step *= 2;
+    }
+
+    size_t GetTotalWeight() const { return total_weight; }
+    size_t GetWeight(size_t index) const { return weights.at(index); }
+
+    void SetWeight(size_t index, size_t weight)
+    {
+        const size_t old_weight = weights.at(index);
+        weights[index] = weight;
+        total_weight = total_weight - old_weight + weight;
+        for(size_t k = index + 1; k < tree.size(); k += k & (~k + 1))
+            tree[k] = tree[k] - old_weight + weight;
+    }
+
+    size_t Draw(Generator& gen) const
+    {
+        if(!total_weight)
+            throw analysis::exception("Unable to draw from the sampler with the zero total weight.");
+        return Find(Uniform(0, total_weight - 1)(gen));
+    }
+
+    // Index k such that the sum of the weights before k is <= position and the sum up to k inclusive is > position.
+    size_t Find(size_t position) const
+    {
+        size_t index = 0;
+        for(size_t step = top_step; step; step /= 2) {
+            if(index + step < tree.size() && tree[index + step] <= position) {
+                index += step;
+                position -= tree[index];
+            }
+        }
+        return index;
+    }
+
+private:
+    std::vector<size_t> weights, tree;
+    size_t total_weight, top_step;
+};
+
+// Sources of the output entries, drawn before the inputs are read. The k-th draw of a source corresponds to its k-th
+// entry, so an output entry is identified by the index of its source and the number of the previous draws of the
+// same source. Plans of all outputs are stored in a binary file in the native byte order.
+struct SamplingPlan {
+    using SampleType = analysis::SampleType;
+
+    struct Source {
+        std::string name;
+        SampleType sample_type;
+        double weight, bin_weight;
+        std::vector<std::string> file_names;
+        std::vector<size_t> file_n_events;
+    };
+
+    std::string output;
+    bool has_weights{false};
+    std::vector<Source> sources;
+    std::vector<uint32_t> draws;
+
+    static void WriteList(const std::string& file_name, const std::vector<SamplingPlan>& plans)
+    {
+        std::ofstream file(file_name, std::ios::binary);
+        if(!file.is_open())
+            throw analysis::exception("Unable to create '%1%'.") % file_name;
+        file.write(magic, sizeof(magic));
+        WriteValue<uint64_t>(file, plans.size());
+        for(const SamplingPlan& plan : plans) {
+            WriteString(file, plan.output);
+            WriteValue<uint8_t>(file, plan.has_weights);
+            WriteValue<uint64_t>(file, plan.sources.size());
+            for(const Source& source : plan.sources) {
+                WriteString(file, source.name);
+                WriteValue<int32_t>(file, static_cast<int32_t>(source.sample_type));
+                WriteValue<double>(file, source.weight);
+                WriteValue<double>(file, source.bin_weight);
+                WriteValue<uint64_t>(file, source.file_names.size());
+                for(size_t n = 0; n < source.file_names.size(); ++n) {
+                    WriteString(file, source.file_names.at(n));
+                    WriteValue<uint64_t>(file, source.file_n_events.at(n));
+                }
+            }
+            WriteValue<uint64_t>(file, plan.draws.size());
+            file.write(reinterpret_cast<const char*>(plan.draws.data()),
+                       static_cast<std::streamsize>(plan.draws.size() * sizeof(uint32_t)));
+        }
+        if(!file.good())
+            throw analysis::exception("Error while writing '%1%'.") % file_name;
+    }
+
+    static std::vector<SamplingPlan> ReadList(const std::string& file_name)
+    {
+        std::ifstream file(file_name, std::ios::binary);
+        if(!file.is_open())
+            throw analysis::exception("Unable to open '%1%'.") % file_name;
+        char file_magic[sizeof(magic)];
+        file.read(file_magic, sizeof(file_magic));
+        if(!file.good() || !std::equal(file_magic, file_magic + sizeof(magic), magic))
+            throw analysis::exception("'%1%' is not a sampling plan file.") % file_name;
+        std::vector<SamplingPlan> plans(ReadValue<uint64_t>(file));
+        for(SamplingPlan& plan : plans) {
+            plan.output = ReadString(file);
+            plan.has_weights = ReadValue<uint8_t>(file);
+            plan.sources.resize(ReadValue<uint64_t>(file));
+            for(Source& source : plan.sources) {
+                source.name = ReadString(file);
+                source.sample_type = static_cast<SampleType>(ReadValue<int32_t>(file));
+                source.weight = ReadValue<double>(file);
+                source.bin_weight = ReadValue<double>(file);
+                const size_t n_files = ReadValue<uint64_t>(file);
+                for(size_t n = 0; n < n_files; ++n) {
+                    source.file_names.push_back(ReadString(file));
+                    source.file_n_events.push_back(ReadValue<uint64_t>(file));
+                }
+            }
+            plan.draws.resize(ReadValue<uint64_t>(file));
+            file.read(reinterpret_cast<char*>(plan.draws.data()),
+                      static_cast<std::streamsize>(plan.draws.size() * sizeof(uint32_t)));
+            if(!file.good())
+                throw analysis::exception("Error while reading '%1%'.") % file_name;
+            for(uint32_t source : plan.draws) {
+                if(source >= plan.sources.size())
+                    throw analysis::exception("Invalid source index = %1% in '%2%'.") % source % file_name;
+            }
+        }
+        if(!file.good())
+            throw analysis::exception("Error while reading '%1%'.") % file_name;
+        return plans;
+    }
+
+private:
+    static constexpr char magic[8] = { 'S', 'M', 'P', 'L', 'A', 'N', '0', '1' };
+
+    template<typename T>
+    static void WriteValue(std::ostream& os, T value) { os.write(reinterpret_cast<const char*>(&value), sizeof(T)); }
+
+    template<typename T>
+    static T ReadValue(std::istream& is)
+    {
+        T value{};
+        is.read(reinterpret_cast<char*>(&value), sizeof(T));
+        return value;
+    }
+
+    static void WriteString(std::ostream& os, const std::string& str)
+    {
+        WriteValue<uint64_t>(os, str.size());
+        os.write(str.data(), static_cast<std::streamsize>(str.size()));
+    }
+
+    static std::string ReadString(std::istream& is)
+    {
+        std::string str(ReadValue<uint64_t>(is), '\0');
+        is.read(&str[0], static_cast<std::streamsize>(str.size()));
+        return str;
+    }
+};
+
+class EventBin {
+public:
+    using Tau = tau_tuple::Tau;
+    using TauTuple = tau_tuple::TauTuple;
+    using Generator = WeightedIndexSampler::Generator;
+
     EventBin(const std::string& _bin_name, double _bin_size, size_t _max_n_events, Generator& _gen) :
         bin_name(_bin_name), bin_size(_bin_size), max_n_events(_max_n_events), n_events(0), n_processed(0),
         bin_weight(1), gen(&_gen)
@@ -188,7 +718,7 @@ public:
 
         n_original_events = n_remaining_events;
         n_original_events_per_source = n_remaining_events_per_source;
-        distr = Uniform(0, n_original_events - 1);
+        sampler = WeightedIndexSampler(n_original_events_per_source);
     }
 
     const std::string& GetName() const { return bin_name; }
@@ -199,25 +729,25 @@ public:
     double GetBinWeight() const { return bin_weight; }
     void SetBinWeight(double weight) { bin_weight = weight; }
 
+    const std::vector<std::shared_ptr<SourceDesc>>& GetSources() const { return sources; }
+
     bool HasNextTau() const { return n_processed < GetEffectiveNumberOfEvents(); }
-    const Tau& GetNextTau()
+
+    // Index of the source of the next tau.
+    size_t DrawSource()
     {
         if(!HasNextTau())
             throw analysis::exception("No taus are available in the bin.");
         if(n_remaining_events_per_source.empty())
-            throw analysis::exception("CreateBalancedInputs should be called before the first GetNextTau call.");
+            throw analysis::exception("CreateBalancedInputs should be called before the first DrawSource call.");
 
-        size_t n;
-        do {
-            n = 0;
-            for(size_t index = distr(*gen); index >= n_original_events_per_source.at(n);
-                index -= n_original_events_per_source.at(n++));
-        } while(!n_remaining_events_per_source.at(n));
-
-        --n_remaining_events_per_source.at(n);
+        // Sources are drawn in proportion to their original number of events, excluding the exhausted sources.
+        const size_t n = sampler.Draw(*gen);
+        if(!--n_remaining_events_per_source.at(n))
+            sampler.SetWeight(n, 0);
         --n_remaining_events;
         ++n_processed;
-        return sources.at(n)->GetNextTau();
+        return n;
     }
 
     void PrintSummary() const
@@ -240,7 +770,7 @@ private:
     size_t n_events, n_processed;
     double bin_weight;
     Generator* gen;
-    Uniform distr;
+    WeightedIndexSampler sampler;
     std::vector<std::shared_ptr<SourceDesc>> sources;
     std::vector<size_t> n_remaining_events_per_source, n_original_events_per_source;
     size_t n_remaining_events, n_original_events;
@@ -355,12 +885,10 @@ public:
     using Tau = tau_tuple::Tau;
     using TauTuple = tau_tuple::TauTuple;
     using Generator = EventBin::Generator;
-    using Uniform = EventBin::Uniform;
 
     EventBinMap(const std::vector<EntryDesc>& entries, const std::vector<double>& pt_bins,
                 const std::vector<double>& eta_bins, bool calc_weights, size_t max_bin_occupancy, Generator& _gen,
-                const std::map<std::string, size_t>& n_events_per_file,
-                const std::set<std::string>& disabled_branches, bool verbose) :
+                const std::map<std::string, size_t>& n_events_per_file, bool verbose) :
         gen(&_gen)
     {
         double total_area;
@@ -369,7 +897,7 @@ public:
         const std::map<std::string, double> bin_sizes = CalculateBinSizes(pt_bins, eta_bins, total_area);
         if(verbose)
             std::cout << "done.\n\tCreating bins..." << std::endl;
-        CreateBins(entries, bin_sizes, max_bin_occupancy, n_events_per_file, disabled_branches, !calc_weights, verbose);
+        CreateBins(entries, bin_sizes, max_bin_occupancy, n_events_per_file, !calc_weights, verbose);
         if(calc_weights) {
             if(verbose)
                 std::cout << "\tCalculating weigts..." << std::endl;
@@ -386,26 +914,55 @@ public:
 
     size_t GetNumberOfRemainingEvents() const { return n_remaining_events; }
     bool HasNextTau() const { return n_remaining_events > 0; }
-    const Tau& GetNextTau(double& weight, bool& last_tau_in_bin)
+    // Draws the bin and the index of the source in the bin for the next tau.
+    void Draw(size_t& bin_index, size_t& source_index, bool& last_tau_in_bin)
     {
         if(!HasNextTau())
             throw analysis::exception("No taus are available.");
 
-        size_t n;
-        do {
-            n = 0;
-            for(size_t index = distr(*gen); index >= n_original_events_per_bin.at(n);
-                index -= n_original_events_per_bin.at(n++));
-        } while(!n_remaining_events_per_bin.at(n));
-
+        // Bins are drawn in proportion to their original number of events, excluding the exhausted bins.
+        const size_t n = sampler.Draw(*gen);
         --n_remaining_events_per_bin.at(n);
         --n_remaining_events;
         auto& bin = bins.at(n);
         last_tau_in_bin = !n_remaining_events_per_bin.at(n);
-        if(last_tau_in_bin)
+        if(last_tau_in_bin) {
+            sampler.SetWeight(n, 0);
             std::cout << "Bin " << bin.GetName() << " is empty." << std::endl;
-        weight = bin.GetBinWeight();
-        return bin.GetNextTau();
+        }
+        bin_index = n;
+        source_index = bin.DrawSource();
+    }
+
+    // Draws the sources of all output entries. With ensure_uniformity, drawing stops after the first bin is empty.
+    SamplingPlan CreatePlan(const std::string& output, bool calc_weights, bool ensure_uniformity)
+    {
+        SamplingPlan plan;
+        plan.output = output;
+        plan.has_weights = calc_weights;
+        std::vector<size_t> first_source;
+        for(const auto& bin : bins) {
+            first_source.push_back(plan.sources.size());
+            for(const auto& source : bin.GetSources()) {
+                plan.sources.push_back(SamplingPlan::Source{
+                    source->GetName(), source->GetSampleType(), source->GetWeight(), bin.GetBinWeight(),
+                    source->GetFileNames(), source->GetFileNumberOfEvents()
+                });
+            }
+        }
+        if(plan.sources.size() > std::numeric_limits<uint32_t>::max())
+            throw analysis::exception("Number of sources = %1% is too large for the sampling plan.")
+                  % plan.sources.size();
+        plan.draws.reserve(n_remaining_events);
+        bool has_empty_bins = false;
+        while(HasNextTau() && (!ensure_uniformity || !has_empty_bins)) {
+            size_t bin_index, source_index;
+            bool last_tau_in_bin;
+            Draw(bin_index, source_index, last_tau_in_bin);
+            has_empty_bins = has_empty_bins || last_tau_in_bin;
+            plan.draws.push_back(static_cast<uint32_t>(first_source.at(bin_index) + source_index));
+        }
+        return plan;
     }
 
     void PrintSummary() const
@@ -419,7 +976,7 @@ public:
 private:
     void CreateBins(const std::vector<EntryDesc>& entries, const std::map<std::string, double>& bin_sizes,
                     size_t max_bin_occupancy, const std::map<std::string, size_t>& n_events_per_file,
-                    const std::set<std::string>& disabled_branches, bool allow_empty_bins, bool verbose)
+                    bool allow_empty_bins, bool verbose)
     {
         std::set<TauType> tau_types;
         for(const auto& entry : entries)
@@ -448,16 +1005,16 @@ private:
                     //throw analysis::exception("Unknown bin name '%1%'.") % bin_name;
                 }
 
-                size_t n_events_bin = 0;
+                std::vector<size_t> file_n_events;
                 for(const auto& file_name : file_names) {
                     if(!n_events_per_file.count(file_name))
                         throw analysis::exception("Missing an information about the number of events for file '%1%'")
                               % file_name;
-                    n_events_bin += n_events_per_file.at(file_name);
+                    file_n_events.push_back(n_events_per_file.at(file_name));
                 }
 
-                auto source = std::make_shared<SourceDesc>(entry.name, file_names, n_events_bin, entry.weight,
-                                                           disabled_branches, entry.sample_type);
+                auto source = std::make_shared<SourceDesc>(entry.name, file_names, file_n_events, entry.weight,
+                                                           std::set<std::string>(), entry.sample_type);
                 bins_map.at(bin_name).AddSource(source);
             }
         }
@@ -512,7 +1069,7 @@ private:
         }
         n_original_events_per_bin = n_remaining_events_per_bin;
         n_original_events = n_remaining_events;
-        distr = Uniform(0, n_original_events - 1);
+        sampler = WeightedIndexSampler(n_original_events_per_bin);
     }
 
     static std::map<std::string, double> CalculateBinSizes(const std::vector<double>& pt_bins,
@@ -545,7 +1102,76 @@ private:
     std::vector<EventBin> bins;
     std::vector<size_t> n_remaining_events_per_bin, n_original_events_per_bin;
     size_t n_remaining_events, n_original_events;
-    Uniform distr;
+    WeightedIndexSampler sampler;
+};
+// Inputs of the output entries [begin, end) of a sampling plan. Only the sources with entries in the range are opened.
+// The read caches are shared between the sources in proportion to their remaining number of entries in the range,
+// i.e. to the rate at which they are read, and are updated each time a source is exhausted.
+class ShardInput {
+public:
+    using Tau = tau_tuple::Tau;
+
+    ShardInput(const SamplingPlan& _plan, size_t begin, size_t end, const std::set<std::string>& disabled_branches,
+               SourceFilePool* file_pool, size_t n_reader_threads, size_t prefetch_depth,
+               Long64_t _max_cache_memory) :
+        plan(&_plan), sources(plan->sources.size()), max_cache_memory(_max_cache_memory), n_remaining(end - begin)
+    {
+        if(begin > end || end > plan->draws.size())
+            throw analysis::exception("Invalid range of the output entries [%1%, %2%).") % begin % end;
+        std::vector<size_t> n_previous_draws(plan->sources.size(), 0);
+        for(size_t n = 0; n < begin; ++n)
+            ++n_previous_draws[plan->draws[n]];
+        std::vector<std::vector<size_t>> entries(plan->sources.size());
+        for(size_t n = begin; n < end; ++n) {
+            const uint32_t source_index = plan->draws[n];
+            entries[source_index].push_back(n_previous_draws[source_index]++);
+        }
+        for(size_t n = 0; n < sources.size(); ++n) {
+            if(entries[n].empty()) continue;
+            const SamplingPlan::Source& desc = plan->sources[n];
+            sources[n] = std::make_shared<SourceDesc>(desc.name, desc.file_names, desc.file_n_events, desc.weight,
+                                                      disabled_branches, desc.sample_type);
+            sources[n]->SetEntries(std::move(entries[n]));
+            sources[n]->SetFilePool(file_pool);
+        }
+        UpdateCacheSizes();
+        if(n_reader_threads) {
+            prefetcher = std::make_unique<SourcePrefetcher>(n_reader_threads, prefetch_depth);
+            for(const auto& source : sources) {
+                if(source)
+                    prefetcher->AddSource(*source);
+            }
+        }
+    }
+
+    // Should be called for the positions of the range in increasing order.
+    const Tau& GetTau(size_t position)
+    {
+        SourceDesc& source = *sources.at(plan->draws.at(position));
+        const Tau& tau = source.GetNextTau();
+        --n_remaining;
+        if(!source.HasNextTau())
+            UpdateCacheSizes();
+        return tau;
+    }
+
+private:
+    void UpdateCacheSizes()
+    {
+        if(max_cache_memory <= 0 || !n_remaining) return;
+        for(const auto& source : sources) {
+            if(!source) continue;
+            const double rate = static_cast<double>(source->GetNumberOfRemainingEntries()) / n_remaining;
+            source->SetCacheSize(static_cast<Long64_t>(max_cache_memory * rate));
+        }
+    }
+
+private:
+    const SamplingPlan* plan;
+    std::vector<std::shared_ptr<SourceDesc>> sources;
+    const Long64_t max_cache_memory;
+    size_t n_remaining;
+    std::unique_ptr<SourcePrefetcher> prefetcher;
 };
 } // anonymous namespace
 
@@ -557,19 +1183,59 @@ public:
     using Generator = EventBinMap::Generator;
 
     ShuffleMerge(const Arguments& _args) :
-        args(_args), pt_bins(ParseBins(args.pt_bins())), eta_bins(ParseBins(args.eta_bins())),
-        n_events_per_file(LoadNumberOfEventsPerFile(args.input() + "/size_list.txt", args.input()))
+        args(_args), pt_bins(ParseBins(args.pt_bins())), eta_bins(ParseBins(args.eta_bins()))
     {
 		if(args.n_threads() > 1)
             ROOT::EnableImplicitMT(args.n_threads());
+        ROOT::EnableThreadSafety();
+        if(!args.n_shards())
+            throw exception("Number of shards should be positive.");
+        if(args.shard() >= static_cast<int>(args.n_shards()))
+            throw exception("Shard index = %1% is out of range.") % args.shard();
+        if(!args.n_shard_workers())
+            throw exception("Number of shard workers should be positive.");
+        if(args.plan_only() && args.plan_file().empty())
+            throw exception("Plan file should be specified to compute only the sampling plan.");
+        const size_t n_files_per_worker = std::max<size_t>(args.n_reader_threads(), 1);
+        if(args.max_open_files() && args.max_open_files() < GetNumberOfWorkers() * n_files_per_worker)
+            throw exception("Maximal number of open files should not be smaller than the number of reader threads"
+                            " of all shard workers.");
 
         const auto disabled_branches_vec = SplitValueList(args.disabled_branches(), false, " ,");
-        disabled_branches.insert(disabled_branches_vec.begin(), disabled_branches_vec.end());
+        disabled_branches = tau_tuple::CheckTauTupleBranches(
+                std::set<std::string>(disabled_branches_vec.begin(), disabled_branches_vec.end()));
+    }
 
+    void Run()
+    {
+        std::vector<SamplingPlan> plans;
+        if(!args.plan_file().empty() && boost::filesystem::exists(args.plan_file())) {
+            std::cout << "Reading the sampling plan from " << args.plan_file() << std::endl;
+            plans = SamplingPlan::ReadList(args.plan_file());
+        } else {
+            plans = CreatePlans();
+            if(!args.plan_file().empty()) {
+                SamplingPlan::WriteList(args.plan_file(), plans);
+                std::cout << "The sampling plan has been stored into " << args.plan_file() << std::endl;
+            }
+        }
+        if(args.plan_only()) return;
+
+        for(const SamplingPlan& plan : plans)
+            WriteOutput(plan);
+        std::cout << "All entries has been merged." << std::endl;
+    }
+
+private:
+    // The generator is shared by the consecutive outputs, so the plans depend only on the seed and the inputs.
+    std::vector<SamplingPlan> CreatePlans() const
+    {
         PrintBins("pt bins", pt_bins);
         PrintBins("eta bins", eta_bins);
 
+        const auto n_events_per_file = LoadNumberOfEventsPerFile(args.input() + "/size_list.txt", args.input());
         const auto all_entries = LoadEntries(args.cfg());
+        std::map<std::string, std::vector<EntryDesc>> entries;
         if(args.mode() == MergeMode::MergeAll) {
             entries[args.output()] = all_entries;
         } else if(args.mode() == MergeMode::MergePerEntry) {
@@ -580,51 +1246,127 @@ public:
         } else {
             throw exception("Unsupported merging mode = '%1%'.") % args.mode();
         }
-    }
 
-    void Run()
-    {
+        std::vector<SamplingPlan> plans;
         Generator gen(args.seed());
         for(const auto& e : entries) {
             const std::string& file_name = e.first;
             const std::vector<EntryDesc>& entry_list = e.second;
-            std::cout << "Processing:";
+            std::cout << "Planning:";
             for(const auto& entry : entry_list)
                 std::cout << ' ' << entry.name;
             std::cout << "\nOutput: " << file_name << std::endl;
-            auto output_file = root_ext::CreateRootFile(file_name, ROOT::kLZ4, 4);
-            auto output_tuple = std::make_shared<TauTuple>("taus", output_file.get(), false);
             std::cout << "Creating event bin map..." << std::endl;
             EventBinMap bin_map(entry_list, pt_bins, eta_bins, args.calc_weights(), args.max_bin_occupancy(), gen,
-                                n_events_per_file, disabled_branches, true);
-            tools::ProgressReporter reporter(10, std::cout, "Sampling taus...");
-            reporter.SetTotalNumberOfEvents(bin_map.GetNumberOfRemainingEvents());
-            size_t n_processed = 0;
-            bool has_empty_bins = false;
-            while(bin_map.HasNextTau() && (!args.ensure_uniformity() || !has_empty_bins)) {
-                double weight;
-                bool last_tau_in_bin;
-                const auto& tau = bin_map.GetNextTau(weight, last_tau_in_bin);
-                has_empty_bins = has_empty_bins || last_tau_in_bin;
-                (*output_tuple)() = tau;
-                if(args.calc_weights())
-                    (*output_tuple)().trainingWeight = static_cast<float>(weight);
-                output_tuple->Fill();
-                if(++n_processed % 1000 == 0)
-                    reporter.Report(n_processed);
+                                n_events_per_file, true);
+            std::cout << "Sampling taus..." << std::endl;
+            plans.push_back(bin_map.CreatePlan(file_name, args.calc_weights(), args.ensure_uniformity()));
+            std::cout << plans.back().draws.size() << " taus are planned." << std::endl;
+        }
+        return plans;
+    }
+
+    size_t GetNumberOfWorkers() const
+    {
+        const size_t n_shards = args.shard() >= 0 ? 1 : args.n_shards();
+        return std::min<size_t>(args.n_shard_workers(), n_shards);
+    }
+
+    // Shards are distributed between the workers in the order of their indices. The first error stops all workers.
+    void WriteOutput(const SamplingPlan& plan) const
+    {
+        std::cout << "Output: " << plan.output << std::endl;
+        std::vector<size_t> shards;
+        for(size_t shard = 0; shard < args.n_shards(); ++shard) {
+            if(args.shard() < 0 || shard == static_cast<size_t>(args.shard()))
+                shards.push_back(shard);
+        }
+        size_t n_total = 0;
+        for(size_t shard : shards)
+            n_total += GetShardEnd(plan, shard) - GetShardBegin(plan, shard);
+
+        const size_t n_workers = GetNumberOfWorkers();
+        const Long64_t max_cache_memory = static_cast<Long64_t>(args.max_cache_memory() * 1024 * 1024 / n_workers);
+
+        std::atomic<size_t> next_shard(0), n_processed(0), n_finished(0);
+        std::atomic<bool> failed(false);
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        // Each worker has its own file pool: without prefetching, the entry returned by a source is valid only
+        // until its file is closed, which should be done only by the thread that consumes the entries.
+        const auto run_worker = [&]() {
+            try {
+                std::unique_ptr<SourceFilePool> filePool;
+                if(args.max_open_files())
+                    filePool = std::make_unique<SourceFilePool>(args.max_open_files() / n_workers);
+                for(size_t n = next_shard++; n < shards.size() && !failed; n = next_shard++)
+                    WriteShard(plan, shards.at(n), filePool.get(), max_cache_memory, n_processed, failed);
+            } catch(...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if(!error)
+                    error = std::current_exception();
+                failed = true;
             }
-            reporter.Report(n_processed, true);
-            std::cout << "Writing output tuples..." << std::endl;
-            output_tuple->Write();
-            output_tuple.reset();
-            std::cout << file_name << " has been successfully created." << std::endl;
+            ++n_finished;
+        };
+
+        tools::ProgressReporter reporter(10, std::cout, "Writing taus...");
+        reporter.SetTotalNumberOfEvents(n_total);
+        std::vector<std::thread> workers;
+        for(size_t n = 0; n < n_workers; ++n)
+            workers.emplace_back(run_worker);
+        while(n_finished < n_workers) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            reporter.Report(n_processed);
         }
+        for(auto& worker : workers)
+            worker.join();
+        if(error)
+            std::rethrow_exception(error);
+        reporter.Report(n_processed, true);
+    }
 
-        std::cout << "All entries has been merged." << std::endl;
+    void WriteShard(const SamplingPlan& plan, size_t shard, SourceFilePool* filePool, Long64_t max_cache_memory,
+                    std::atomic<size_t>& n_processed, const std::atomic<bool>& failed) const
+    {
+        const size_t begin = GetShardBegin(plan, shard), end = GetShardEnd(plan, shard);
+        const std::string file_name = GetShardFileName(plan.output, shard);
+        auto output_file = root_ext::CreateRootFile(file_name, ROOT::kLZ4, 4);
+        auto output_tuple = std::make_shared<TauTuple>("taus", output_file.get(), false);
+        AsyncTupleWriter<TauTuple> output_writer(output_tuple);
+        ShardInput input(plan, begin, end, disabled_branches, filePool, args.n_reader_threads(),
+                         args.prefetch_depth(), max_cache_memory);
+        for(size_t n = begin; n < end; ++n) {
+            if(failed) return;
+            output_writer() = input.GetTau(n);
+            if(plan.has_weights)
+                output_writer().trainingWeight = static_cast<float>(plan.sources.at(plan.draws.at(n)).bin_weight);
+            output_writer.Fill();
+            ++n_processed;
+        }
+        output_writer.Finish();
+        output_tuple->Write();
+        std::cout << file_name + " has been successfully created.\n" << std::flush;
     }
 
-private:
-    std::vector<EntryDesc> LoadEntries(const std::string& cfg_file_name)
+    size_t GetShardBegin(const SamplingPlan& plan, size_t shard) const
+    {
+        return plan.draws.size() * shard / args.n_shards();
+    }
+
+    size_t GetShardEnd(const SamplingPlan& plan, size_t shard) const { return GetShardBegin(plan, shard + 1); }
+
+    std::string GetShardFileName(const std::string& output, size_t shard) const
+    {
+        if(args.n_shards() == 1) return output;
+        const std::string suffix = ".root";
+        std::string base_name = output;
+        if(boost::algorithm::ends_with(base_name, suffix))
+            base_name.erase(base_name.size() - suffix.size());
+        return base_name + "_" + std::to_string(shard) + suffix;
+    }
+
+    std::vector<EntryDesc> LoadEntries(const std::string& cfg_file_name) const
     {
         std::vector<EntryDesc> entries;
         PropertyConfigReader reader;
@@ -690,10 +1432,8 @@ private:
 
 private:
     Arguments args;
-    std::map<std::string, std::vector<EntryDesc>> entries;
     const std::vector<double> pt_bins, eta_bins;
     std::set<std::string> disabled_branches;
-    std::map<std::string, size_t> n_events_per_file;
 };
 
 } // namespace analysis
@@ -1,29 +1,101 @@
 /*! Produce training tuple from tau tuple.
 */
 
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iomanip>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <boost/algorithm/string.hpp>
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/preprocessor/seq.hpp>
 #include <boost/preprocessor/variadic.hpp>
-#include <boost/math/constants/constants.hpp>
 
 #include "AnalysisTools/Run/include/program_main.h"
 #include "AnalysisTools/Core/include/AnalysisMath.h"
 #include "AnalysisTools/Core/include/RootExt.h"
-#include "TauML/Analysis/include/TauTuple.h"
+#include "AnalysisTools/Core/include/TextIO.h"
+#include "TauML/Analysis/include/TauTupleReader.h"
 #include "TauML/Analysis/include/TrainingTuple.h"
+#include "TauML/Analysis/include/TrainingTupleWriter.h"
+#include "TauML/Analysis/include/CellGrid.h"
+#include "TauML/Analysis/include/NpyFile.h"
+#include "TauML/Analysis/include/FeatureEncoding.h"
+#include "TauML/Analysis/include/FeatureStatistics.h"
+#include "TauML/Analysis/include/KinematicKernels.h"
+#include "TauML/Analysis/include/AsyncTupleWriter.h"
 #include "AnalysisTools/Core/include/ProgressReporter.h"
 
 #define CP_BR_EX(r, placeholder, name) CP_BR(name)
 #define CP_BRANCHES(...) \
     BOOST_PP_SEQ_FOR_EACH(CP_BR_EX, placeholder, BOOST_PP_VARIADIC_TO_SEQ(__VA_ARGS__))
 
+namespace analysis {
+
+enum class TrainingTupleFormat { Root = 1, Dense = 2 };
+ENUM_NAMES(TrainingTupleFormat) = {
+    { TrainingTupleFormat::Root, "root" },
+    { TrainingTupleFormat::Dense, "dense" }
+};
+
+enum class CellSchema { Full = 1, Compact = 2 };
+ENUM_NAMES(CellSchema) = {
+    { CellSchema::Full, "full" },
+    { CellSchema::Compact, "compact" }
+};
+} // namespace analysis
+
 struct Arguments {
     run::Argument<std::string> input{"input", "input root file with tau tuple"};
-    run::Argument<std::string> output{"output", "output root file with training tuple"};
+    run::Argument<std::string> output{"output", "output, depending on the format: root - file with training tuple,"
+                                                " dense - directory with npy arrays"};
+    run::Argument<analysis::TrainingTupleFormat> format{"format", "output format: root or dense",
+                                                        analysis::TrainingTupleFormat::Root};
+    run::Argument<analysis::FeatureStorage> storage{"storage", "storage of the tau and cell features in the dense"
+        " format: float32, float16 or fixed16", analysis::FeatureStorage::Float};
+    run::Argument<analysis::CellEncoding> cell_encoding{"cell-encoding", "positions of the cells in the root format:"
+        " index - eta_index and phi_index of each cell, bitmap - occupancy bitmap of each tau in the cell_occupancy"
+        " tree, the cells are stored in the traversal order of the grid", analysis::CellEncoding::Index};
+    run::Argument<analysis::CellSchema> cell_schema{"cell-schema", "schema of the cells in the root format: full -"
+        " all features are stored as separate branches, compact - flags, counts and categorical features are stored"
+        " in one byte each in the compact_inner_cells and compact_outer_cells trees", analysis::CellSchema::Full};
+    run::Argument<bool> compute_stats{"compute-stats", "instead of producing the training tuple, measure the"
+        " distributions of the raw inputs and write the normalization configuration into the output file", false};
+    run::Argument<double> stats_quantile{"stats-quantile", "fraction of values below and above the range of linear"
+        " transforms with fit_range=true, estimated in the compute-stats mode", 0.001};
     run::Argument<unsigned> n_inner_cells{"n-inner-cells", "number of inner cells in eta and phi", 11};
     run::Argument<double> inner_cell_size{"inner-cell-size", "size of the inner cell in eta and phi", 0.02};
     run::Argument<unsigned> n_outer_cells{"n-outer-cells", "number of outer cells in eta and phi", 21};
     run::Argument<double> outer_cell_size{"outer-cell-size", "size of the outer cell in eta and phi", 0.05};
-    run::Argument<unsigned> n_threads{"n-threads", "number of threads", 1};
+    run::Argument<std::string> extra_grids{"extra-grids", "additional grid configurations that are produced in the"
+        " same pass: list of label:n_inner_cells:inner_cell_size:n_outer_cells:outer_cell_size", ""};
+    run::Argument<std::string> normalization{"normalization", "configuration file with the normalization of inputs",
+        "TauML/Analysis/config/training_normalization.cfg"};
+    run::Argument<bool> raw_features{"raw-features", "store inputs without normalization. Non-finite values and"
+        " values of invalid objects are set to zero, the normalization is applied by the training data loader",
+        false};
+    run::Argument<unsigned> n_threads{"n-threads", "number of worker threads", 1};
+    run::Argument<unsigned> n_workers{"n-workers", "number of worker processes. Each process writes the chunks that"
+        " it has processed into a separate output <name>_<n><extension>. The files and the tau ranges of the chunks"
+        " in the order of the input entries are stored in <output>.chunks.json", 1};
+    run::Argument<Long64_t> cluster_size{"cluster-size", "number of taus in a cluster of the root output. Clusters of"
+        " the cell trees end at the same taus, their entry and byte ranges are stored in <output>.index.json."
+        " 0 - default clustering of ROOT", 1000};
+    run::Argument<bool> async_write{"async-write", "write the output on a separate thread, while the next chunks"
+        " are processed", true};
+    run::Argument<unsigned> n_compression_threads{"n-compression-threads", "number of threads of the ROOT implicit"
+        " multi-threading, which compress the baskets of the root output in parallel. With worker processes, it is"
+        " enabled in each of them. 0 - disabled", 0};
+    run::Argument<bool> append{"append", "append the taus to the existing root output. Only the entries of the input"
+        " that are not yet listed in the manifest of the output are processed. Grid, normalization and weight"
+        " settings should be the same as for the existing output", false};
+    run::Argument<Long64_t> chunk_size{"chunk-size", "number of input entries processed by a worker at once", 100};
     run::Argument<Long64_t> start_entry{"start-entry", "start entry", 0};
     run::Argument<Long64_t> end_entry{"end-entry", "end entry", std::numeric_limits<Long64_t>::max()};
     run::Argument<float> training_weight_factor{"training-weight-factor",
@@ -33,190 +105,1041 @@ struct Arguments {
 
 namespace analysis {
 
-enum class CellObjectType { PfCand_electron, PfCand_muon, PfCand_chargedHadron, PfCand_neutralHadron,
-                            PfCand_gamma, Electron, Muon };
-using Cell = std::map<CellObjectType, std::set<size_t>>;
-struct CellIndex {
-    int eta, phi;
+// Object inside the isolation cone of the tau with the position relative to the tau.
+struct CellCandidate {
+    CellObjectType type;
+    size_t index;
+    float pt, deta, dphi, dR2;
+};
+
+// Positions of all objects of a collection relative to the tau, and the indices of the objects inside the cone.
+struct CellCandidateWorkspace {
+    std::vector<float> deta, dphi, dR2;
+    std::vector<uint32_t> selected;
 
-    bool operator<(const CellIndex& other) const
+    void Resize(size_t n_objects)
     {
-        if(eta != other.eta) return eta < other.eta;
-        return phi < other.phi;
+        deta.resize(n_objects);
+        dphi.resize(n_objects);
+        dR2.resize(n_objects);
+        selected.resize(n_objects);
     }
 };
 
-class CellGrid {
+// Distributes consecutive chunk ids between the workers and hands the processed chunks to the writer
+// in the original order. The number of chunks that are processed but not yet written is limited by max_pending.
+template<typename Chunk>
+class OrderedChunkQueue {
 public:
-    CellGrid(unsigned _nCellsEta, unsigned _nCellsPhi, double _cellSizeEta, double _cellSizePhi) :
-        nCellsEta(_nCellsEta), nCellsPhi(_nCellsPhi), nTotal(nCellsEta * nCellsPhi),
-        cellSizeEta(_cellSizeEta), cellSizePhi(_cellSizePhi), cells(nTotal)
-    {
-        if(nCellsEta % 2 != 1 || nCellsEta < 1)
-            throw exception("Invalid number of eta cells.");
-        if(nCellsPhi % 2 != 1 || nCellsPhi < 1)
-            throw exception("Invalid number of phi cells.");
-        if(cellSizeEta <= 0 || cellSizePhi <= 0)
-            throw exception("Invalid cell size.");
-    }
-
-    int MaxEtaIndex() const { return static_cast<int>((nCellsEta - 1) / 2); }
-    int MaxPhiIndex() const { return static_cast<int>((nCellsPhi - 1) / 2); }
-    double MaxDeltaEta() const { return cellSizeEta * (0.5 + MaxEtaIndex()); }
-    double MaxDeltaPhi() const { return cellSizePhi * (0.5 + MaxPhiIndex()); }
-
-    bool TryGetCellIndex(double deltaEta, double deltaPhi, CellIndex& cellIndex) const
-    {
-        static auto getCellIndex = [](double x, double maxX, double size, int& index) {
-            const double absX = std::abs(x);
-            if(absX > maxX) return false;
-            const double absIndex = std::floor(absX / size + 0.5);
-            index = static_cast<int>(std::copysign(absIndex, x));
-            return true;
+    OrderedChunkQueue(size_t _n_chunks, size_t _max_pending) :
+        n_chunks(_n_chunks), max_pending(std::max<size_t>(_max_pending, 1)), next_chunk_id(0), next_to_pop(0)
+    {
+    }
+
+    bool TryAcquire(size_t& chunk_id)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond_var.wait(lock, [&] { return error || next_chunk_id >= n_chunks
+                                         || next_chunk_id < next_to_pop + max_pending; });
+        if(error || next_chunk_id >= n_chunks) return false;
+        chunk_id = next_chunk_id++;
+        return true;
+    }
+
+    void Push(size_t chunk_id, std::unique_ptr<Chunk>&& chunk)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready_chunks[chunk_id] = std::move(chunk);
+        }
+        cond_var.notify_all();
+    }
+
+    void SetError(std::exception_ptr _error)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(!error)
+                error = _error;
+        }
+        cond_var.notify_all();
+    }
+
+    bool HasNext() const { return next_to_pop < n_chunks; }
+
+    std::unique_ptr<Chunk> PopNext()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond_var.wait(lock, [&] { return error || ready_chunks.count(next_to_pop); });
+        if(error)
+            std::rethrow_exception(error);
+        auto iter = ready_chunks.find(next_to_pop);
+        std::unique_ptr<Chunk> chunk = std::move(iter->second);
+        ready_chunks.erase(iter);
+        ++next_to_pop;
+        lock.unlock();
+        cond_var.notify_all();
+        return chunk;
+    }
+
+private:
+    const size_t n_chunks, max_pending;
+    size_t next_chunk_id, next_to_pop;
+    std::map<size_t, std::unique_ptr<Chunk>> ready_chunks;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable cond_var;
+};
+
+// Flags, counts and categorical features of the cells that are stored in the compact form. The ranges of the raw
+// values cover the categorical values that are produced by FillCellGrid; larger counts saturate to the last code.
+inline std::shared_ptr<const CompactCellEncoder> MakeCompactCellEncoder(
+        const FeatureNormalizationSpec::FeatureMap& features)
+{
+    static const std::vector<CompactCellEncoder::FlagGroup> flag_groups = {
+        { "pfCand_ele_valid", "pfCand_ele_tauSignal", "pfCand_ele_tauIso", "pfCand_ele_hasTrackDetails" },
+        { "pfCand_muon_valid", "pfCand_muon_tauSignal", "pfCand_muon_tauIso", "pfCand_muon_hasTrackDetails" },
+        { "pfCand_chHad_valid", "pfCand_chHad_tauSignal", "pfCand_chHad_leadChargedHadrCand", "pfCand_chHad_tauIso",
+          "pfCand_chHad_hasTrackDetails" },
+        { "pfCand_nHad_valid", "pfCand_nHad_tauSignal", "pfCand_nHad_tauIso" },
+        { "pfCand_gamma_valid", "pfCand_gamma_tauSignal", "pfCand_gamma_tauIso", "pfCand_gamma_hasTrackDetails" },
+        { "ele_valid", "ele_cc_valid", "ele_has_closestCtfTrack" },
+        { "muon_valid", "muon_normalizedChi2_valid", "muon_pfEcalEnergy_valid" },
+    };
+    static const std::vector<CompactCellEncoder::CodedFeature> coded_features = [] {
+        std::vector<CompactCellEncoder::CodedFeature> coded;
+        for(const char* type : { "ele", "muon", "chHad", "nHad", "gamma" })
+            coded.push_back({ std::string("pfCand_") + type + "_n_total", 0, 254 });
+        coded.push_back({ "ele_n_total", 0, 254 });
+        coded.push_back({ "muon_n_total", 0, 254 });
+        for(const char* type : { "ele", "muon", "chHad", "gamma" }) {
+            coded.push_back({ std::string("pfCand_") + type + "_pvAssociationQuality", 0, 7 });
+            coded.push_back({ std::string("pfCand_") + type + "_lostInnerHits", -1, 2 });
+            coded.push_back({ std::string("pfCand_") + type + "_numberOfPixelHits", 0, 254 });
+        }
+        for(const char* type : { "muon", "chHad", "gamma" })
+            coded.push_back({ std::string("pfCand_") + type + "_fromPV", 0, 3 });
+        for(const char* type : { "ele", "muon", "chHad" })
+            coded.push_back({ std::string("pfCand_") + type + "_charge", -1, 1 });
+        coded.push_back({ "ele_mvaInput_earlyBrem", -2, 1 });
+        coded.push_back({ "ele_mvaInput_lateBrem", -2, 1 });
+        for(const char* kind : { "matches", "hits" }) {
+            for(const char* detector : { "DT", "CSC", "RPC" }) {
+                for(int station = 1; station <= 4; ++station) {
+                    const std::string name = std::string("muon_n_") + kind + "_" + detector + "_"
+                                             + std::to_string(station);
+                    coded.push_back({ name, 0, 254 });
+                }
+            }
+        }
+        return coded;
+    }();
+    return std::make_shared<CompactCellEncoder>(tau_tuple::GetTrainingCellColumns(), features, flag_groups,
+                                                coded_features);
+}
+
+// Fixed-shape arrays in the npy format that can be memory-mapped by numpy:
+//     taus.npy (n_taus, n_tau_features), truth.npy (n_taus, n_truth), weights.npy (n_taus),
+//     inner_cells.npy and outer_cells.npy (n_taus, n_eta, n_phi, n_cell_features).
+// Cells of additional grids are stored in inner_cells_<label>.npy and outer_cells_<label>.npy.
+// Cells without objects are filled with zeros. Names of the columns are stored in columns.json together with
+// the storage of the features. With the float16 and fixed16 storages, features without a bounded normalized range are
+// stored in the float32 arrays <name>_float.npy, their names are listed in float32_columns. For the fixed16 storage,
+// the scales of the features stored in the main arrays are listed in scales.
+class DenseTrainingTupleWriter : public TrainingTupleWriter {
+public:
+    using TrainingTau = tau_tuple::TrainingTau;
+    using TrainingCell = tau_tuple::TrainingCell;
+    using TauColumnPtr = FeatureColumns<TrainingTau>::ColumnPtr;
+    using CellColumnPtr = FeatureColumns<TrainingCell>::ColumnPtr;
+
+    // The first grid configuration is the main one.
+    // If the stored features are not normalized, the normalization configuration is copied into the output
+    // directory, so that it can be applied when the arrays are loaded.
+    DenseTrainingTupleWriter(const std::string& output_dir, const std::vector<CellGridConfig>& grids,
+                             FeatureStorage _storage, const FeatureNormalizationSpec& normalizationSpec,
+                             const std::string& raw_normalization = "") :
+        storage(_storage)
+    {
+        if(storage != FeatureStorage::Float && !raw_normalization.empty())
+            throw exception("Reduced precision storage is supported only for normalized features.");
+
+        static const std::set<std::string> non_feature_tau_branches = {
+            "run", "lumi", "evt", "trainingWeight", "innerCells_begin", "innerCells_end", "outerCells_begin",
+            "outerCells_end"
+        };
+        static const std::vector<std::string> truth_branches = {
+            "gen_e", "gen_mu", "gen_tau", "gen_jet", "gen_emb", "gen_data"
         };
+        static const std::set<std::string> cell_index_branches = { "eta_index", "phi_index" };
+
+        const auto& tauColumns = tau_tuple::GetTrainingTauColumns();
+        const auto& cellColumns = tau_tuple::GetTrainingCellColumns();
+        const std::set<std::string> truth_set(truth_branches.begin(), truth_branches.end());
+        for(const std::string& name : tauColumns.Names()) {
+            if(!non_feature_tau_branches.count(name) && !truth_set.count(name))
+                tauFeatureNames.push_back(name);
+        }
+        for(const std::string& name : cellColumns.Names()) {
+            if(!cell_index_branches.count(name))
+                cellFeatureNames.push_back(name);
+        }
+        for(const std::string& name : tauFeatureNames)
+            tauFeatureColumns.push_back(tauColumns.Get(name));
+        for(const std::string& name : truth_branches)
+            truthColumns.push_back(tauColumns.Get(name));
+        weightColumn = tauColumns.Get("trainingWeight");
+        for(const std::string& name : cellFeatureNames)
+            cellFeatureColumns.push_back(cellColumns.Get(name));
+
+        if(!boost::filesystem::exists(output_dir))
+            boost::filesystem::create_directories(output_dir);
+        const std::string prefix = output_dir + "/";
+        const auto innerScales = FeatureEncoder::GetScales(cellFeatureNames,
+                                                           normalizationSpec.GetFeatures("inner_cell", "cell"));
+        const auto outerScales = FeatureEncoder::GetScales(cellFeatureNames,
+                                                           normalizationSpec.GetFeatures("outer_cell", "cell"));
+        tauFile = std::make_unique<DenseFeatureFile>(prefix + "taus.npy", std::vector<size_t>{ tauFeatureNames.size() },
+            storage, FeatureEncoder::GetScales(tauFeatureNames, normalizationSpec.GetFeatures("tau")));
+        truthFile = std::make_unique<NpyFileWriter<int32_t>>(prefix + "truth.npy",
+                                                             std::vector<size_t>{ truth_branches.size() });
+        weightFile = std::make_unique<NpyFileWriter<float>>(prefix + "weights.npy", std::vector<size_t>{});
+        for(const auto& grid : grids) {
+            gridNames.push_back("inner_cells" + grid.Suffix());
+            gridTensors.push_back(std::make_unique<GridTensor>(prefix + gridNames.back() + ".npy",
+                                                               grid.n_inner_cells, storage, innerScales));
+            gridNames.push_back("outer_cells" + grid.Suffix());
+            gridTensors.push_back(std::make_unique<GridTensor>(prefix + gridNames.back() + ".npy",
+                                                               grid.n_outer_cells, storage, outerScales));
+        }
+        if(!raw_normalization.empty()) {
+            normalizationFile = "normalization.cfg";
+            boost::filesystem::copy_file(raw_normalization, prefix + normalizationFile,
+                                         boost::filesystem::copy_option::overwrite_if_exists);
+        }
+        WriteColumnNames(prefix + "columns.json", truth_branches);
+    }
 
-        return getCellIndex(deltaEta, MaxDeltaEta(), cellSizeEta, cellIndex.eta)
-               && getCellIndex(deltaPhi, MaxDeltaPhi(), cellSizePhi, cellIndex.phi);
+    void Write(const TrainingTupleChunk& chunk) override
+    {
+        const size_t n_taus = chunk.taus.size();
+        if(!n_taus) return;
+
+        FillMatrix(chunk.taus, tauFeatureColumns, tauMatrix);
+        tauFile->Write(tauMatrix);
+
+        FillMatrix(chunk.taus, truthColumns, tauMatrix);
+        truthMatrix.assign(tauMatrix.begin(), tauMatrix.end());
+        truthFile->Write(truthMatrix);
+
+        columnBuffer.resize(n_taus);
+        weightColumn->Gather(chunk.taus.data(), n_taus, columnBuffer.data());
+        weightFile->Write(columnBuffer.data(), n_taus);
+
+        if(gridTensors.size() != 2 * (chunk.extraGrids.size() + 1))
+            throw exception("Inconsistent number of grid configurations.");
+        WriteGrid(chunk.taus, chunk.innerCells, true, *gridTensors.at(0));
+        WriteGrid(chunk.taus, chunk.outerCells, false, *gridTensors.at(1));
+        for(size_t n = 0; n < chunk.extraGrids.size(); ++n) {
+            const TrainingGridCells& grid = chunk.extraGrids.at(n);
+            WriteGrid(grid.ranges, grid.innerCells, true, *gridTensors.at(2 * n + 2));
+            WriteGrid(grid.ranges, grid.outerCells, false, *gridTensors.at(2 * n + 3));
+        }
     }
 
-    Cell& at(const CellIndex& cellIndex) { return cells.at(GetFlatIndex(cellIndex)); }
-    const Cell& at(const CellIndex& cellIndex) const { return cells.at(GetFlatIndex(cellIndex)); }
+    void Finalize() override
+    {
+        tauFile->Close();
+        truthFile->Close();
+        weightFile->Close();
+        for(auto& grid : gridTensors)
+            grid->file.Close();
+    }
 
-    bool IsEmpty(const CellIndex& cellIndex) const
+private:
+    struct GridTensor {
+        GridTensor(const std::string& file_name, size_t n_cells, FeatureStorage storage,
+                   const std::vector<float>& scales) :
+            n_eta(n_cells), n_phi(n_cells), file(file_name, { n_eta, n_phi, scales.size() }, storage, scales) {}
+
+        const size_t n_eta, n_phi;
+        DenseFeatureFile file;
+        std::vector<float> values;
+        std::vector<size_t> offsets;
+    };
+
+    // Row-major matrix (n_rows, n_columns).
+    template<typename Row, typename ColumnPtr>
+    void FillMatrix(const std::vector<Row>& rows, const std::vector<ColumnPtr>& columns, std::vector<float>& matrix)
     {
-        const Cell& cell = at(cellIndex);
-        for(const auto& col : cell) {
-            if(!col.second.empty())
-                return false;
+        const size_t n_rows = rows.size(), n_columns = columns.size();
+        matrix.resize(n_rows * n_columns);
+        columnBuffer.resize(n_rows);
+        for(size_t c = 0; c < n_columns; ++c) {
+            columns[c]->Gather(rows.data(), n_rows, columnBuffer.data());
+            for(size_t n = 0; n < n_rows; ++n)
+                matrix[n * n_columns + c] = columnBuffer[n];
         }
-        return true;
+    }
+
+    template<typename Range>
+    void WriteGrid(const std::vector<Range>& ranges, const std::vector<TrainingCell>& cells, bool inner,
+                   GridTensor& grid)
+    {
+        const size_t n_taus = ranges.size(), n_features = cellFeatureColumns.size();
+        const int max_eta_index = static_cast<int>(grid.n_eta - 1) / 2;
+        const int max_phi_index = static_cast<int>(grid.n_phi - 1) / 2;
+        grid.values.assign(n_taus * grid.n_eta * grid.n_phi * n_features, 0.f);
+        grid.offsets.resize(cells.size());
+        for(size_t tau_index = 0; tau_index < n_taus; ++tau_index) {
+            const Range& range = ranges.at(tau_index);
+            const Long64_t begin = inner ? range.innerCells_begin : range.outerCells_begin;
+            const Long64_t end = inner ? range.innerCells_end : range.outerCells_end;
+            for(Long64_t cell_index = begin; cell_index < end; ++cell_index) {
+                const TrainingCell& cell = cells.at(static_cast<size_t>(cell_index));
+                const size_t eta = static_cast<size_t>(cell.eta_index + max_eta_index);
+                const size_t phi = static_cast<size_t>(cell.phi_index + max_phi_index);
+                if(eta >= grid.n_eta || phi >= grid.n_phi)
+                    throw exception("Cell (%1%, %2%) is outside of the grid.") % cell.eta_index % cell.phi_index;
+                grid.offsets[static_cast<size_t>(cell_index)] =
+                        ((tau_index * grid.n_eta + eta) * grid.n_phi + phi) * n_features;
+            }
+        }
+        columnBuffer.resize(cells.size());
+        for(size_t c = 0; c < n_features; ++c) {
+            cellFeatureColumns[c]->Gather(cells.data(), cells.size(), columnBuffer.data());
+            for(size_t n = 0; n < cells.size(); ++n)
+                grid.values[grid.offsets[n] + c] = columnBuffer[n];
+        }
+        grid.file.Write(grid.values);
+    }
+
+    void WriteColumnNames(const std::string& file_name, const std::vector<std::string>& truth_branches) const
+    {
+        std::ofstream json(file_name);
+        if(!json.is_open())
+            throw exception("Unable to create '%1%'.") % file_name;
+        const auto writeList = [&](const std::string& key, const std::vector<std::string>& names, bool last) {
+            json << "    \"" << key << "\": [";
+            for(size_t n = 0; n < names.size(); ++n)
+                json << (n ? ", " : "") << "\"" << names.at(n) << "\"";
+            json << "]" << (last ? "" : ",") << "\n";
+        };
+        const auto writeScales = [&](const std::string& key, const std::vector<float>& scales, bool last) {
+            json << "        \"" << key << "\": [";
+            for(size_t n = 0; n < scales.size(); ++n)
+                json << (n ? ", " : "") << scales.at(n);
+            json << "]" << (last ? "" : ",") << "\n";
+        };
+        json.precision(9);
+        json << "{\n";
+        if(!normalizationFile.empty())
+            json << "    \"normalization\": \"" << normalizationFile << "\",\n";
+        json << "    \"storage\": \"" << storage << "\",\n";
+        if(storage == FeatureStorage::Fixed) {
+            json << "    \"scales\": {\n";
+            writeScales("taus", tauFile->Scales(), gridNames.empty());
+            for(size_t n = 0; n < gridNames.size(); ++n)
+                writeScales(gridNames.at(n), gridTensors.at(n)->file.Scales(), n + 1 == gridNames.size());
+            json << "    },\n";
+        }
+        std::vector<std::pair<std::string, std::vector<std::string>>> float_columns;
+        const auto addFloatColumns = [&](const std::string& key, const DenseFeatureFile& file,
+                                         const std::vector<std::string>& names) {
+            if(file.FloatColumns().empty()) return;
+            float_columns.emplace_back(key, std::vector<std::string>());
+            for(size_t n : file.FloatColumns())
+                float_columns.back().second.push_back(names.at(n));
+        };
+        addFloatColumns("taus", *tauFile, tauFeatureNames);
+        for(size_t n = 0; n < gridNames.size(); ++n)
+            addFloatColumns(gridNames.at(n), gridTensors.at(n)->file, cellFeatureNames);
+        if(!float_columns.empty()) {
+            json << "    \"float32_columns\": {\n";
+            for(size_t n = 0; n < float_columns.size(); ++n) {
+                json << "    ";
+                writeList(float_columns.at(n).first, float_columns.at(n).second, n + 1 == float_columns.size());
+            }
+            json << "    },\n";
+        }
+        writeList("taus", tauFeatureNames, false);
+        writeList("truth", truth_branches, false);
+        writeList("weights", { "trainingWeight" }, gridNames.empty());
+        for(size_t n = 0; n < gridNames.size(); ++n)
+            writeList(gridNames.at(n), cellFeatureNames, n + 1 == gridNames.size());
+        json << "}\n";
     }
 
 private:
-    size_t GetFlatIndex(const CellIndex& cellIndex) const
+    std::vector<std::string> tauFeatureNames, cellFeatureNames, gridNames;
+    std::string normalizationFile;
+    std::vector<TauColumnPtr> tauFeatureColumns, truthColumns;
+    TauColumnPtr weightColumn;
+    std::vector<CellColumnPtr> cellFeatureColumns;
+    const FeatureStorage storage;
+    std::unique_ptr<DenseFeatureFile> tauFile;
+    std::unique_ptr<NpyFileWriter<float>> weightFile;
+    std::unique_ptr<NpyFileWriter<int32_t>> truthFile;
+    std::vector<std::unique_ptr<GridTensor>> gridTensors;
+    std::vector<float> columnBuffer, tauMatrix;
+    std::vector<int32_t> truthMatrix;
+};
+
+// Writer that passes the chunks to another writer running on a separate thread. Write only copies the chunk into
+// a staging chunk, which is reused after it is written.
+class AsyncTrainingTupleWriter : public TrainingTupleWriter {
+public:
+    AsyncTrainingTupleWriter(std::unique_ptr<TrainingTupleWriter>&& _writer, size_t max_pending_chunks) :
+        writer(std::move(_writer)),
+        pipeline([this](TrainingTupleChunk& chunk) { writer->Write(chunk); }, max_pending_chunks)
+    {
+        ROOT::EnableThreadSafety();
+    }
+
+    void Write(const TrainingTupleChunk& chunk) override
     {
-        if(std::abs(cellIndex.eta) > MaxEtaIndex() || std::abs(cellIndex.phi) > MaxPhiIndex())
-            throw exception("Cell index is out of range");
-        const unsigned shiftedEta = static_cast<unsigned>(cellIndex.eta + MaxEtaIndex());
-        const unsigned shiftedPhi = static_cast<unsigned>(cellIndex.phi + MaxPhiIndex());
-        return shiftedEta * nCellsPhi + shiftedPhi;
+        auto staged = pipeline.Acquire();
+        *staged = chunk;
+        pipeline.Push(std::move(staged));
+    }
+
+    void Finalize() override
+    {
+        pipeline.Close();
+        writer->Finalize();
     }
 
 private:
-    const unsigned nCellsEta, nCellsPhi, nTotal;
-    const double cellSizeEta, cellSizePhi;
-    std::vector<Cell> cells;
+    std::unique_ptr<TrainingTupleWriter> writer;
+    AsyncPipeline<TrainingTupleChunk> pipeline;
 };
 
 class TrainingTupleProducer {
 public:
     using Tau = tau_tuple::Tau;
-    using TauTuple = tau_tuple::TauTuple;
+    using TwoPhaseTauTupleReader = tau_tuple::TwoPhaseTauTupleReader;
     using TrainingTau = tau_tuple::TrainingTau;
-    using TrainingTauTuple = tau_tuple::TrainingTauTuple;
+    using TrainingCellOccupancy = tau_tuple::TrainingCellOccupancy;
     using TrainingCell = tau_tuple::TrainingCell;
-    using TrainingCellTuple = tau_tuple::TrainingCellTuple;
+
+    using ProcessedChunk = TrainingTupleChunk;
+    using ChunkQueue = OrderedChunkQueue<ProcessedChunk>;
+
+    // Statistics of the raw inputs that are collected by a worker in the compute-stats mode.
+    struct InputStatistics {
+        FeatureStatisticsCollector<TrainingTau> taus;
+        FeatureStatisticsCollector<TrainingCell> innerCells, outerCells;
+
+        explicit InputStatistics(const FeatureNormalizationSpec& spec) :
+            taus(spec.GetFeatures("tau"), tau_tuple::GetTrainingTauColumns()),
+            innerCells(spec.GetFeatures("inner_cell", "cell"), tau_tuple::GetTrainingCellColumns()),
+            outerCells(spec.GetFeatures("outer_cell", "cell"), tau_tuple::GetTrainingCellColumns())
+        {
+        }
+
+        void Merge(const InputStatistics& other)
+        {
+            taus.Merge(other.taus);
+            innerCells.Merge(other.innerCells);
+            outerCells.Merge(other.outerCells);
+        }
+    };
+
+    // Grids of the additional configurations. Their layouts are computed at run time.
+    struct ExtraCellGrids {
+        CellGrid<DynamicCellGridLayout> inner, outer;
+    };
+
+    // Buffers that are reused by a worker between taus.
+    template<typename InnerCellGrid, typename OuterCellGrid>
+    struct WorkerContext {
+        WorkerContext(const InnerCellGrid& _innerCellGrid, const OuterCellGrid& _outerCellGrid,
+                      const std::vector<ExtraCellGrids>& _extraCellGrids) :
+            innerCellGrid(_innerCellGrid), outerCellGrid(_outerCellGrid), extraCellGrids(_extraCellGrids) {}
+
+        InnerCellGrid innerCellGrid;
+        OuterCellGrid outerCellGrid;
+        std::vector<ExtraCellGrids> extraCellGrids;
+        std::vector<CellCandidate> candidates;
+        CellCandidateWorkspace candidateWorkspace;
+        FeatureNormalizationWorkspace normalizationWorkspace;
+        InputStatistics* statistics{nullptr};
+    };
 
     TrainingTupleProducer(const Arguments& _args) :
-        args(_args), inputFile(root_ext::OpenRootFile(args.input())),
-        outputFile(root_ext::CreateRootFile(args.output(), ROOT::kLZ4, 4)),
-        tauTuple(inputFile.get(), true), trainingTauTuple(outputFile.get(), false),
-        innerCellTuple("inner_cells", outputFile.get(), false), outerCellTuple("outer_cells", outputFile.get(), false),
-        innerCellGridRef(args.n_inner_cells(), args.n_inner_cells(), args.inner_cell_size(), args.inner_cell_size()),
-        outerCellGridRef(args.n_outer_cells(), args.n_outer_cells(), args.outer_cell_size(), args.outer_cell_size()),
-        trainingWeightFactor(tauTuple.GetEntries() / args.training_weight_factor())
+        args(_args), tauReader(MakeInputReader()),
+        extraGridConfigs(CellGridConfig::ParseList(args.extra_grids())),
+        extraCellGridRefs(MakeExtraCellGrids(extraGridConfigs)),
+        normalizationSpec(args.normalization()),
+        tauNormalizer(GetOutputFeatures("tau"), tau_tuple::GetTrainingTauColumns()),
+        innerCellNormalizer(GetOutputFeatures("inner_cell", "cell"), tau_tuple::GetTrainingCellColumns()),
+        outerCellNormalizer(GetOutputFeatures("outer_cell", "cell"), tau_tuple::GetTrainingCellColumns()),
+        trainingWeightFactor(tauReader.GetEntries() / args.training_weight_factor()),
+        startEntry(args.start_entry()), endEntry(std::min(tauReader.GetEntries(), args.end_entry()))
     {
+        if(args.chunk_size() <= 0)
+            throw exception("Chunk size should be positive.");
+        if(args.n_workers() > 1 && args.n_threads() > 1)
+            throw exception("Worker processes and worker threads can not be used at the same time.");
+        if(args.n_workers() > 1 && args.compute_stats())
+            throw exception("Statistics can not be computed with several worker processes. Use threads instead.");
+        if(!extraGridConfigs.empty() && args.compute_stats())
+            throw exception("Statistics are computed only for the main grid configuration.");
+        if(args.storage() != FeatureStorage::Float && args.format() != TrainingTupleFormat::Dense)
+            throw exception("Reduced precision storage is supported only by the dense format.");
+        if(args.cell_encoding() != CellEncoding::Index && args.format() != TrainingTupleFormat::Root)
+            throw exception("Cell encoding can be chosen only for the root format.");
+        if(args.cell_schema() != CellSchema::Full && args.format() != TrainingTupleFormat::Root)
+            throw exception("Compact cell schema is supported only by the root format.");
+        if(args.append() && (args.compute_stats() || args.format() != TrainingTupleFormat::Root))
+            throw exception("Append mode is supported only for the root format.");
+        if(args.append() && args.n_workers() > 1)
+            throw exception("Append mode is not supported with worker processes.");
         if(args.n_threads() > 1)
-            ROOT::EnableImplicitMT(args.n_threads());
+            ROOT::EnableThreadSafety();
+        if(args.n_compression_threads() && args.n_workers() <= 1)
+            ROOT::EnableImplicitMT(args.n_compression_threads());
+        if(args.compute_stats()) {
+            if(!(args.stats_quantile() >= 0 && args.stats_quantile() < 0.5))
+                throw exception("Quantile for the range of linear transforms should be in [0, 0.5).");
+        } else if(args.format() == TrainingTupleFormat::Root) {
+            auto manifest = std::make_unique<TrainingTupleManifest>();
+            if(args.append()) {
+                *manifest = TrainingTupleManifest::Read(args.output());
+                manifest->CheckConfig(GetOutputConfig());
+                std::tie(startEntry, endEntry) = manifest->GetNewEntries(args.input(), startEntry, endEntry);
+                if(startEntry >= endEntry)
+                    std::cout << "All requested entries of '" << args.input() << "' are already stored in "
+                              << args.output() << "." << std::endl;
+            } else {
+                manifest->config = GetOutputConfig();
+            }
+            if(startEntry < endEntry)
+                manifest->inputs.push_back({ args.input(), startEntry, endEntry, 0 });
+            outputManifest = std::move(manifest);
+        } else if(args.format() != TrainingTupleFormat::Dense)
+            throw exception("Unsupported output format '%1%'.") % args.format();
+        // With worker processes, each worker creates the writer of its own output after it is forked.
+        if(!args.compute_stats() && args.n_workers() <= 1)
+            writer = MakeWriter(args.output(), std::move(outputManifest), args.append());
+    }
+
+    std::unique_ptr<TrainingTupleWriter> MakeWriter(const std::string& output,
+                                                    std::unique_ptr<TrainingTupleManifest> manifest, bool append) const
+    {
+        std::unique_ptr<TrainingTupleWriter> output_writer;
+        if(args.format() == TrainingTupleFormat::Root)
+            output_writer = std::make_unique<RootTrainingTupleWriter>(output, extraGridConfigs, GetRootCellLayout(),
+                                                                      args.cluster_size(), std::move(manifest),
+                                                                      append);
+        else
+            output_writer = std::make_unique<DenseTrainingTupleWriter>(output, GetAllGridConfigs(), args.storage(),
+                normalizationSpec, args.raw_features() ? args.normalization() : "");
+        if(args.async_write())
+            output_writer = std::make_unique<AsyncTrainingTupleWriter>(std::move(output_writer), 2);
+        return output_writer;
+    }
+
+    // Normalization applied to the output. With raw features only the sanity filter is applied.
+    FeatureNormalizationSpec::FeatureMap GetOutputFeatures(const std::string& scope,
+                                                           const std::string& fallback_scope = "") const
+    {
+        const auto features = normalizationSpec.GetFeatures(scope, fallback_scope);
+        return args.raw_features() ? FeatureNormalizationSpec::GetRawFeatures(features) : features;
     }
 
+    // Settings that should be the same for all inputs of the output. The normalization is identified by the checksum
+    // of the configuration file.
+    TrainingTupleManifest::Config GetOutputConfig() const
+    {
+        std::ifstream cfg(args.normalization(), std::ios::binary);
+        if(!cfg.is_open())
+            throw exception("Unable to open '%1%'.") % args.normalization();
+        const std::string cfg_content((std::istreambuf_iterator<char>(cfg)), std::istreambuf_iterator<char>());
+        boost::crc_32_type crc;
+        crc.process_bytes(cfg_content.data(), cfg_content.size());
+        std::ostringstream crc_ss;
+        crc_ss << std::hex << std::setw(8) << std::setfill('0') << crc.checksum();
+
+        return {
+            { "n_inner_cells", ToString(args.n_inner_cells()) },
+            { "inner_cell_size", ToString(args.inner_cell_size()) },
+            { "n_outer_cells", ToString(args.n_outer_cells()) },
+            { "outer_cell_size", ToString(args.outer_cell_size()) },
+            { "extra_grids", args.extra_grids() }, { "normalization_crc32", crc_ss.str() },
+            { "raw_features", ToString(args.raw_features()) },
+            { "training_weight_factor", ToString(args.training_weight_factor()) },
+            { "parity", ToString(args.parity()) }, { "cluster_size", ToString(args.cluster_size()) },
+            { "cell_encoding", ToString(args.cell_encoding()) }, { "cell_schema", ToString(args.cell_schema()) }
+        };
+    }
+
+    RootCellLayout GetRootCellLayout() const
+    {
+        RootCellLayout layout(args.cell_encoding());
+        if(args.cell_schema() == CellSchema::Compact) {
+            layout.innerCompact = MakeCompactCellEncoder(GetOutputFeatures("inner_cell", "cell"));
+            layout.outerCompact = MakeCompactCellEncoder(GetOutputFeatures("outer_cell", "cell"));
+        }
+        return layout;
+    }
+
+    std::vector<CellGridConfig> GetAllGridConfigs() const
+    {
+        CellGridConfig main;
+        main.n_inner_cells = args.n_inner_cells();
+        main.inner_cell_size = args.inner_cell_size();
+        main.n_outer_cells = args.n_outer_cells();
+        main.outer_cell_size = args.outer_cell_size();
+        std::vector<CellGridConfig> configs = { main };
+        configs.insert(configs.end(), extraGridConfigs.begin(), extraGridConfigs.end());
+        return configs;
+    }
+
+    // Grids with the standard number of cells use layouts with the traversal order precomputed at compile time.
     void Run()
     {
-        const Long64_t end_entry = std::min(tauTuple.GetEntries(), args.end_entry());
-        size_t n_processed = 0, n_total = static_cast<size_t>(end_entry - args.start_entry());
+        if(InnerCellGridLayout::Matches(args.n_inner_cells(), args.n_inner_cells()))
+            RunWithInnerLayout<InnerCellGridLayout>();
+        else
+            RunWithInnerLayout<DynamicCellGridLayout>();
+    }
+
+private:
+    template<typename InnerLayout>
+    void RunWithInnerLayout()
+    {
+        if(OuterCellGridLayout::Matches(args.n_outer_cells(), args.n_outer_cells()))
+            RunWithLayouts<InnerLayout, OuterCellGridLayout>();
+        else
+            RunWithLayouts<InnerLayout, DynamicCellGridLayout>();
+    }
+
+    template<typename InnerLayout, typename OuterLayout>
+    void RunWithLayouts()
+    {
+        using InnerCellGrid = CellGrid<InnerLayout>;
+        using OuterCellGrid = CellGrid<OuterLayout>;
+        using Context = WorkerContext<InnerCellGrid, OuterCellGrid>;
+
+        const InnerCellGrid innerCellGridRef(InnerLayout(args.n_inner_cells(), args.n_inner_cells()),
+                                             args.inner_cell_size(), args.inner_cell_size());
+        const OuterCellGrid outerCellGridRef(OuterLayout(args.n_outer_cells(), args.n_outer_cells()),
+                                             args.outer_cell_size(), args.outer_cell_size());
+        const Long64_t n_total = std::max<Long64_t>(endEntry - startEntry, 0);
+        const size_t n_chunks = static_cast<size_t>((n_total + args.chunk_size() - 1) / args.chunk_size());
+        size_t n_processed = 0;
         tools::ProgressReporter reporter(10, std::cout, "Creating training tuple...");
-        reporter.SetTotalNumberOfEvents(n_total);
-        for(Long64_t current_entry = args.start_entry(); current_entry < end_entry; ++current_entry) {
-            tauTuple.GetEntry(current_entry);
-            const auto& tau = tauTuple.data();
-            if(args.parity() == -1 || tau.evt % 2 == args.parity()) {
-                FillTauBranches(tau);
-                FillCellGrid(tau, innerCellGridRef, innerCellTuple, trainingTauTuple().innerCells_begin,
-                             trainingTauTuple().innerCells_end, true);
-                FillCellGrid(tau, outerCellGridRef, outerCellTuple, trainingTauTuple().outerCells_begin,
-                             trainingTauTuple().outerCells_end, false);
-
-                trainingTauTuple.Fill();
+        reporter.SetTotalNumberOfEvents(static_cast<size_t>(n_total));
+
+        std::vector<std::unique_ptr<InputStatistics>> statistics;
+        if(args.compute_stats()) {
+            for(unsigned n = 0; n < std::max(args.n_threads(), 1u); ++n)
+                statistics.push_back(std::make_unique<InputStatistics>(normalizationSpec));
+        }
+        const auto getStatistics = [&](unsigned n) { return statistics.empty() ? nullptr : statistics.at(n).get(); };
+
+        if(args.n_workers() > 1) {
+            n_processed = RunWorkerProcesses(n_chunks, innerCellGridRef, outerCellGridRef, reporter);
+        } else if(args.n_threads() > 1) {
+            ChunkQueue queue(n_chunks, 4 * args.n_threads());
+            std::vector<std::thread> workers;
+            for(unsigned n = 0; n < args.n_threads(); ++n)
+                workers.emplace_back(&TrainingTupleProducer::RunWorker<InnerCellGrid, OuterCellGrid>, this,
+                                     std::ref(queue), std::cref(innerCellGridRef), std::cref(outerCellGridRef),
+                                     getStatistics(n));
+            try {
+                while(queue.HasNext()) {
+                    auto chunk = queue.PopNext();
+                    WriteChunk(*chunk, n_processed, reporter);
+                }
+            } catch(...) {
+                queue.SetError(std::current_exception());
+                for(auto& worker : workers)
+                    worker.join();
+                throw;
+            }
+            for(auto& worker : workers)
+                worker.join();
+        } else {
+            ProcessedChunk chunk;
+            Context context(innerCellGridRef, outerCellGridRef, extraCellGridRefs);
+            context.statistics = getStatistics(0);
+            for(size_t chunk_id = 0; chunk_id < n_chunks; ++chunk_id) {
+                ProcessChunk(tauReader, chunk_id, context, chunk);
+                WriteChunk(chunk, n_processed, reporter);
             }
-            if(++n_processed % 1000 == 0)
-                reporter.Report(n_processed);
         }
         reporter.Report(n_processed, true);
 
-        trainingTauTuple.Write();
-        innerCellTuple.Write();
-        outerCellTuple.Write();
-        std::cout << "Training tuples has been successfully stored in " << args.output() << "." << std::endl;
+        if(args.compute_stats()) {
+            for(size_t n = 1; n < statistics.size(); ++n)
+                statistics.front()->Merge(*statistics.at(n));
+            WriteNormalization(*statistics.front());
+            std::cout << "Normalization has been successfully stored in " << args.output() << "." << std::endl;
+        } else if(writer) {
+            writer->Finalize();
+            std::cout << "Training tuples has been successfully stored in " << args.output() << "." << std::endl;
+        } else {
+            std::cout << "Training tuples has been successfully stored in the outputs listed in "
+                      << GetChunkIndexName() << "." << std::endl;
+        }
     }
 
-private:
-    static constexpr float pi = boost::math::constants::pi<float>();
+    void WriteNormalization(const InputStatistics& statistics) const
+    {
+        std::ofstream cfg(args.output());
+        if(!cfg.is_open())
+            throw exception("Unable to create '%1%'.") % args.output();
+        statistics.taus.WriteNormalization(cfg, "tau", args.stats_quantile());
+        statistics.innerCells.WriteNormalization(cfg, "inner_cell", args.stats_quantile());
+        statistics.outerCells.WriteNormalization(cfg, "outer_cell", args.stats_quantile());
+        if(!cfg.good())
+            throw exception("Error while writing '%1%'.") % args.output();
+    }
 
-    template<typename Scalar>
-    static Scalar DeltaPhi(Scalar phi1, Scalar phi2)
+    template<typename InnerCellGrid, typename OuterCellGrid>
+    void RunWorker(ChunkQueue& queue, const InnerCellGrid& innerCellGridRef,
+                   const OuterCellGrid& outerCellGridRef, InputStatistics* statistics) const
     {
-        static constexpr Scalar pi = boost::math::constants::pi<Scalar>();
-        Scalar dphi = phi1 - phi2;
-        if(dphi > pi)
-            dphi -= 2*pi;
-        else if(dphi <= -pi)
-            dphi += 2*pi;
-        return dphi;
+        try {
+            auto workerTauReader = MakeInputReader();
+            WorkerContext<InnerCellGrid, OuterCellGrid> context(innerCellGridRef, outerCellGridRef, extraCellGridRefs);
+            context.statistics = statistics;
+            size_t chunk_id;
+            while(queue.TryAcquire(chunk_id)) {
+                auto chunk = std::make_unique<ProcessedChunk>();
+                ProcessChunk(workerTauReader, chunk_id, context, *chunk);
+                queue.Push(chunk_id, std::move(chunk));
+            }
+        } catch(...) {
+            queue.SetError(std::current_exception());
+        }
     }
 
-    template<typename T>
-    static float GetValue(T value)
+    // Counters in memory shared between the worker processes.
+    struct SharedWorkerState {
+        std::atomic<size_t> next_chunk_id, n_processed;
+    };
+
+    // Output of a chunk, filled in the shared memory by the worker that has processed it.
+    struct WorkerChunk {
+        unsigned worker;
+        size_t n_processed, n_taus;
+    };
+
+    // Worker processes claim chunks one by one from a shared counter and write them into their own outputs, so the
+    // chunks of an output are in the order of the input entries. The entries are not copied after the workers are
+    // finished: the outputs are kept as they are and the order of the chunks is stored in the chunk index.
+    template<typename InnerCellGrid, typename OuterCellGrid>
+    size_t RunWorkerProcesses(size_t n_chunks, const InnerCellGrid& innerCellGridRef,
+                              const OuterCellGrid& outerCellGridRef, tools::ProgressReporter& reporter)
     {
-        return std::isnormal(value) ? static_cast<float>(value) : 0.f;
+        const size_t shared_size = sizeof(SharedWorkerState) + n_chunks * sizeof(WorkerChunk);
+        void* shared_memory = mmap(nullptr, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if(shared_memory == MAP_FAILED)
+            throw exception("Unable to allocate memory shared between the worker processes.");
+        SharedWorkerState* state = new(shared_memory) SharedWorkerState();
+        state->next_chunk_id = 0;
+        state->n_processed = 0;
+        WorkerChunk* worker_chunks = reinterpret_cast<WorkerChunk*>(static_cast<char*>(shared_memory)
+                                                                    + sizeof(SharedWorkerState));
+        for(size_t chunk_id = 0; chunk_id < n_chunks; ++chunk_id)
+            worker_chunks[chunk_id] = WorkerChunk{ args.n_workers(), 0, 0 };
+
+        std::vector<std::string> outputs;
+        size_t n_running = 0;
+        bool failed = false;
+        std::cout.flush();
+        std::cerr.flush();
+        for(unsigned n = 0; n < args.n_workers(); ++n) {
+            outputs.push_back(GetWorkerOutputName(n));
+            const pid_t pid = fork();
+            if(pid == 0) {
+                int status = 0;
+                try {
+                    RunWorkerProcess(n, outputs.back(), *state, worker_chunks, n_chunks, innerCellGridRef,
+                                     outerCellGridRef);
+                } catch(std::exception& e) {
+                    std::cerr << "ERROR in worker " << n << ": " << e.what() << std::endl;
+                    status = 1;
+                }
+                std::cout.flush();
+                std::cerr.flush();
+                _exit(status);
+            }
+            if(pid < 0) {
+                std::cerr << "ERROR: unable to start worker process " << n << "." << std::endl;
+                state->next_chunk_id = n_chunks;
+                failed = true;
+                break;
+            }
+            ++n_running;
+        }
+
+        size_t reported = 0;
+        while(n_running) {
+            int status;
+            const pid_t pid = waitpid(-1, &status, WNOHANG);
+            if(pid > 0) {
+                --n_running;
+                if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    state->next_chunk_id = n_chunks;
+                    failed = true;
+                }
+            } else if(pid == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            } else {
+                failed = true;
+                break;
+            }
+            const size_t n_processed = state->n_processed;
+            if(n_processed / 1000 != reported / 1000)
+                reporter.Report(n_processed);
+            reported = n_processed;
+        }
+        const size_t n_processed = state->n_processed;
+        const std::vector<WorkerChunk> chunks(worker_chunks, worker_chunks + n_chunks);
+        state->~SharedWorkerState();
+        munmap(shared_memory, shared_size);
+
+        if(!failed) {
+            WriteChunkIndex(outputs, chunks);
+        } else {
+            for(const std::string& output : outputs) {
+                boost::filesystem::remove_all(output);
+                boost::filesystem::remove(output + ".index.json");
+            }
+            throw exception("At least one of the worker processes has failed.");
+        }
+        return n_processed;
     }
 
-    template<typename T>
-    static float GetValueLinear(T value, float min_value, float max_value, bool positive)
+    template<typename InnerCellGrid, typename OuterCellGrid>
+    void RunWorkerProcess(unsigned worker, const std::string& output, SharedWorkerState& state,
+                          WorkerChunk* worker_chunks, size_t n_chunks, const InnerCellGrid& innerCellGridRef,
+                          const OuterCellGrid& outerCellGridRef) const
     {
-        const float fixed_value = GetValue(value);
-        const float clamped_value = std::clamp(fixed_value, min_value, max_value);
-        float transformed_value = (clamped_value - min_value) / (max_value - min_value);
-        if(!positive)
-            transformed_value = transformed_value * 2 - 1;
-        return transformed_value;
+        if(args.n_compression_threads())
+            ROOT::EnableImplicitMT(args.n_compression_threads());
+        auto workerTauReader = MakeInputReader();
+        WorkerContext<InnerCellGrid, OuterCellGrid> context(innerCellGridRef, outerCellGridRef, extraCellGridRefs);
+        auto workerWriter = MakeWriter(output, nullptr, false);
+        ProcessedChunk chunk;
+        for(size_t chunk_id = state.next_chunk_id++; chunk_id < n_chunks; chunk_id = state.next_chunk_id++) {
+            ProcessChunk(workerTauReader, chunk_id, context, chunk);
+            worker_chunks[chunk_id] = WorkerChunk{ worker, chunk.n_processed, chunk.taus.size() };
+            workerWriter->Write(chunk);
+            state.n_processed += chunk.n_processed;
+        }
+        workerWriter->Finalize();
     }
 
-    template<typename T>
-    static float GetValueNorm(T value, float mean, float sigma, float n_sigmas_max = 5)
+    // <name>_<worker><extension> in the directory of the output.
+    std::string GetWorkerOutputName(unsigned worker) const
     {
-        const float fixed_value = GetValue(value);
-        const float norm_value = (fixed_value - mean) / sigma;
-        return std::clamp(norm_value, -n_sigmas_max, n_sigmas_max);
+        const boost::filesystem::path output(args.output());
+        const std::string name = output.stem().string() + "_" + std::to_string(worker) + output.extension().string();
+        return (output.parent_path() / name).string();
     }
 
-    #define CP_BR(name) trainingTauTuple().name = tau.name;
+    std::string GetChunkIndexName() const { return args.output() + ".chunks.json"; }
+
+    // Outputs of the workers, relative to the directory of the index, and the output and the tau range of each
+    // chunk in the order of the input entries.
+    void WriteChunkIndex(const std::vector<std::string>& outputs, const std::vector<WorkerChunk>& chunks) const
+    {
+        std::vector<size_t> n_taus(outputs.size(), 0);
+        const std::string index_name = GetChunkIndexName();
+        std::ofstream json(index_name);
+        if(!json.is_open())
+            throw exception("Unable to create '%1%'.") % index_name;
+        json << "{\n    \"files\": [";
+        for(size_t n = 0; n < outputs.size(); ++n)
+            json << (n ? ", " : "") << "\"" << boost::filesystem::path(outputs.at(n)).filename().string() << "\"";
+        json << "],\n    \"chunks\": [\n";
+        for(size_t chunk_id = 0; chunk_id < chunks.size(); ++chunk_id) {
+            const WorkerChunk& chunk = chunks.at(chunk_id);
+            if(chunk.worker >= outputs.size())
+                throw exception("Chunk %1% has not been processed by the worker processes.") % chunk_id;
+            size_t& taus_begin = n_taus.at(chunk.worker);
+            json << "        { \"id\": " << chunk_id << ", \"file\": " << chunk.worker << ", \"n_processed\": "
+                 << chunk.n_processed << ", \"taus\": [" << taus_begin << ", " << taus_begin + chunk.n_taus << "] }"
+                 << (chunk_id + 1 == chunks.size() ? "" : ",") << "\n";
+            taus_begin += chunk.n_taus;
+        }
+        json << "    ]\n}\n";
+        if(!json.good())
+            throw exception("Error while writing '%1%'.") % index_name;
+    }
+
+    template<typename Context>
+    void ProcessChunk(TwoPhaseTauTupleReader& inputReader, size_t chunk_id, Context& context,
+                      ProcessedChunk& chunk) const
+    {
+        chunk.taus.clear();
+        chunk.occupancy.clear();
+        chunk.innerCells.clear();
+        chunk.outerCells.clear();
+        chunk.extraGrids.resize(context.extraCellGrids.size());
+        for(TrainingGridCells& gridCells : chunk.extraGrids) {
+            gridCells.ranges.clear();
+            gridCells.occupancy.clear();
+            gridCells.innerCells.clear();
+            gridCells.outerCells.clear();
+        }
+        const Long64_t chunk_begin = startEntry + static_cast<Long64_t>(chunk_id) * args.chunk_size();
+        const Long64_t chunk_end = std::min(chunk_begin + args.chunk_size(), endEntry);
+        chunk.chunk_id = chunk_id;
+        const auto select = [&](const Tau& tau) { return args.parity() == -1 || tau.evt % 2 == args.parity(); };
+        inputReader.ForEach(chunk_begin, chunk_end, select, [&](const Tau& tau) {
+            chunk.taus.emplace_back();
+            TrainingTau& out = chunk.taus.back();
+            FillTauBranches(tau, out);
+            FillCellCandidates(tau, context.candidateWorkspace, context.candidates);
+            TrainingCellOccupancy* occupancy = AddOccupancy(chunk.occupancy);
+            FillCellGrid(tau, context.candidates, context.innerCellGrid, chunk.innerCells, out.innerCells_begin,
+                         out.innerCells_end, true, occupancy ? &occupancy->innerCells_occupancy : nullptr);
+            FillCellGrid(tau, context.candidates, context.outerCellGrid, chunk.outerCells, out.outerCells_begin,
+                         out.outerCells_end, false, occupancy ? &occupancy->outerCells_occupancy : nullptr);
+            for(size_t n = 0; n < context.extraCellGrids.size(); ++n) {
+                ExtraCellGrids& grids = context.extraCellGrids[n];
+                TrainingGridCells& gridCells = chunk.extraGrids[n];
+                gridCells.ranges.emplace_back();
+                auto& range = gridCells.ranges.back();
+                TrainingCellOccupancy* gridOccupancy = AddOccupancy(gridCells.occupancy);
+                FillCellGrid(tau, context.candidates, grids.inner, gridCells.innerCells, range.innerCells_begin,
+                             range.innerCells_end, true,
+                             gridOccupancy ? &gridOccupancy->innerCells_occupancy : nullptr);
+                FillCellGrid(tau, context.candidates, grids.outer, gridCells.outerCells, range.outerCells_begin,
+                             range.outerCells_end, false,
+                             gridOccupancy ? &gridOccupancy->outerCells_occupancy : nullptr);
+            }
+            return true;
+        });
+        if(context.statistics) {
+            context.statistics->taus.Fill(chunk.taus, context.normalizationWorkspace);
+            context.statistics->innerCells.Fill(chunk.innerCells, context.normalizationWorkspace);
+            context.statistics->outerCells.Fill(chunk.outerCells, context.normalizationWorkspace);
+            chunk.taus.clear();
+            chunk.innerCells.clear();
+            chunk.outerCells.clear();
+        } else {
+            tauNormalizer.Apply(chunk.taus, context.normalizationWorkspace);
+            innerCellNormalizer.Apply(chunk.innerCells, context.normalizationWorkspace);
+            outerCellNormalizer.Apply(chunk.outerCells, context.normalizationWorkspace);
+            for(TrainingGridCells& gridCells : chunk.extraGrids) {
+                innerCellNormalizer.Apply(gridCells.innerCells, context.normalizationWorkspace);
+                outerCellNormalizer.Apply(gridCells.outerCells, context.normalizationWorkspace);
+            }
+        }
+        chunk.n_processed = static_cast<size_t>(std::max<Long64_t>(chunk_end - chunk_begin, 0));
+    }
+
+    static std::vector<ExtraCellGrids> MakeExtraCellGrids(const std::vector<CellGridConfig>& configs)
+    {
+        std::vector<ExtraCellGrids> grids;
+        for(const CellGridConfig& config : configs) {
+            grids.push_back(ExtraCellGrids{
+                CellGrid<DynamicCellGridLayout>(DynamicCellGridLayout(config.n_inner_cells, config.n_inner_cells),
+                                                config.inner_cell_size, config.inner_cell_size),
+                CellGrid<DynamicCellGridLayout>(DynamicCellGridLayout(config.n_outer_cells, config.n_outer_cells),
+                                                config.outer_cell_size, config.outer_cell_size)
+            });
+        }
+        return grids;
+    }
+
+    void WriteChunk(const ProcessedChunk& chunk, size_t& n_processed, tools::ProgressReporter& reporter)
+    {
+        if(writer)
+            writer->Write(chunk);
+        const size_t prev_n_processed = n_processed;
+        n_processed += chunk.n_processed;
+        if(n_processed / 1000 != prev_n_processed / 1000)
+            reporter.Report(n_processed);
+    }
+
+    static constexpr float iso_cone_dR2 = 0.5f * 0.5f;
+
+    // Input tuple reader. With the parity selection, evt is read first, and other branches only for the selected taus.
+    TwoPhaseTauTupleReader MakeInputReader() const
+    {
+        std::set<std::string> selection_branches;
+        if(args.parity() != -1)
+            selection_branches.insert("evt");
+        return TwoPhaseTauTupleReader(args.input(), "taus", selection_branches, InputBranches());
+    }
+
+    // Branches of the input tuple that are read to fill the training tuple. Baskets of other branches are not read.
+    static const std::set<std::string>& InputBranches()
+    {
+        #define TAU_ID(name, pattern, has_raw, wp_list) #name, #name "raw",
+        static const std::set<std::string> branches = tau_tuple::CheckTauTupleBranches({
+            "run", "lumi", "evt", "npv", "rho", "genEventWeight", "trainingWeight", "sampleType", "npu", "pv_x", "pv_y",
+            "pv_z", "pv_chi2", "pv_ndof", "jet_index", "jet_pt", "jet_eta", "jet_phi", "jet_mass",
+            "jet_neutralHadronEnergyFraction", "jet_neutralEmEnergyFraction", "jet_nConstituents",
+            "jet_chargedMultiplicity", "jet_neutralMultiplicity", "jet_partonFlavour", "jet_hadronFlavour",
+            "jet_has_gen_match", "jet_gen_pt", "jet_gen_eta", "jet_gen_phi", "jet_gen_mass", "jet_gen_n_b",
+            "jet_gen_n_c", "jetTauMatch", "tau_index", "tau_pt", "tau_eta", "tau_phi", "tau_mass", "tau_charge",
+            "lepton_gen_match", "lepton_gen_charge", "lepton_gen_pt", "lepton_gen_eta", "lepton_gen_phi",
+            "lepton_gen_mass", "lepton_gen_vis_pt", "lepton_gen_vis_eta", "lepton_gen_vis_phi", "lepton_gen_vis_mass",
+            "qcd_gen_match", "qcd_gen_charge", "qcd_gen_pt", "qcd_gen_eta", "qcd_gen_phi", "qcd_gen_mass",
+            "tau_decayMode", "tau_decayModeFinding", "tau_decayModeFindingNewDMs", "chargedIsoPtSum",
+            "chargedIsoPtSumdR03", "footprintCorrection", "neutralIsoPtSum", "neutralIsoPtSumWeight",
+            "neutralIsoPtSumWeightdR03", "neutralIsoPtSumdR03", "photonPtSumOutsideSignalCone", "puCorrPtSum",
+            "tau_dxy_pca_x", "tau_dxy_pca_y", "tau_dxy_pca_z", "tau_dxy", "tau_dxy_error", "tau_ip3d", "tau_ip3d_error",
+            "tau_dz", "tau_dz_error", "tau_flightLength_x", "tau_flightLength_y", "tau_flightLength_z",
+            "tau_flightLength_sig", "tau_pt_weighted_deta_strip", "tau_pt_weighted_dphi_strip",
+            "tau_pt_weighted_dr_signal", "tau_pt_weighted_dr_iso", "tau_leadingTrackNormChi2", "tau_e_ratio",
+            "tau_gj_angle_diff", "tau_n_photons", "tau_emFraction", "tau_inside_ecal_crack",
+            "leadChargedCand_etaAtEcalEntrance", "pfCand_tauSignal", "pfCand_leadChargedHadrCand", "pfCand_tauIso",
+            "pfCand_pt", "pfCand_eta", "pfCand_phi", "pfCand_pvAssociationQuality", "pfCand_fromPV",
+            "pfCand_puppiWeight", "pfCand_puppiWeightNoLep", "pfCand_pdgId", "pfCand_charge", "pfCand_lostInnerHits",
+            "pfCand_numberOfPixelHits", "pfCand_vertex_x", "pfCand_vertex_y", "pfCand_vertex_z",
+            "pfCand_hasTrackDetails", "pfCand_dxy", "pfCand_dxy_error", "pfCand_dz", "pfCand_dz_error",
+            "pfCand_track_chi2", "pfCand_track_ndof", "pfCand_hcalFraction", "pfCand_rawCaloFraction", "ele_pt",
+            "ele_eta", "ele_phi", "ele_cc_ele_energy", "ele_cc_gamma_energy", "ele_cc_n_gamma",
+            "ele_trackMomentumAtVtx", "ele_trackMomentumAtCalo", "ele_trackMomentumOut", "ele_trackMomentumAtEleClus",
+            "ele_trackMomentumAtVtxWithConstraint", "ele_ecalEnergy", "ele_ecalEnergy_error", "ele_eSuperClusterOverP",
+            "ele_eSeedClusterOverP", "ele_eSeedClusterOverPout", "ele_eEleClusterOverPout",
+            "ele_deltaEtaSuperClusterTrackAtVtx", "ele_deltaEtaSeedClusterTrackAtCalo",
+            "ele_deltaEtaEleClusterTrackAtCalo", "ele_deltaPhiEleClusterTrackAtCalo",
+            "ele_deltaPhiSuperClusterTrackAtVtx", "ele_deltaPhiSeedClusterTrackAtCalo", "ele_mvaInput_earlyBrem",
+            "ele_mvaInput_lateBrem", "ele_mvaInput_sigmaEtaEta", "ele_mvaInput_hadEnergy", "ele_mvaInput_deltaEta",
+            "ele_gsfTrack_normalizedChi2", "ele_gsfTrack_numberOfValidHits", "ele_gsfTrack_pt", "ele_gsfTrack_pt_error",
+            "ele_closestCtfTrack_normalizedChi2", "ele_closestCtfTrack_numberOfValidHits", "muon_pt", "muon_eta",
+            "muon_phi", "muon_dxy", "muon_dxy_error", "muon_normalizedChi2", "muon_numberOfValidHits",
+            "muon_segmentCompatibility", "muon_caloCompatibility", "muon_pfEcalEnergy", "muon_n_matches_DT_1",
+            "muon_n_matches_DT_2", "muon_n_matches_DT_3", "muon_n_matches_DT_4", "muon_n_matches_CSC_1",
+            "muon_n_matches_CSC_2", "muon_n_matches_CSC_3", "muon_n_matches_CSC_4", "muon_n_matches_RPC_1",
+            "muon_n_matches_RPC_2", "muon_n_matches_RPC_3", "muon_n_matches_RPC_4", "muon_n_hits_DT_1",
+            "muon_n_hits_DT_2", "muon_n_hits_DT_3", "muon_n_hits_DT_4", "muon_n_hits_CSC_1", "muon_n_hits_CSC_2",
+            "muon_n_hits_CSC_3", "muon_n_hits_CSC_4", "muon_n_hits_RPC_1", "muon_n_hits_RPC_2", "muon_n_hits_RPC_3",
+            "muon_n_hits_RPC_4",
+            TAU_IDS()
+        });
+        #undef TAU_ID
+        return branches;
+    }
+
+    #define CP_BR(name) out.name = tau.name;
     #define TAU_ID(name, pattern, has_raw, wp_list) CP_BR(name) CP_BR(name##raw)
-    void FillTauBranches(const Tau& tau)
+    void FillTauBranches(const Tau& tau, TrainingTau& out) const
     {
-        auto& out = trainingTauTuple();
         out.run = tau.run;
         out.lumi = tau.lumi;
         out.evt = tau.evt;
-        out.npv = GetValueNorm(tau.npv, 29.51f, 13.31f);
-        out.rho = GetValueNorm(tau.rho, 21.49f, 9.713f);
+        out.npv = tau.npv;
+        out.rho = tau.rho;
         out.genEventWeight = tau.genEventWeight;
         out.trainingWeight = tau.trainingWeight * trainingWeightFactor;
         out.npu = tau.npu;
-        out.pv_x = GetValueNorm(tau.pv_x, -0.0274f, 0.0018f);
-        out.pv_y = GetValueNorm(tau.pv_y, 0.0693f, 0.0017f);
-        out.pv_z = GetValueNorm(tau.pv_z, 0.8196f, 3.501f);
-        out.pv_chi2 = GetValueNorm(tau.pv_chi2, 95.6f, 45.13f);
-        out.pv_ndof = GetValueNorm(tau.pv_ndof, 125.2f, 56.96f);
+        out.pv_x = tau.pv_x;
+        out.pv_y = tau.pv_y;
+        out.pv_z = tau.pv_z;
+        out.pv_chi2 = tau.pv_chi2;
+        out.pv_ndof = tau.pv_ndof;
 
         CP_BRANCHES(jet_index, jet_pt, jet_eta, jet_phi, jet_mass, jet_neutralHadronEnergyFraction,
                     jet_neutralEmEnergyFraction, jet_nConstituents, jet_chargedMultiplicity, jet_neutralMultiplicity,
@@ -224,162 +1147,144 @@ private:
                     jet_gen_mass, jet_gen_n_b, jet_gen_n_c, jetTauMatch)
 
         out.tau_index = tau.tau_index;
-        out.tau_pt = GetValueLinear(tau.tau_pt, 20.f, 1000.f, true);
-        out.tau_eta = GetValueLinear(tau.tau_eta, -2.3f, 2.3f, false);
-        out.tau_phi = GetValueLinear(tau.tau_phi, -pi, pi, false);
-        out.tau_mass = GetValueNorm(tau.tau_mass, 0.6669f, 0.6553f);
+        out.tau_pt = tau.tau_pt;
+        out.tau_eta = tau.tau_eta;
+        out.tau_phi = tau.tau_phi;
+        out.tau_mass = tau.tau_mass;
         const LorentzVectorM tau_p4(tau.tau_pt, tau.tau_eta, tau.tau_phi, tau.tau_mass);
-        out.tau_E_over_pt = GetValueLinear(tau_p4.energy() / tau.tau_pt, 1.f, 5.2f, true);
-        out.tau_charge = GetValue(tau.tau_charge);
-        out.tau_n_charged_prongs = GetValueLinear(tau.tau_decayMode / 5 + 1, 1, 3, true);
-        out.tau_n_neutral_prongs = GetValueLinear(tau.tau_decayMode % 5, 0, 2, true);
+        out.tau_E_over_pt = tau_p4.energy() / tau.tau_pt;
+        out.tau_charge = tau.tau_charge;
+        out.tau_n_charged_prongs = tau.tau_decayMode / 5 + 1;
+        out.tau_n_neutral_prongs = tau.tau_decayMode % 5;
         CP_BRANCHES(lepton_gen_match, lepton_gen_charge, lepton_gen_pt, lepton_gen_eta, lepton_gen_phi, lepton_gen_mass,
                     qcd_gen_match, qcd_gen_charge, qcd_gen_pt, qcd_gen_eta, qcd_gen_phi, qcd_gen_mass,
                     tau_decayMode, tau_decayModeFinding, tau_decayModeFindingNewDMs)
 
 
-        out.chargedIsoPtSum = GetValueNorm(tau.chargedIsoPtSum, 47.78f, 123.5f);
-        out.chargedIsoPtSumdR03_over_dR05 = GetValue(tau.chargedIsoPtSumdR03 / tau.chargedIsoPtSum);
-        out.footprintCorrection = GetValueNorm(tau.footprintCorrection, 9.029f, 26.42f);
-        out.neutralIsoPtSum = GetValueNorm(tau.neutralIsoPtSum, 57.59f, 155.3f);
-        out.neutralIsoPtSumWeight_over_neutralIsoPtSum = GetValue(tau.neutralIsoPtSumWeight / tau.neutralIsoPtSum);
-        out.neutralIsoPtSumWeightdR03_over_neutralIsoPtSum =
-            GetValue(tau.neutralIsoPtSumWeightdR03 / tau.neutralIsoPtSum);
-        out.neutralIsoPtSumdR03_over_dR05 = GetValue(tau.neutralIsoPtSumdR03 / tau.neutralIsoPtSum);
-        out.photonPtSumOutsideSignalCone = GetValueNorm(tau.photonPtSumOutsideSignalCone, 1.731f, 6.846f);
-        out.puCorrPtSum = GetValueNorm(tau.puCorrPtSum, 22.38f, 16.34f);
+        out.chargedIsoPtSum = tau.chargedIsoPtSum;
+        out.chargedIsoPtSumdR03_over_dR05 = tau.chargedIsoPtSumdR03 / tau.chargedIsoPtSum;
+        out.footprintCorrection = tau.footprintCorrection;
+        out.neutralIsoPtSum = tau.neutralIsoPtSum;
+        out.neutralIsoPtSumWeight_over_neutralIsoPtSum = tau.neutralIsoPtSumWeight / tau.neutralIsoPtSum;
+        out.neutralIsoPtSumWeightdR03_over_neutralIsoPtSum = tau.neutralIsoPtSumWeightdR03 / tau.neutralIsoPtSum;
+        out.neutralIsoPtSumdR03_over_dR05 = tau.neutralIsoPtSumdR03 / tau.neutralIsoPtSum;
+        out.photonPtSumOutsideSignalCone = tau.photonPtSumOutsideSignalCone;
+        out.puCorrPtSum = tau.puCorrPtSum;
 
-        out.tau_dxy_pca_x = GetValueNorm(tau.tau_dxy_pca_x, -0.0241f, 0.0074f);
-        out.tau_dxy_pca_y = GetValueNorm(tau.tau_dxy_pca_y, 0.0675f, 0.0128f);
-        out.tau_dxy_pca_z = GetValueNorm(tau.tau_dxy_pca_z, 0.7973f, 3.456f);
+        out.tau_dxy_pca_x = tau.tau_dxy_pca_x;
+        out.tau_dxy_pca_y = tau.tau_dxy_pca_y;
+        out.tau_dxy_pca_z = tau.tau_dxy_pca_z;
 
         const bool tau_dxy_valid = std::isnormal(tau.tau_dxy) && tau.tau_dxy > - 10
                                    && std::isnormal(tau.tau_dxy_error) && tau.tau_dxy_error > 0;
         out.tau_dxy_valid = tau_dxy_valid;
-        out.tau_dxy = tau_dxy_valid ? GetValueNorm(tau.tau_dxy, 0.0018f, 0.0085f) : 0.f;
-        out.tau_dxy_sig = tau_dxy_valid ? GetValueNorm(std::abs(tau.tau_dxy)/tau.tau_dxy_error, 2.26f, 4.191f) : 0.f;
+        out.tau_dxy = tau_dxy_valid ? tau.tau_dxy : 0;
+        out.tau_dxy_sig = tau_dxy_valid ? std::abs(tau.tau_dxy)/tau.tau_dxy_error : 0;
 
         const bool tau_ip3d_valid = std::isnormal(tau.tau_ip3d) && tau.tau_ip3d > - 10
                                     && std::isnormal(tau.tau_ip3d_error) && tau.tau_ip3d_error > 0;
         out.tau_ip3d_valid = tau_ip3d_valid;
-        out.tau_ip3d = tau_ip3d_valid ? GetValueNorm(tau.tau_ip3d, 0.0026f, 0.0114f) : 0.f;
-        out.tau_ip3d_sig = tau_ip3d_valid
-                         ? GetValueNorm(std::abs(tau.tau_ip3d) / tau.tau_ip3d_error, 2.928f, 4.466f) : 0.f;
+        out.tau_ip3d = tau_ip3d_valid ? tau.tau_ip3d : 0;
+        out.tau_ip3d_sig = tau_ip3d_valid ? std::abs(tau.tau_ip3d) / tau.tau_ip3d_error : 0;
 
-        out.tau_dz = GetValueNorm(tau.tau_dz, 0.f, 0.0190f);
+        out.tau_dz = tau.tau_dz;
         const bool tau_dz_sig_valid = std::isnormal(tau.tau_dz) && std::isnormal(tau.tau_dz_error)
                                       && tau.tau_dz_error > 0;
         out.tau_dz_sig_valid = tau_dz_sig_valid;
-        out.tau_dz_sig = tau_dz_sig_valid ? GetValueNorm(std::abs(tau.tau_dz) / tau.tau_dz_error, 4.717f, 11.78f) : 0.f;
+        out.tau_dz_sig = tau_dz_sig_valid ? std::abs(tau.tau_dz) / tau.tau_dz_error : 0;
 
-        out.tau_flightLength_x = GetValueNorm(tau.tau_flightLength_x, -0.0003f, 0.7362f);
-        out.tau_flightLength_y = GetValueNorm(tau.tau_flightLength_y, -0.0009f, 0.7354f);
-        out.tau_flightLength_z = GetValueNorm(tau.tau_flightLength_z, -0.0022f, 1.993f);
-        out.tau_flightLength_sig = GetValueNorm(tau.tau_flightLength_sig, -4.78f, 9.573f);
+        out.tau_flightLength_x = tau.tau_flightLength_x;
+        out.tau_flightLength_y = tau.tau_flightLength_y;
+        out.tau_flightLength_z = tau.tau_flightLength_z;
+        out.tau_flightLength_sig = tau.tau_flightLength_sig;
 
-        out.tau_pt_weighted_deta_strip = GetValueLinear(tau.tau_pt_weighted_deta_strip, 0, 1, true);
-        out.tau_pt_weighted_dphi_strip = GetValueLinear(tau.tau_pt_weighted_dphi_strip, 0, 1, true);
-        out.tau_pt_weighted_dr_signal = GetValueNorm(tau.tau_pt_weighted_dr_signal, 0.0052f, 0.01433f);
-        out.tau_pt_weighted_dr_iso = GetValueLinear(tau.tau_pt_weighted_dr_iso, 0, 1, true);
+        out.tau_pt_weighted_deta_strip = tau.tau_pt_weighted_deta_strip;
+        out.tau_pt_weighted_dphi_strip = tau.tau_pt_weighted_dphi_strip;
+        out.tau_pt_weighted_dr_signal = tau.tau_pt_weighted_dr_signal;
+        out.tau_pt_weighted_dr_iso = tau.tau_pt_weighted_dr_iso;
 
-        out.tau_leadingTrackNormChi2 = GetValueNorm(tau.tau_leadingTrackNormChi2, 1.538f, 4.401f);
+        out.tau_leadingTrackNormChi2 = tau.tau_leadingTrackNormChi2;
         const bool tau_e_ratio_valid = std::isnormal(tau.tau_e_ratio) && tau.tau_e_ratio > 0.f;
         out.tau_e_ratio_valid = tau_e_ratio_valid;
-        out.tau_e_ratio = tau_e_ratio_valid ? GetValueLinear(tau.tau_e_ratio, 0, 1, true) : 0.f;
+        out.tau_e_ratio = tau_e_ratio_valid ? tau.tau_e_ratio : 0;
         const bool tau_gj_angle_diff_valid = (std::isnormal(tau.tau_gj_angle_diff) || tau.tau_gj_angle_diff == 0)
             && tau.tau_gj_angle_diff >= 0;
         out.tau_gj_angle_diff_valid = tau_gj_angle_diff_valid;
-        out.tau_gj_angle_diff = tau_gj_angle_diff_valid ? GetValueLinear(tau.tau_gj_angle_diff, 0, pi, true) : 0;
-        out.tau_n_photons = GetValueNorm(tau.tau_n_photons, 2.95f, 3.927f);
-        out.tau_emFraction = GetValueLinear(tau.tau_emFraction, -1, 1, false);
-        out.tau_inside_ecal_crack = GetValue(tau.tau_inside_ecal_crack);
-        out.leadChargedCand_etaAtEcalEntrance_minus_tau_eta =
-            GetValueNorm(tau.leadChargedCand_etaAtEcalEntrance - tau.tau_eta, 0.0042f, 0.0323f);
+        out.tau_gj_angle_diff = tau_gj_angle_diff_valid ? tau.tau_gj_angle_diff : 0;
+        out.tau_n_photons = tau.tau_n_photons;
+        out.tau_emFraction = tau.tau_emFraction;
+        out.tau_inside_ecal_crack = tau.tau_inside_ecal_crack;
+        out.leadChargedCand_etaAtEcalEntrance_minus_tau_eta = tau.leadChargedCand_etaAtEcalEntrance - tau.tau_eta;
 
         TAU_IDS()
         const TauType tauType = GenMatchToTauType(static_cast<GenLeptonMatch>(tau.lepton_gen_match),
                                                   static_cast<SampleType>(tau.sampleType));
-        trainingTauTuple().gen_e = tauType == TauType::e;
-        trainingTauTuple().gen_mu = tauType == TauType::mu;
-        trainingTauTuple().gen_tau = tauType == TauType::tau;
-        trainingTauTuple().gen_jet = tauType == TauType::jet;
-        trainingTauTuple().gen_emb = tauType == TauType::emb;
-        trainingTauTuple().gen_data = tauType == TauType::data;
+        out.gen_e = tauType == TauType::e;
+        out.gen_mu = tauType == TauType::mu;
+        out.gen_tau = tauType == TauType::tau;
+        out.gen_jet = tauType == TauType::jet;
+        out.gen_emb = tauType == TauType::emb;
+        out.gen_data = tauType == TauType::data;
         if(tauType != TauType::jet && tauType != TauType::data) {
             const auto gen_vis_sum = SumP4(tau.lepton_gen_vis_pt, tau.lepton_gen_vis_eta, tau.lepton_gen_vis_phi,
                                            tau.lepton_gen_vis_mass);
-            trainingTauTuple().lepton_gen_vis_pt = static_cast<float>(gen_vis_sum.first.pt());
-            trainingTauTuple().lepton_gen_vis_eta = static_cast<float>(gen_vis_sum.first.eta());
-            trainingTauTuple().lepton_gen_vis_phi = static_cast<float>(gen_vis_sum.first.phi());
-            trainingTauTuple().lepton_gen_vis_mass = static_cast<float>(gen_vis_sum.first.mass());
+            out.lepton_gen_vis_pt = static_cast<float>(gen_vis_sum.first.pt());
+            out.lepton_gen_vis_eta = static_cast<float>(gen_vis_sum.first.eta());
+            out.lepton_gen_vis_phi = static_cast<float>(gen_vis_sum.first.phi());
+            out.lepton_gen_vis_mass = static_cast<float>(gen_vis_sum.first.mass());
         } else {
-            trainingTauTuple().lepton_gen_vis_pt = 0;
-            trainingTauTuple().lepton_gen_vis_eta = 0;
-            trainingTauTuple().lepton_gen_vis_phi = 0;
-            trainingTauTuple().lepton_gen_vis_mass = 0;
+            out.lepton_gen_vis_pt = 0;
+            out.lepton_gen_vis_eta = 0;
+            out.lepton_gen_vis_phi = 0;
+            out.lepton_gen_vis_mass = 0;
         }
     }
     #undef TAU_ID
     #undef CP_BR
 
-    void FillCellGrid(const Tau& tau, const CellGrid& cellGridRef, TrainingCellTuple& cellTuple, Long64_t& begin,
-                      Long64_t& end, bool inner)
-    {
-        begin = cellTuple.GetEntries();
-        auto cellGrid = CreateCellGrid(tau, cellGridRef, inner);
-        const int max_eta_index = cellGrid.MaxEtaIndex(), max_phi_index = cellGrid.MaxPhiIndex();
-        const int max_distance = max_eta_index + max_phi_index;
-        std::set<CellIndex> processed_cells;
-        for(int distance = 0; distance <= max_distance; ++distance) {
-            const int max_eta_d = std::min(max_eta_index, distance);
-            for(int eta_index = -max_eta_d; eta_index <= max_eta_d; ++eta_index) {
-                const int max_phi_d = distance - std::abs(eta_index);
-                if(max_phi_d > max_phi_index) continue;
-                const size_t n_max = max_phi_d ? 2 : 1;
-                for(size_t n = 0; n < n_max; ++n) {
-                    int phi_index = n ? max_phi_d : -max_phi_d;
-                    const CellIndex cellIndex{eta_index, phi_index};
-                    if(processed_cells.count(cellIndex))
-                        throw exception("Duplicated cell index in FillCellGrid.");
-                    processed_cells.insert(cellIndex);
-                    if(!cellGrid.IsEmpty(cellIndex))
-                        FillCellBranches(tau, cellIndex, cellGrid.at(cellIndex), cellTuple, inner);
-                }
+    // New occupancy entry for the tau, if the bitmap cell encoding is used.
+    TrainingCellOccupancy* AddOccupancy(std::vector<TrainingCellOccupancy>& occupancy) const
+    {
+        if(args.cell_encoding() != CellEncoding::Bitmap) return nullptr;
+        occupancy.emplace_back();
+        return &occupancy.back();
+    }
+
+    // Bit n of the occupancy bitmap is set if the n-th cell in the traversal order is stored.
+    template<typename Grid>
+    void FillCellGrid(const Tau& tau, const std::vector<CellCandidate>& candidates, Grid& cellGrid,
+                      std::vector<TrainingCell>& cells, Long64_t& begin, Long64_t& end, bool inner,
+                      std::vector<ULong64_t>* occupancy = nullptr) const
+    {
+        begin = static_cast<Long64_t>(cells.size());
+        FillCellObjects(tau, candidates, cellGrid, inner);
+        const auto& order = cellGrid.GetLayout().TraversalOrder();
+        const auto& flatIndices = cellGrid.GetLayout().TraversalFlatIndices();
+        if(occupancy)
+            occupancy->assign((order.size() + 63) / 64, 0);
+        for(size_t n = 0; n < order.size(); ++n) {
+            const Cell& cell = cellGrid.at(flatIndices[n]);
+            if(!cell.IsEmpty()) {
+                FillCellBranches(tau, order[n], cell, cells);
+                if(occupancy)
+                    (*occupancy)[n / 64] |= ULong64_t(1) << (n % 64);
             }
         }
-        if(processed_cells.size() != static_cast<size_t>( (2 * max_eta_index + 1) * (2 * max_phi_index + 1) ))
-            throw exception("Not all cell indices are processed in FillCellGrid.");
-        end = cellTuple.GetEntries();
+        end = static_cast<Long64_t>(cells.size());
     }
 
-    void FillCellBranches(const Tau& tau, const CellIndex& cellIndex, Cell& cell, TrainingCellTuple& cellTuple,
-                          bool inner)
+    void FillCellBranches(const Tau& tau, const CellIndex& cellIndex, const Cell& cell,
+                          std::vector<TrainingCell>& cells) const
     {
-        auto& out = cellTuple();
+        cells.emplace_back();
+        auto& out = cells.back();
         out.eta_index = cellIndex.eta;
         out.phi_index = cellIndex.phi;
-        out.tau_pt = GetValueLinear(tau.tau_pt, 20.f, 1000.f, true);
-        out.rho = GetValueNorm(tau.rho, 21.49f, 9.713f);
-
-        const auto getPt = [&](CellObjectType type, size_t index) {
-            if(type == CellObjectType::Electron)
-                return tau.ele_pt.at(index);
-            if(type == CellObjectType::Muon)
-                return tau.muon_pt.at(index);
-            return tau.pfCand_pt.at(index);
-        };
 
         const auto getBestObj = [&](CellObjectType type, size_t& n_total, size_t& best_idx) {
-            const auto& index_set = cell[type];
-            n_total = index_set.size();
-            double max_pt = std::numeric_limits<double>::lowest();
-            for(size_t index : index_set) {
-                const double pt = getPt(type, index);
-                if(pt > max_pt) {
-                    max_pt = pt;
-                    best_idx = index;
-                }
-            }
+            const CellObjectAccumulator& obj = cell.at(type);
+            n_total = obj.n_total;
+            best_idx = obj.best_index;
         };
 
         { // CellObjectType::PfCand_electron
@@ -389,48 +1294,39 @@ private:
             out.pfCand_ele_n_total = static_cast<int>(n_pfCand);
             out.pfCand_ele_valid = valid;
 
-            out.pfCand_ele_rel_pt = valid ? GetValueNorm(tau.pfCand_pt.at(pfCand_idx) / tau.tau_pt,
-                inner ? 0.9792f : 0.304f, inner ? 0.5383f : 1.845f) : 0;
-            out.pfCand_ele_deta = valid ? GetValueLinear(tau.pfCand_eta.at(pfCand_idx) - tau.tau_eta,
-                inner ? -0.1f : -0.5f, inner ? 0.1f : 0.5f, false) : 0;
-            out.pfCand_ele_dphi = valid ? GetValueLinear(DeltaPhi(tau.pfCand_phi.at(pfCand_idx), tau.tau_phi),
-                inner ? -0.1f : -0.5f, inner ? 0.1f : 0.5f, false) : 0;
-            out.pfCand_ele_tauSignal = valid ? GetValue(tau.pfCand_tauSignal.at(pfCand_idx)) : 0;
-            out.pfCand_ele_tauIso = valid ? GetValue(tau.pfCand_tauIso.at(pfCand_idx)) : 0;
-            out.pfCand_ele_pvAssociationQuality = valid ?
-                GetValueLinear(tau.pfCand_pvAssociationQuality.at(pfCand_idx), 0, 7, true) : 0;
-            out.pfCand_ele_puppiWeight = valid ? GetValue(tau.pfCand_puppiWeight.at(pfCand_idx)) : 0;
-            out.pfCand_ele_charge = valid ? GetValue(tau.pfCand_charge.at(pfCand_idx)) : 0;
-            out.pfCand_ele_lostInnerHits = valid ? GetValue(tau.pfCand_lostInnerHits.at(pfCand_idx)) : 0;
-            out.pfCand_ele_numberOfPixelHits = valid ?
-                GetValueLinear(tau.pfCand_numberOfPixelHits.at(pfCand_idx), 0, 10, true) : 0;
-
-            out.pfCand_ele_vertex_dx = valid ?
-                GetValueNorm(tau.pfCand_vertex_x.at(pfCand_idx) - tau.pv_x, 0.f, 0.1221f) : 0;
-            out.pfCand_ele_vertex_dy = valid ?
-                GetValueNorm(tau.pfCand_vertex_y.at(pfCand_idx) - tau.pv_y, 0.f, 0.1226f) : 0;
-            out.pfCand_ele_vertex_dz = valid ?
-                GetValueNorm(tau.pfCand_vertex_z.at(pfCand_idx) - tau.pv_z, 0.001f, 1.024f) : 0;
+            out.pfCand_ele_rel_pt = valid ? tau.pfCand_pt.at(pfCand_idx) / tau.tau_pt : 0;
+            out.pfCand_ele_deta = valid ? tau.pfCand_eta.at(pfCand_idx) - tau.tau_eta : 0;
+            out.pfCand_ele_dphi = valid ? kinematics::DeltaPhi(tau.pfCand_phi.at(pfCand_idx), tau.tau_phi) : 0;
+            out.pfCand_ele_tauSignal = valid ? tau.pfCand_tauSignal.at(pfCand_idx) : 0;
+            out.pfCand_ele_tauIso = valid ? tau.pfCand_tauIso.at(pfCand_idx) : 0;
+            out.pfCand_ele_pvAssociationQuality = valid ? tau.pfCand_pvAssociationQuality.at(pfCand_idx) : 0;
+            out.pfCand_ele_puppiWeight = valid ? tau.pfCand_puppiWeight.at(pfCand_idx) : 0;
+            out.pfCand_ele_charge = valid ? tau.pfCand_charge.at(pfCand_idx) : 0;
+            out.pfCand_ele_lostInnerHits = valid ? tau.pfCand_lostInnerHits.at(pfCand_idx) : 0;
+            out.pfCand_ele_numberOfPixelHits = valid ? tau.pfCand_numberOfPixelHits.at(pfCand_idx) : 0;
+
+            out.pfCand_ele_vertex_dx = valid ? tau.pfCand_vertex_x.at(pfCand_idx) - tau.pv_x : 0;
+            out.pfCand_ele_vertex_dy = valid ? tau.pfCand_vertex_y.at(pfCand_idx) - tau.pv_y : 0;
+            out.pfCand_ele_vertex_dz = valid ? tau.pfCand_vertex_z.at(pfCand_idx) - tau.pv_z : 0;
             out.pfCand_ele_vertex_dx_tauFL = valid ?
-                GetValueNorm(tau.pfCand_vertex_x.at(pfCand_idx) - tau.pv_x - tau.tau_flightLength_x, 0.f, 0.3411f) : 0;
-            out.pfCand_ele_vertex_dy_tauFL = valid ? GetValueNorm(tau.pfCand_vertex_y.at(pfCand_idx) - tau.pv_y -
-                tau.tau_flightLength_y, 0.0003f, 0.3385f) : 0;
-            out.pfCand_ele_vertex_dz_tauFL = valid ? GetValueNorm(tau.pfCand_vertex_z.at(pfCand_idx) - tau.pv_z -
-                tau.tau_flightLength_z, 0.f, 1.307f) : 0;
+                tau.pfCand_vertex_x.at(pfCand_idx) - tau.pv_x - tau.tau_flightLength_x : 0;
+            out.pfCand_ele_vertex_dy_tauFL = valid ?
+                tau.pfCand_vertex_y.at(pfCand_idx) - tau.pv_y - tau.tau_flightLength_y : 0;
+            out.pfCand_ele_vertex_dz_tauFL = valid ?
+                tau.pfCand_vertex_z.at(pfCand_idx) - tau.pv_z - tau.tau_flightLength_z : 0;
 
             const bool hasTrackDetails = valid && tau.pfCand_hasTrackDetails.at(pfCand_idx) == 1;
             out.pfCand_ele_hasTrackDetails = hasTrackDetails;
-            out.pfCand_ele_dxy = hasTrackDetails ? GetValueNorm(tau.pfCand_dxy.at(pfCand_idx), 0.f, 0.171f) : 0;
-            out.pfCand_ele_dxy_sig = hasTrackDetails ? GetValueNorm(std::abs(tau.pfCand_dxy.at(pfCand_idx)) /
-                tau.pfCand_dxy_error.at(pfCand_idx), 1.634f, 6.45f) : 0;
-            out.pfCand_ele_dz = hasTrackDetails ? GetValueNorm(tau.pfCand_dz.at(pfCand_idx), 0.001f, 1.02f) : 0;
-            out.pfCand_ele_dz_sig = hasTrackDetails ? GetValueNorm(std::abs(tau.pfCand_dz.at(pfCand_idx)) /
-                tau.pfCand_dz_error.at(pfCand_idx), 24.56f, 210.4f) : 0;
+            out.pfCand_ele_dxy = hasTrackDetails ? tau.pfCand_dxy.at(pfCand_idx) : 0;
+            out.pfCand_ele_dxy_sig = hasTrackDetails ?
+                std::abs(tau.pfCand_dxy.at(pfCand_idx)) / tau.pfCand_dxy_error.at(pfCand_idx) : 0;
+            out.pfCand_ele_dz = hasTrackDetails ? tau.pfCand_dz.at(pfCand_idx) : 0;
+            out.pfCand_ele_dz_sig = hasTrackDetails ?
+                std::abs(tau.pfCand_dz.at(pfCand_idx)) / tau.pfCand_dz_error.at(pfCand_idx) : 0;
             out.pfCand_ele_track_chi2_ndof = hasTrackDetails && tau.pfCand_track_ndof.at(pfCand_idx) > 0 ?
-                GetValueNorm(tau.pfCand_track_chi2.at(pfCand_idx) / tau.pfCand_track_ndof.at(pfCand_idx),
-                2.272f, 8.439f) : 0;
+                tau.pfCand_track_chi2.at(pfCand_idx) / tau.pfCand_track_ndof.at(pfCand_idx) : 0;
             out.pfCand_ele_track_ndof = hasTrackDetails && tau.pfCand_track_ndof.at(pfCand_idx) > 0 ?
-                GetValueNorm(tau.pfCand_track_ndof.at(pfCand_idx), 15.18f, 3.203f) : 0;
+                tau.pfCand_track_ndof.at(pfCand_idx) : 0;
         }
 
         { // CellObjectType::PfCand_muon
@@ -440,50 +1336,40 @@ private:
             out.pfCand_muon_n_total = static_cast<int>(n_pfCand);
             out.pfCand_muon_valid = valid;
 
-            out.pfCand_muon_rel_pt = valid ? GetValueNorm(tau.pfCand_pt.at(pfCand_idx) / tau.tau_pt,
-                inner ? 0.9509f : 0.0861f, inner ? 0.4294f : 0.4065f) : 0;
-            out.pfCand_muon_deta = valid ? GetValueLinear(tau.pfCand_eta.at(pfCand_idx) - tau.tau_eta,
-                inner ? -0.1f : -0.5f, inner ? 0.1f : 0.5f, false) : 0;
-            out.pfCand_muon_dphi = valid ? GetValueLinear(DeltaPhi(tau.pfCand_phi.at(pfCand_idx), tau.tau_phi),
-                inner ? -0.1f : -0.5f, inner ? 0.1f : 0.5f, false) : 0;
-            out.pfCand_muon_tauSignal = valid ? GetValue(tau.pfCand_tauSignal.at(pfCand_idx)) : 0;
-            out.pfCand_muon_tauIso = valid ? GetValue(tau.pfCand_tauIso.at(pfCand_idx)) : 0;
-            out.pfCand_muon_pvAssociationQuality = valid ?
-                GetValueLinear(tau.pfCand_pvAssociationQuality.at(pfCand_idx), 0, 7, true) : 0;
-            out.pfCand_muon_fromPV = valid ? GetValueLinear(tau.pfCand_fromPV.at(pfCand_idx), 0, 3, true) : 0;
-            out.pfCand_muon_puppiWeight = valid ? GetValue(tau.pfCand_puppiWeight.at(pfCand_idx)) : 0;
-            out.pfCand_muon_charge = valid ? GetValue(tau.pfCand_charge.at(pfCand_idx)) : 0;
-            out.pfCand_muon_lostInnerHits = valid ? GetValue(tau.pfCand_lostInnerHits.at(pfCand_idx)) : 0;
-            out.pfCand_muon_numberOfPixelHits = valid ?
-                GetValueLinear(tau.pfCand_numberOfPixelHits.at(pfCand_idx), 0, 11, true) : 0;
-
-            out.pfCand_muon_vertex_dx = valid ?
-                GetValueNorm(tau.pfCand_vertex_x.at(pfCand_idx) - tau.pv_x, -0.0007f, 0.6869f) : 0;
-            out.pfCand_muon_vertex_dy = valid ?
-                GetValueNorm(tau.pfCand_vertex_y.at(pfCand_idx) - tau.pv_y, 0.0001f, 0.6784f) : 0;
-            out.pfCand_muon_vertex_dz = valid ?
-                GetValueNorm(tau.pfCand_vertex_z.at(pfCand_idx) - tau.pv_z, -0.0117f, 4.097f) : 0;
-            out.pfCand_muon_vertex_dx_tauFL = valid ? GetValueNorm(tau.pfCand_vertex_x.at(pfCand_idx) - tau.pv_x -
-                tau.tau_flightLength_x, -0.0001f, 0.8642f) : 0;
-            out.pfCand_muon_vertex_dy_tauFL = valid ? GetValueNorm(tau.pfCand_vertex_y.at(pfCand_idx) - tau.pv_y -
-                tau.tau_flightLength_y, 0.0004f, 0.8561f) : 0;
-            out.pfCand_muon_vertex_dz_tauFL = valid ? GetValueNorm(tau.pfCand_vertex_z.at(pfCand_idx) - tau.pv_z -
-                tau.tau_flightLength_z, -0.0118f, 4.405f) : 0;
+            out.pfCand_muon_rel_pt = valid ? tau.pfCand_pt.at(pfCand_idx) / tau.tau_pt : 0;
+            out.pfCand_muon_deta = valid ? tau.pfCand_eta.at(pfCand_idx) - tau.tau_eta : 0;
+            out.pfCand_muon_dphi = valid ? kinematics::DeltaPhi(tau.pfCand_phi.at(pfCand_idx), tau.tau_phi) : 0;
+            out.pfCand_muon_tauSignal = valid ? tau.pfCand_tauSignal.at(pfCand_idx) : 0;
+            out.pfCand_muon_tauIso = valid ? tau.pfCand_tauIso.at(pfCand_idx) : 0;
+            out.pfCand_muon_pvAssociationQuality = valid ? tau.pfCand_pvAssociationQuality.at(pfCand_idx) : 0;
+            out.pfCand_muon_fromPV = valid ? tau.pfCand_fromPV.at(pfCand_idx) : 0;
+            out.pfCand_muon_puppiWeight = valid ? tau.pfCand_puppiWeight.at(pfCand_idx) : 0;
+            out.pfCand_muon_charge = valid ? tau.pfCand_charge.at(pfCand_idx) : 0;
+            out.pfCand_muon_lostInnerHits = valid ? tau.pfCand_lostInnerHits.at(pfCand_idx) : 0;
+            out.pfCand_muon_numberOfPixelHits = valid ? tau.pfCand_numberOfPixelHits.at(pfCand_idx) : 0;
+
+            out.pfCand_muon_vertex_dx = valid ? tau.pfCand_vertex_x.at(pfCand_idx) - tau.pv_x : 0;
+            out.pfCand_muon_vertex_dy = valid ? tau.pfCand_vertex_y.at(pfCand_idx) - tau.pv_y : 0;
+            out.pfCand_muon_vertex_dz = valid ? tau.pfCand_vertex_z.at(pfCand_idx) - tau.pv_z : 0;
+            out.pfCand_muon_vertex_dx_tauFL = valid ?
+                tau.pfCand_vertex_x.at(pfCand_idx) - tau.pv_x - tau.tau_flightLength_x : 0;
+            out.pfCand_muon_vertex_dy_tauFL = valid ?
+                tau.pfCand_vertex_y.at(pfCand_idx) - tau.pv_y - tau.tau_flightLength_y : 0;
+            out.pfCand_muon_vertex_dz_tauFL = valid ?
+                tau.pfCand_vertex_z.at(pfCand_idx) - tau.pv_z - tau.tau_flightLength_z : 0;
 
             const bool hasTrackDetails = valid && tau.pfCand_hasTrackDetails.at(pfCand_idx) == 1;
             out.pfCand_muon_hasTrackDetails = hasTrackDetails;
-            out.pfCand_muon_dxy = hasTrackDetails ?
-                GetValueNorm(tau.pfCand_dxy.at(pfCand_idx), -0.0045f, 0.9655f) : 0;
-            out.pfCand_muon_dxy_sig = hasTrackDetails ? GetValueNorm(std::abs(tau.pfCand_dxy.at(pfCand_idx)) /
-                tau.pfCand_dxy_error.at(pfCand_idx), 4.575f, 42.36f) : 0;
-            out.pfCand_muon_dz = hasTrackDetails ? GetValueNorm(tau.pfCand_dz.at(pfCand_idx), -0.0117f, 4.097f) : 0;
-            out.pfCand_muon_dz_sig = hasTrackDetails ? GetValueNorm(std::abs(tau.pfCand_dz.at(pfCand_idx)) /
-                tau.pfCand_dz_error.at(pfCand_idx), 80.37f, 343.3f) : 0;
+            out.pfCand_muon_dxy = hasTrackDetails ? tau.pfCand_dxy.at(pfCand_idx) : 0;
+            out.pfCand_muon_dxy_sig = hasTrackDetails ?
+                std::abs(tau.pfCand_dxy.at(pfCand_idx)) / tau.pfCand_dxy_error.at(pfCand_idx) : 0;
+            out.pfCand_muon_dz = hasTrackDetails ? tau.pfCand_dz.at(pfCand_idx) : 0;
+            out.pfCand_muon_dz_sig = hasTrackDetails ?
+                std::abs(tau.pfCand_dz.at(pfCand_idx)) / tau.pfCand_dz_error.at(pfCand_idx) : 0;
             out.pfCand_muon_track_chi2_ndof = hasTrackDetails && tau.pfCand_track_ndof.at(pfCand_idx) > 0 ?
-                GetValueNorm(tau.pfCand_track_chi2.at(pfCand_idx) / tau.pfCand_track_ndof.at(pfCand_idx),
-                0.69f, 1.711f) : 0;
+                tau.pfCand_track_chi2.at(pfCand_idx) / tau.pfCand_track_ndof.at(pfCand_idx) : 0;
             out.pfCand_muon_track_ndof = hasTrackDetails && tau.pfCand_track_ndof.at(pfCand_idx) > 0 ?
-                GetValueNorm(tau.pfCand_track_ndof.at(pfCand_idx), 17.5f, 5.11f) : 0;
+                tau.pfCand_track_ndof.at(pfCand_idx) : 0;
         }
 
         { // CellObjectType::PfCand_chargedHadron
@@ -493,56 +1379,45 @@ private:
             out.pfCand_chHad_n_total = static_cast<int>(n_pfCand);
             out.pfCand_chHad_valid = valid;
 
-            out.pfCand_chHad_rel_pt = valid ? GetValueNorm(tau.pfCand_pt.at(pfCand_idx) / tau.tau_pt,
-                inner ? 0.2564f : 0.0194f, inner ? 0.8607f : 0.1865f) : 0;
-            out.pfCand_chHad_deta = valid ? GetValueLinear(tau.pfCand_eta.at(pfCand_idx) - tau.tau_eta,
-                inner ? -0.1f : -0.5f, inner ? 0.1f : 0.5f, false) : 0;
-            out.pfCand_chHad_dphi = valid ? GetValueLinear(DeltaPhi(tau.pfCand_phi.at(pfCand_idx), tau.tau_phi),
-                inner ? -0.1f : -0.5f, inner ? 0.1f : 0.5f, false) : 0;
-            out.pfCand_chHad_tauSignal = valid ? GetValue(tau.pfCand_tauSignal.at(pfCand_idx)) : 0;
-            out.pfCand_chHad_leadChargedHadrCand = valid ? GetValue(tau.pfCand_leadChargedHadrCand.at(pfCand_idx)) : 0;
-            out.pfCand_chHad_tauIso = valid ? GetValue(tau.pfCand_tauIso.at(pfCand_idx)) : 0;
-            out.pfCand_chHad_pvAssociationQuality = valid ?
-                GetValueLinear(tau.pfCand_pvAssociationQuality.at(pfCand_idx), 0, 7, true) : 0;
-            out.pfCand_chHad_fromPV = valid ? GetValueLinear(tau.pfCand_fromPV.at(pfCand_idx), 0, 3, true) : 0;
-            out.pfCand_chHad_puppiWeight = valid ? GetValue(tau.pfCand_puppiWeight.at(pfCand_idx)) : 0;
-            out.pfCand_chHad_puppiWeightNoLep = valid ? GetValue(tau.pfCand_puppiWeightNoLep.at(pfCand_idx)) : 0;
-            out.pfCand_chHad_charge = valid ? GetValue(tau.pfCand_charge.at(pfCand_idx)) : 0;
-            out.pfCand_chHad_lostInnerHits = valid ? GetValue(tau.pfCand_lostInnerHits.at(pfCand_idx)) : 0;
-            out.pfCand_chHad_numberOfPixelHits = valid ?
-                GetValueLinear(tau.pfCand_numberOfPixelHits.at(pfCand_idx), 0, 12, true) : 0;
-
-            out.pfCand_chHad_vertex_dx = valid ?
-                GetValueNorm(tau.pfCand_vertex_x.at(pfCand_idx) - tau.pv_x, 0.0005f, 1.735f) : 0;
-            out.pfCand_chHad_vertex_dy = valid ?
-                GetValueNorm(tau.pfCand_vertex_y.at(pfCand_idx) - tau.pv_y, -0.0008f, 1.752f) : 0;
-            out.pfCand_chHad_vertex_dz = valid ?
-                GetValueNorm(tau.pfCand_vertex_z.at(pfCand_idx) - tau.pv_z, -0.0201f, 8.333f) : 0;
-            out.pfCand_chHad_vertex_dx_tauFL = valid ? GetValueNorm(tau.pfCand_vertex_x.at(pfCand_idx) - tau.pv_x -
-                tau.tau_flightLength_x, -0.0014f, 1.93f) : 0;
-            out.pfCand_chHad_vertex_dy_tauFL = valid ? GetValueNorm(tau.pfCand_vertex_y.at(pfCand_idx) - tau.pv_y -
-                tau.tau_flightLength_y, 0.0022f, 1.948f) : 0;
-            out.pfCand_chHad_vertex_dz_tauFL = valid ? GetValueNorm(tau.pfCand_vertex_z.at(pfCand_idx) - tau.pv_z -
-                tau.tau_flightLength_z, -0.0138f, 8.622f) : 0;
+            out.pfCand_chHad_rel_pt = valid ? tau.pfCand_pt.at(pfCand_idx) / tau.tau_pt : 0;
+            out.pfCand_chHad_deta = valid ? tau.pfCand_eta.at(pfCand_idx) - tau.tau_eta : 0;
+            out.pfCand_chHad_dphi = valid ? kinematics::DeltaPhi(tau.pfCand_phi.at(pfCand_idx), tau.tau_phi) : 0;
+            out.pfCand_chHad_tauSignal = valid ? tau.pfCand_tauSignal.at(pfCand_idx) : 0;
+            out.pfCand_chHad_leadChargedHadrCand = valid ? tau.pfCand_leadChargedHadrCand.at(pfCand_idx) : 0;
+            out.pfCand_chHad_tauIso = valid ? tau.pfCand_tauIso.at(pfCand_idx) : 0;
+            out.pfCand_chHad_pvAssociationQuality = valid ? tau.pfCand_pvAssociationQuality.at(pfCand_idx) : 0;
+            out.pfCand_chHad_fromPV = valid ? tau.pfCand_fromPV.at(pfCand_idx) : 0;
+            out.pfCand_chHad_puppiWeight = valid ? tau.pfCand_puppiWeight.at(pfCand_idx) : 0;
+            out.pfCand_chHad_puppiWeightNoLep = valid ? tau.pfCand_puppiWeightNoLep.at(pfCand_idx) : 0;
+            out.pfCand_chHad_charge = valid ? tau.pfCand_charge.at(pfCand_idx) : 0;
+            out.pfCand_chHad_lostInnerHits = valid ? tau.pfCand_lostInnerHits.at(pfCand_idx) : 0;
+            out.pfCand_chHad_numberOfPixelHits = valid ? tau.pfCand_numberOfPixelHits.at(pfCand_idx) : 0;
+
+            out.pfCand_chHad_vertex_dx = valid ? tau.pfCand_vertex_x.at(pfCand_idx) - tau.pv_x : 0;
+            out.pfCand_chHad_vertex_dy = valid ? tau.pfCand_vertex_y.at(pfCand_idx) - tau.pv_y : 0;
+            out.pfCand_chHad_vertex_dz = valid ? tau.pfCand_vertex_z.at(pfCand_idx) - tau.pv_z : 0;
+            out.pfCand_chHad_vertex_dx_tauFL = valid ?
+                tau.pfCand_vertex_x.at(pfCand_idx) - tau.pv_x - tau.tau_flightLength_x : 0;
+            out.pfCand_chHad_vertex_dy_tauFL = valid ?
+                tau.pfCand_vertex_y.at(pfCand_idx) - tau.pv_y - tau.tau_flightLength_y : 0;
+            out.pfCand_chHad_vertex_dz_tauFL = valid ?
+                tau.pfCand_vertex_z.at(pfCand_idx) - tau.pv_z - tau.tau_flightLength_z : 0;
 
             const bool hasTrackDetails = valid && tau.pfCand_hasTrackDetails.at(pfCand_idx) == 1;
             out.pfCand_chHad_hasTrackDetails = hasTrackDetails;
-            out.pfCand_chHad_dxy = hasTrackDetails ?
-                GetValueNorm(tau.pfCand_dxy.at(pfCand_idx), -0.012f, 2.386f) : 0;
-            out.pfCand_chHad_dxy_sig = hasTrackDetails ? GetValueNorm(std::abs(tau.pfCand_dxy.at(pfCand_idx)) /
-                tau.pfCand_dxy_error.at(pfCand_idx), 6.417f, 36.28f) : 0;
-            out.pfCand_chHad_dz = hasTrackDetails ? GetValueNorm(tau.pfCand_dz.at(pfCand_idx), -0.0246f, 7.618f) : 0;
-            out.pfCand_chHad_dz_sig = hasTrackDetails ? GetValueNorm(std::abs(tau.pfCand_dz.at(pfCand_idx)) /
-                tau.pfCand_dz_error.at(pfCand_idx), 301.3f, 491.1f) : 0;
+            out.pfCand_chHad_dxy = hasTrackDetails ? tau.pfCand_dxy.at(pfCand_idx) : 0;
+            out.pfCand_chHad_dxy_sig = hasTrackDetails ?
+                std::abs(tau.pfCand_dxy.at(pfCand_idx)) / tau.pfCand_dxy_error.at(pfCand_idx) : 0;
+            out.pfCand_chHad_dz = hasTrackDetails ? tau.pfCand_dz.at(pfCand_idx) : 0;
+            out.pfCand_chHad_dz_sig = hasTrackDetails ?
+                std::abs(tau.pfCand_dz.at(pfCand_idx)) / tau.pfCand_dz_error.at(pfCand_idx) : 0;
             out.pfCand_chHad_track_chi2_ndof = hasTrackDetails && tau.pfCand_track_ndof.at(pfCand_idx) > 0 ?
-                GetValueNorm(tau.pfCand_track_chi2.at(pfCand_idx) / tau.pfCand_track_ndof.at(pfCand_idx),
-                0.7876f, 3.694f) : 0;
+                tau.pfCand_track_chi2.at(pfCand_idx) / tau.pfCand_track_ndof.at(pfCand_idx) : 0;
             out.pfCand_chHad_track_ndof = hasTrackDetails && tau.pfCand_track_ndof.at(pfCand_idx) > 0 ?
-                GetValueNorm(tau.pfCand_track_ndof.at(pfCand_idx), 13.92f, 6.581f) : 0;
+                tau.pfCand_track_ndof.at(pfCand_idx) : 0;
 
-            out.pfCand_chHad_hcalFraction = valid ? GetValue(tau.pfCand_hcalFraction.at(pfCand_idx)) : 0;
-            out.pfCand_chHad_rawCaloFraction = valid ?
-                GetValueLinear(tau.pfCand_rawCaloFraction.at(pfCand_idx), 0.f, 2.6f, true) : 0;
+            out.pfCand_chHad_hcalFraction = valid ? tau.pfCand_hcalFraction.at(pfCand_idx) : 0;
+            out.pfCand_chHad_rawCaloFraction = valid ? tau.pfCand_rawCaloFraction.at(pfCand_idx) : 0;
         }
 
         { // CellObjectType::PfCand_neutralHadron
@@ -552,17 +1427,14 @@ private:
             out.pfCand_nHad_n_total = static_cast<int>(n_pfCand);
             out.pfCand_nHad_valid = valid;
 
-            out.pfCand_nHad_rel_pt = valid ? GetValueNorm(tau.pfCand_pt.at(pfCand_idx) / tau.tau_pt,
-                inner ? 0.3163f : 0.0502f, inner ? 0.2769f : 0.4266f) : 0;
-            out.pfCand_nHad_deta = valid ? GetValueLinear(tau.pfCand_eta.at(pfCand_idx) - tau.tau_eta,
-                inner ? -0.1f : -0.5f, inner ? 0.1f : 0.5f, false) : 0;
-            out.pfCand_nHad_dphi = valid ? GetValueLinear(DeltaPhi(tau.pfCand_phi.at(pfCand_idx), tau.tau_phi),
-                inner ? -0.1f : -0.5f, inner ? 0.1f : 0.5f, false) : 0;
-            out.pfCand_nHad_tauSignal = valid ? GetValue(tau.pfCand_tauSignal.at(pfCand_idx)) : 0;
-            out.pfCand_nHad_tauIso = valid ? GetValue(tau.pfCand_tauIso.at(pfCand_idx)) : 0;
-            out.pfCand_nHad_puppiWeight = valid ? GetValue(tau.pfCand_puppiWeight.at(pfCand_idx)) : 0;
-            out.pfCand_nHad_puppiWeightNoLep = valid ? GetValue(tau.pfCand_puppiWeightNoLep.at(pfCand_idx)) : 0;
-            out.pfCand_nHad_hcalFraction = valid ? GetValue(tau.pfCand_hcalFraction.at(pfCand_idx)) : 0;
+            out.pfCand_nHad_rel_pt = valid ? tau.pfCand_pt.at(pfCand_idx) / tau.tau_pt : 0;
+            out.pfCand_nHad_deta = valid ? tau.pfCand_eta.at(pfCand_idx) - tau.tau_eta : 0;
+            out.pfCand_nHad_dphi = valid ? kinematics::DeltaPhi(tau.pfCand_phi.at(pfCand_idx), tau.tau_phi) : 0;
+            out.pfCand_nHad_tauSignal = valid ? tau.pfCand_tauSignal.at(pfCand_idx) : 0;
+            out.pfCand_nHad_tauIso = valid ? tau.pfCand_tauIso.at(pfCand_idx) : 0;
+            out.pfCand_nHad_puppiWeight = valid ? tau.pfCand_puppiWeight.at(pfCand_idx) : 0;
+            out.pfCand_nHad_puppiWeightNoLep = valid ? tau.pfCand_puppiWeightNoLep.at(pfCand_idx) : 0;
+            out.pfCand_nHad_hcalFraction = valid ? tau.pfCand_hcalFraction.at(pfCand_idx) : 0;
         }
 
         { // CellObjectType::PfCand_gamma
@@ -572,50 +1444,40 @@ private:
             out.pfCand_gamma_n_total = static_cast<int>(n_pfCand);
             out.pfCand_gamma_valid = valid;
 
-            out.pfCand_gamma_rel_pt = valid ? GetValueNorm(tau.pfCand_pt.at(pfCand_idx) / tau.tau_pt,
-                inner ? 0.6048f : 0.02576f, inner ? 1.669f : 0.3833f) : 0;
-            out.pfCand_gamma_deta = valid ? GetValueLinear(tau.pfCand_eta.at(pfCand_idx) - tau.tau_eta,
-                inner ? -0.1f : -0.5f, inner ? 0.1f : 0.5f, false) : 0;
-            out.pfCand_gamma_dphi = valid ? GetValueLinear(DeltaPhi(tau.pfCand_phi.at(pfCand_idx), tau.tau_phi),
-                inner ? -0.1f : -0.5f, inner ? 0.1f : 0.5f, false) : 0;
-            out.pfCand_gamma_tauSignal = valid ? GetValue(tau.pfCand_tauSignal.at(pfCand_idx)) : 0;
-            out.pfCand_gamma_tauIso = valid ? GetValue(tau.pfCand_tauIso.at(pfCand_idx)) : 0;
-            out.pfCand_gamma_pvAssociationQuality = valid ?
-                GetValueLinear(tau.pfCand_pvAssociationQuality.at(pfCand_idx), 0, 7, true) : 0;
-            out.pfCand_gamma_fromPV = valid ? GetValueLinear(tau.pfCand_fromPV.at(pfCand_idx), 0, 3, true) : 0;
-            out.pfCand_gamma_puppiWeight = valid ? GetValue(tau.pfCand_puppiWeight.at(pfCand_idx)) : 0;
-            out.pfCand_gamma_puppiWeightNoLep = valid ? GetValue(tau.pfCand_puppiWeightNoLep.at(pfCand_idx)) : 0;
-            out.pfCand_gamma_lostInnerHits = valid ? GetValue(tau.pfCand_lostInnerHits.at(pfCand_idx)) : 0;
-            out.pfCand_gamma_numberOfPixelHits = valid ?
-                GetValueLinear(tau.pfCand_numberOfPixelHits.at(pfCand_idx), 0, 7, true) : 0;
-
-            out.pfCand_gamma_vertex_dx = valid ?
-                GetValueNorm(tau.pfCand_vertex_x.at(pfCand_idx) - tau.pv_x, 0.f, 0.0067f) : 0;
-            out.pfCand_gamma_vertex_dy = valid ?
-                GetValueNorm(tau.pfCand_vertex_y.at(pfCand_idx) - tau.pv_y, 0.f, 0.0069f) : 0;
-            out.pfCand_gamma_vertex_dz = valid ?
-                GetValueNorm(tau.pfCand_vertex_z.at(pfCand_idx) - tau.pv_z, 0.f, 0.0578f) : 0;
-            out.pfCand_gamma_vertex_dx_tauFL = valid ? GetValueNorm(tau.pfCand_vertex_x.at(pfCand_idx) - tau.pv_x -
-                tau.tau_flightLength_x, 0.001f, 0.9565f) : 0;
-            out.pfCand_gamma_vertex_dy_tauFL = valid ? GetValueNorm(tau.pfCand_vertex_y.at(pfCand_idx) - tau.pv_y -
-                tau.tau_flightLength_y, 0.0008f, 0.9592f) : 0;
-            out.pfCand_gamma_vertex_dz_tauFL = valid ? GetValueNorm(tau.pfCand_vertex_z.at(pfCand_idx) - tau.pv_z -
-                tau.tau_flightLength_z, 0.0038f, 2.154f) : 0;
+            out.pfCand_gamma_rel_pt = valid ? tau.pfCand_pt.at(pfCand_idx) / tau.tau_pt : 0;
+            out.pfCand_gamma_deta = valid ? tau.pfCand_eta.at(pfCand_idx) - tau.tau_eta : 0;
+            out.pfCand_gamma_dphi = valid ? kinematics::DeltaPhi(tau.pfCand_phi.at(pfCand_idx), tau.tau_phi) : 0;
+            out.pfCand_gamma_tauSignal = valid ? tau.pfCand_tauSignal.at(pfCand_idx) : 0;
+            out.pfCand_gamma_tauIso = valid ? tau.pfCand_tauIso.at(pfCand_idx) : 0;
+            out.pfCand_gamma_pvAssociationQuality = valid ? tau.pfCand_pvAssociationQuality.at(pfCand_idx) : 0;
+            out.pfCand_gamma_fromPV = valid ? tau.pfCand_fromPV.at(pfCand_idx) : 0;
+            out.pfCand_gamma_puppiWeight = valid ? tau.pfCand_puppiWeight.at(pfCand_idx) : 0;
+            out.pfCand_gamma_puppiWeightNoLep = valid ? tau.pfCand_puppiWeightNoLep.at(pfCand_idx) : 0;
+            out.pfCand_gamma_lostInnerHits = valid ? tau.pfCand_lostInnerHits.at(pfCand_idx) : 0;
+            out.pfCand_gamma_numberOfPixelHits = valid ? tau.pfCand_numberOfPixelHits.at(pfCand_idx) : 0;
+
+            out.pfCand_gamma_vertex_dx = valid ? tau.pfCand_vertex_x.at(pfCand_idx) - tau.pv_x : 0;
+            out.pfCand_gamma_vertex_dy = valid ? tau.pfCand_vertex_y.at(pfCand_idx) - tau.pv_y : 0;
+            out.pfCand_gamma_vertex_dz = valid ? tau.pfCand_vertex_z.at(pfCand_idx) - tau.pv_z : 0;
+            out.pfCand_gamma_vertex_dx_tauFL = valid ?
+                tau.pfCand_vertex_x.at(pfCand_idx) - tau.pv_x - tau.tau_flightLength_x : 0;
+            out.pfCand_gamma_vertex_dy_tauFL = valid ?
+                tau.pfCand_vertex_y.at(pfCand_idx) - tau.pv_y - tau.tau_flightLength_y : 0;
+            out.pfCand_gamma_vertex_dz_tauFL = valid ?
+                tau.pfCand_vertex_z.at(pfCand_idx) - tau.pv_z - tau.tau_flightLength_z : 0;
 
             const bool hasTrackDetails = valid && tau.pfCand_hasTrackDetails.at(pfCand_idx) == 1;
             out.pfCand_gamma_hasTrackDetails = hasTrackDetails;
-            out.pfCand_gamma_dxy = hasTrackDetails ?
-                GetValueNorm(tau.pfCand_dxy.at(pfCand_idx), 0.0004f, 0.882f) : 0;
-            out.pfCand_gamma_dxy_sig = hasTrackDetails ? GetValueNorm(std::abs(tau.pfCand_dxy.at(pfCand_idx)) /
-                tau.pfCand_dxy_error.at(pfCand_idx), 4.271f, 63.78f) : 0;
-            out.pfCand_gamma_dz = hasTrackDetails ? GetValueNorm(tau.pfCand_dz.at(pfCand_idx), 0.0071f, 5.285f) : 0;
-            out.pfCand_gamma_dz_sig = hasTrackDetails ? GetValueNorm(std::abs(tau.pfCand_dz.at(pfCand_idx)) /
-                tau.pfCand_dz_error.at(pfCand_idx), 162.1f, 622.4f) : 0;
+            out.pfCand_gamma_dxy = hasTrackDetails ? tau.pfCand_dxy.at(pfCand_idx) : 0;
+            out.pfCand_gamma_dxy_sig = hasTrackDetails ?
+                std::abs(tau.pfCand_dxy.at(pfCand_idx)) / tau.pfCand_dxy_error.at(pfCand_idx) : 0;
+            out.pfCand_gamma_dz = hasTrackDetails ? tau.pfCand_dz.at(pfCand_idx) : 0;
+            out.pfCand_gamma_dz_sig = hasTrackDetails ?
+                std::abs(tau.pfCand_dz.at(pfCand_idx)) / tau.pfCand_dz_error.at(pfCand_idx) : 0;
             out.pfCand_gamma_track_chi2_ndof = hasTrackDetails && tau.pfCand_track_ndof.at(pfCand_idx) > 0 ?
-                GetValueNorm(tau.pfCand_track_chi2.at(pfCand_idx) / tau.pfCand_track_ndof.at(pfCand_idx),
-                4.268f, 15.47f) : 0;
+                tau.pfCand_track_chi2.at(pfCand_idx) / tau.pfCand_track_ndof.at(pfCand_idx) : 0;
             out.pfCand_gamma_track_ndof = hasTrackDetails && tau.pfCand_track_ndof.at(pfCand_idx) > 0 ?
-                GetValueNorm(tau.pfCand_track_ndof.at(pfCand_idx), 12.25f, 4.774f) : 0;
+                tau.pfCand_track_ndof.at(pfCand_idx) : 0;
         }
 
         { // PAT electron
@@ -625,70 +1487,50 @@ private:
             out.ele_n_total = static_cast<int>(n_ele);
             out.ele_valid = valid;
 
-            out.ele_rel_pt = valid ? GetValueNorm(tau.ele_pt.at(idx) / tau.tau_pt,
-                inner ? 1.067f : 0.5111f, inner ? 1.521f : 2.765f) : 0;
-            out.ele_deta = valid ? GetValueLinear(tau.ele_eta.at(idx) - tau.tau_eta,
-                inner ? -0.1f : -0.5f, inner ? 0.1f : 0.5f, false) : 0;
-            out.ele_dphi = valid ? GetValueLinear(DeltaPhi(tau.ele_phi.at(idx), tau.tau_phi),
-                inner ? -0.1f : -0.5f, inner ? 0.1f : 0.5f, false) : 0;
+            out.ele_rel_pt = valid ? tau.ele_pt.at(idx) / tau.tau_pt : 0;
+            out.ele_deta = valid ? tau.ele_eta.at(idx) - tau.tau_eta : 0;
+            out.ele_dphi = valid ? kinematics::DeltaPhi(tau.ele_phi.at(idx), tau.tau_phi) : 0;
 
             const bool cc_valid = valid && tau.ele_cc_ele_energy.at(idx) >= 0;
             out.ele_cc_valid = cc_valid;
-            out.ele_cc_ele_rel_energy = cc_valid ? GetValueNorm(tau.ele_cc_ele_energy.at(idx) / tau.ele_pt.at(idx),
-                1.729f, 1.644f) : 0;
-            out.ele_cc_gamma_rel_energy = cc_valid ? GetValueNorm(tau.ele_cc_gamma_energy.at(idx) /
-                tau.ele_cc_ele_energy.at(idx), 0.1439f, 0.3284f) : 0;
-            out.ele_cc_n_gamma = cc_valid ? GetValueNorm(tau.ele_cc_n_gamma.at(idx), 1.794f, 2.079f) : 0;
-            out.ele_rel_trackMomentumAtVtx = valid ? GetValueNorm(tau.ele_trackMomentumAtVtx.at(idx) /
-                tau.ele_pt.at(idx), 1.531f, 1.424f) : 0;
-            out.ele_rel_trackMomentumAtCalo = valid ? GetValueNorm(tau.ele_trackMomentumAtCalo.at(idx) /
-                tau.ele_pt.at(idx), 1.531f, 1.424f) : 0;
-            out.ele_rel_trackMomentumOut = valid ? GetValueNorm(tau.ele_trackMomentumOut.at(idx) /
-                tau.ele_pt.at(idx), 0.7735f, 0.935f) : 0;
-            out.ele_rel_trackMomentumAtEleClus = valid ? GetValueNorm(tau.ele_trackMomentumAtEleClus.at(idx) /
-                tau.ele_pt.at(idx), 0.7735f, 0.935f) : 0;
+            out.ele_cc_ele_rel_energy = cc_valid ? tau.ele_cc_ele_energy.at(idx) / tau.ele_pt.at(idx) : 0;
+            out.ele_cc_gamma_rel_energy = cc_valid ?
+                tau.ele_cc_gamma_energy.at(idx) / tau.ele_cc_ele_energy.at(idx) : 0;
+            out.ele_cc_n_gamma = cc_valid ? tau.ele_cc_n_gamma.at(idx) : 0;
+            out.ele_rel_trackMomentumAtVtx = valid ? tau.ele_trackMomentumAtVtx.at(idx) / tau.ele_pt.at(idx) : 0;
+            out.ele_rel_trackMomentumAtCalo = valid ? tau.ele_trackMomentumAtCalo.at(idx) / tau.ele_pt.at(idx) : 0;
+            out.ele_rel_trackMomentumOut = valid ? tau.ele_trackMomentumOut.at(idx) / tau.ele_pt.at(idx) : 0;
+            out.ele_rel_trackMomentumAtEleClus = valid ?
+                tau.ele_trackMomentumAtEleClus.at(idx) / tau.ele_pt.at(idx) : 0;
             out.ele_rel_trackMomentumAtVtxWithConstraint = valid ?
-                GetValueNorm(tau.ele_trackMomentumAtVtxWithConstraint.at(idx) / tau.ele_pt.at(idx), 1.625f, 1.581f) : 0;
-            out.ele_rel_ecalEnergy = valid ? GetValueNorm(tau.ele_ecalEnergy.at(idx) /
-                tau.ele_pt.at(idx), 1.993f, 1.308f) : 0;
-            out.ele_ecalEnergy_sig = valid ? GetValueNorm(tau.ele_ecalEnergy.at(idx) /
-                tau.ele_ecalEnergy_error.at(idx), 70.25f, 58.16f) : 0;
-            out.ele_eSuperClusterOverP = valid ? GetValueNorm(tau.ele_eSuperClusterOverP.at(idx), 2.432f, 15.13f) : 0;
-            out.ele_eSeedClusterOverP = valid ? GetValueNorm(tau.ele_eSeedClusterOverP.at(idx), 2.034f, 13.96f) : 0;
-            out.ele_eSeedClusterOverPout = valid ? GetValueNorm(tau.ele_eSeedClusterOverPout.at(idx), 6.64f, 36.8f) : 0;
-            out.ele_eEleClusterOverPout = valid ? GetValueNorm(tau.ele_eEleClusterOverPout.at(idx), 4.183f, 20.63f) : 0;
-            out.ele_deltaEtaSuperClusterTrackAtVtx = valid ?
-                GetValueNorm(tau.ele_deltaEtaSuperClusterTrackAtVtx.at(idx), 0.f, 0.0363f) : 0;
-            out.ele_deltaEtaSeedClusterTrackAtCalo = valid ?
-                GetValueNorm(tau.ele_deltaEtaSeedClusterTrackAtCalo.at(idx), -0.0001f, 0.0512f) : 0;
-            out.ele_deltaEtaEleClusterTrackAtCalo = valid ? GetValueNorm(tau.ele_deltaEtaEleClusterTrackAtCalo.at(idx),
-                -0.0001f, 0.0541f) : 0;
-            out.ele_deltaPhiEleClusterTrackAtCalo = valid ? GetValueNorm(tau.ele_deltaPhiEleClusterTrackAtCalo.at(idx),
-                0.0002f, 0.0553f) : 0;
-            out.ele_deltaPhiSuperClusterTrackAtVtx = valid ?
-                GetValueNorm(tau.ele_deltaPhiSuperClusterTrackAtVtx.at(idx), 0.0001f, 0.0523f) : 0;
-            out.ele_deltaPhiSeedClusterTrackAtCalo = valid ?
-                GetValueNorm(tau.ele_deltaPhiSeedClusterTrackAtCalo.at(idx), 0.0004f, 0.0777f) : 0;
-            out.ele_mvaInput_earlyBrem = valid ? GetValue(tau.ele_mvaInput_earlyBrem.at(idx)) : 0;
-            out.ele_mvaInput_lateBrem = valid ? GetValue(tau.ele_mvaInput_lateBrem.at(idx)) : 0;
-            out.ele_mvaInput_sigmaEtaEta = valid ? GetValueNorm(tau.ele_mvaInput_sigmaEtaEta.at(idx),
-                0.0008f, 0.0052f) : 0;
-            out.ele_mvaInput_hadEnergy = valid ? GetValueNorm(tau.ele_mvaInput_hadEnergy.at(idx), 14.04f, 69.48f) : 0;
-            out.ele_mvaInput_deltaEta = valid ? GetValueNorm(tau.ele_mvaInput_deltaEta.at(idx), 0.0099f, 0.0851f) : 0;
-            out.ele_gsfTrack_normalizedChi2 = valid ? GetValueNorm(tau.ele_gsfTrack_normalizedChi2.at(idx),
-                3.049f, 10.39f) : 0;
-            out.ele_gsfTrack_numberOfValidHits = valid ? GetValueNorm(tau.ele_gsfTrack_numberOfValidHits.at(idx),
-                16.52f, 2.806f) : 0;
-            out.ele_rel_gsfTrack_pt = valid ? GetValueNorm(tau.ele_gsfTrack_pt.at(idx) / tau.ele_pt.at(idx),
-                1.355f, 16.81f) : 0;
-            out.ele_gsfTrack_pt_sig = valid ? GetValueNorm(tau.ele_gsfTrack_pt.at(idx) /
-                tau.ele_gsfTrack_pt_error.at(idx), 5.046f, 3.119f) : 0;
+                tau.ele_trackMomentumAtVtxWithConstraint.at(idx) / tau.ele_pt.at(idx) : 0;
+            out.ele_rel_ecalEnergy = valid ? tau.ele_ecalEnergy.at(idx) / tau.ele_pt.at(idx) : 0;
+            out.ele_ecalEnergy_sig = valid ? tau.ele_ecalEnergy.at(idx) / tau.ele_ecalEnergy_error.at(idx) : 0;
+            out.ele_eSuperClusterOverP = valid ? tau.ele_eSuperClusterOverP.at(idx) : 0;
+            out.ele_eSeedClusterOverP = valid ? tau.ele_eSeedClusterOverP.at(idx) : 0;
+            out.ele_eSeedClusterOverPout = valid ? tau.ele_eSeedClusterOverPout.at(idx) : 0;
+            out.ele_eEleClusterOverPout = valid ? tau.ele_eEleClusterOverPout.at(idx) : 0;
+            out.ele_deltaEtaSuperClusterTrackAtVtx = valid ? tau.ele_deltaEtaSuperClusterTrackAtVtx.at(idx) : 0;
+            out.ele_deltaEtaSeedClusterTrackAtCalo = valid ? tau.ele_deltaEtaSeedClusterTrackAtCalo.at(idx) : 0;
+            out.ele_deltaEtaEleClusterTrackAtCalo = valid ? tau.ele_deltaEtaEleClusterTrackAtCalo.at(idx) : 0;
+            out.ele_deltaPhiEleClusterTrackAtCalo = valid ? tau.ele_deltaPhiEleClusterTrackAtCalo.at(idx) : 0;
+            out.ele_deltaPhiSuperClusterTrackAtVtx = valid ? tau.ele_deltaPhiSuperClusterTrackAtVtx.at(idx) : 0;
+            out.ele_deltaPhiSeedClusterTrackAtCalo = valid ? tau.ele_deltaPhiSeedClusterTrackAtCalo.at(idx) : 0;
+            out.ele_mvaInput_earlyBrem = valid ? tau.ele_mvaInput_earlyBrem.at(idx) : 0;
+            out.ele_mvaInput_lateBrem = valid ? tau.ele_mvaInput_lateBrem.at(idx) : 0;
+            out.ele_mvaInput_sigmaEtaEta = valid ? tau.ele_mvaInput_sigmaEtaEta.at(idx) : 0;
+            out.ele_mvaInput_hadEnergy = valid ? tau.ele_mvaInput_hadEnergy.at(idx) : 0;
+            out.ele_mvaInput_deltaEta = valid ? tau.ele_mvaInput_deltaEta.at(idx) : 0;
+            out.ele_gsfTrack_normalizedChi2 = valid ? tau.ele_gsfTrack_normalizedChi2.at(idx) : 0;
+            out.ele_gsfTrack_numberOfValidHits = valid ? tau.ele_gsfTrack_numberOfValidHits.at(idx) : 0;
+            out.ele_rel_gsfTrack_pt = valid ? tau.ele_gsfTrack_pt.at(idx) / tau.ele_pt.at(idx) : 0;
+            out.ele_gsfTrack_pt_sig = valid ? tau.ele_gsfTrack_pt.at(idx) / tau.ele_gsfTrack_pt_error.at(idx) : 0;
             const bool has_closestCtfTrack = valid && tau.ele_closestCtfTrack_normalizedChi2.at(idx) >= 0;
             out.ele_has_closestCtfTrack = has_closestCtfTrack;
             out.ele_closestCtfTrack_normalizedChi2 = has_closestCtfTrack ?
-                GetValueNorm(tau.ele_closestCtfTrack_normalizedChi2.at(idx), 2.411f, 6.98f) : 0;
+                tau.ele_closestCtfTrack_normalizedChi2.at(idx) : 0;
             out.ele_closestCtfTrack_numberOfValidHits = has_closestCtfTrack ?
-                GetValueNorm(tau.ele_closestCtfTrack_numberOfValidHits.at(idx), 15.16f, 5.26f) : 0;
+                tau.ele_closestCtfTrack_numberOfValidHits.at(idx) : 0;
         }
 
         { // PAT muon
@@ -698,55 +1540,46 @@ private:
             out.muon_n_total = static_cast<int>(n_muon);
             out.muon_valid = valid;
 
-            out.muon_rel_pt = valid ? GetValueNorm(tau.muon_pt.at(idx) / tau.tau_pt,
-                inner ? 0.7966f : 0.2678f, inner ? 3.402f : 3.592f) : 0;
-            out.muon_deta = valid ? GetValueLinear(tau.muon_eta.at(idx) - tau.tau_eta,
-                inner ? -0.1f : -0.5f, inner ? 0.1f : 0.5f, false) : 0;
-            out.muon_dphi = valid ? GetValueLinear(DeltaPhi(tau.muon_phi.at(idx), tau.tau_phi),
-                inner ? -0.1f : -0.5f, inner ? 0.1f : 0.5f, false) : 0;
+            out.muon_rel_pt = valid ? tau.muon_pt.at(idx) / tau.tau_pt : 0;
+            out.muon_deta = valid ? tau.muon_eta.at(idx) - tau.tau_eta : 0;
+            out.muon_dphi = valid ? kinematics::DeltaPhi(tau.muon_phi.at(idx), tau.tau_phi) : 0;
 
-            out.muon_dxy = valid ? GetValueNorm(tau.muon_dxy.at(idx), 0.0019f, 1.039f) : 0;
-            out.muon_dxy_sig = valid ? GetValueNorm(std::abs(tau.muon_dxy.at(idx)) / tau.muon_dxy_error.at(idx),
-                8.98f, 71.17f) : 0;
+            out.muon_dxy = valid ? tau.muon_dxy.at(idx) : 0;
+            out.muon_dxy_sig = valid ? std::abs(tau.muon_dxy.at(idx)) / tau.muon_dxy_error.at(idx) : 0;
             const bool normalizedChi2_valid = valid && tau.muon_normalizedChi2.at(idx) >= 0;
             out.muon_normalizedChi2_valid = normalizedChi2_valid;
-            out.muon_normalizedChi2 = normalizedChi2_valid ? GetValueNorm(tau.muon_normalizedChi2.at(idx),
-                21.52f, 265.8f) : 0;
-            out.muon_numberOfValidHits = normalizedChi2_valid ? GetValueNorm(tau.muon_numberOfValidHits.at(idx),
-                21.84f, 10.59f) : 0;
-            out.muon_segmentCompatibility = valid ? GetValue(tau.muon_segmentCompatibility.at(idx)) : 0;
-            out.muon_caloCompatibility = valid ? GetValue(tau.muon_caloCompatibility.at(idx)) : 0;
+            out.muon_normalizedChi2 = normalizedChi2_valid ? tau.muon_normalizedChi2.at(idx) : 0;
+            out.muon_numberOfValidHits = normalizedChi2_valid ? tau.muon_numberOfValidHits.at(idx) : 0;
+            out.muon_segmentCompatibility = valid ? tau.muon_segmentCompatibility.at(idx) : 0;
+            out.muon_caloCompatibility = valid ? tau.muon_caloCompatibility.at(idx) : 0;
             const bool pfEcalEnergy_valid = valid && tau.muon_pfEcalEnergy.at(idx) >= 0;
             out.muon_pfEcalEnergy_valid = pfEcalEnergy_valid;
-            out.muon_rel_pfEcalEnergy = pfEcalEnergy_valid ? GetValueNorm(tau.muon_pfEcalEnergy.at(idx) /
-                tau.muon_pt.at(idx), 0.2273f, 0.4865f) : 0;
-            out.muon_n_matches_DT_1 = valid ? GetValueLinear(tau.muon_n_matches_DT_1.at(idx), 0, 2, true) : 0;
-            out.muon_n_matches_DT_2 = valid ? GetValueLinear(tau.muon_n_matches_DT_2.at(idx), 0, 2, true) : 0;
-            out.muon_n_matches_DT_3 = valid ? GetValueLinear(tau.muon_n_matches_DT_3.at(idx), 0, 2, true) : 0;
-            out.muon_n_matches_DT_4 = valid ? GetValueLinear(tau.muon_n_matches_DT_4.at(idx), 0, 2, true) : 0;
-            out.muon_n_matches_CSC_1 = valid ? GetValueLinear(tau.muon_n_matches_CSC_1.at(idx), 0, 6, true) : 0;
-            out.muon_n_matches_CSC_2 = valid ? GetValueLinear(tau.muon_n_matches_CSC_2.at(idx), 0, 2, true) : 0;
-            out.muon_n_matches_CSC_3 = valid ? GetValueLinear(tau.muon_n_matches_CSC_3.at(idx), 0, 2, true) : 0;
-            out.muon_n_matches_CSC_4 = valid ? GetValueLinear(tau.muon_n_matches_CSC_4.at(idx), 0, 2, true) : 0;
-            out.muon_n_matches_RPC_1 = valid ? GetValueLinear(tau.muon_n_matches_RPC_1.at(idx), 0, 7, true) : 0;
-            out.muon_n_matches_RPC_2 = valid ? GetValueLinear(tau.muon_n_matches_RPC_2.at(idx), 0, 6, true) : 0;
-            out.muon_n_matches_RPC_3 = valid ? GetValueLinear(tau.muon_n_matches_RPC_3.at(idx), 0, 4, true) : 0;
-            out.muon_n_matches_RPC_4 = valid ? GetValueLinear(tau.muon_n_matches_RPC_4.at(idx), 0, 4, true) : 0;
-            out.muon_n_hits_DT_1 = valid ? GetValueLinear(tau.muon_n_hits_DT_1.at(idx), 0, 12, true) : 0;
-            out.muon_n_hits_DT_2 = valid ? GetValueLinear(tau.muon_n_hits_DT_2.at(idx), 0, 12, true) : 0;
-            out.muon_n_hits_DT_3 = valid ? GetValueLinear(tau.muon_n_hits_DT_3.at(idx), 0, 12, true) : 0;
-            out.muon_n_hits_DT_4 = valid ? GetValueLinear(tau.muon_n_hits_DT_4.at(idx), 0, 8, true) : 0;
-            out.muon_n_hits_CSC_1 = valid ? GetValueLinear(tau.muon_n_hits_CSC_1.at(idx), 0, 24, true) : 0;
-            out.muon_n_hits_CSC_2 = valid ? GetValueLinear(tau.muon_n_hits_CSC_2.at(idx), 0, 12, true) : 0;
-            out.muon_n_hits_CSC_3 = valid ? GetValueLinear(tau.muon_n_hits_CSC_3.at(idx), 0, 12, true) : 0;
-            out.muon_n_hits_CSC_4 = valid ? GetValueLinear(tau.muon_n_hits_CSC_4.at(idx), 0, 12, true) : 0;
-            out.muon_n_hits_RPC_1 = valid ? GetValueLinear(tau.muon_n_hits_RPC_1.at(idx), 0, 4, true) : 0;
-            out.muon_n_hits_RPC_2 = valid ? GetValueLinear(tau.muon_n_hits_RPC_2.at(idx), 0, 4, true) : 0;
-            out.muon_n_hits_RPC_3 = valid ? GetValueLinear(tau.muon_n_hits_RPC_3.at(idx), 0, 2, true) : 0;
-            out.muon_n_hits_RPC_4 = valid ? GetValueLinear(tau.muon_n_hits_RPC_4.at(idx), 0, 2, true) : 0;
-        }
-
-        cellTuple.Fill();
+            out.muon_rel_pfEcalEnergy = pfEcalEnergy_valid ? tau.muon_pfEcalEnergy.at(idx) / tau.muon_pt.at(idx) : 0;
+            out.muon_n_matches_DT_1 = valid ? tau.muon_n_matches_DT_1.at(idx) : 0;
+            out.muon_n_matches_DT_2 = valid ? tau.muon_n_matches_DT_2.at(idx) : 0;
+            out.muon_n_matches_DT_3 = valid ? tau.muon_n_matches_DT_3.at(idx) : 0;
+            out.muon_n_matches_DT_4 = valid ? tau.muon_n_matches_DT_4.at(idx) : 0;
+            out.muon_n_matches_CSC_1 = valid ? tau.muon_n_matches_CSC_1.at(idx) : 0;
+            out.muon_n_matches_CSC_2 = valid ? tau.muon_n_matches_CSC_2.at(idx) : 0;
+            out.muon_n_matches_CSC_3 = valid ? tau.muon_n_matches_CSC_3.at(idx) : 0;
+            out.muon_n_matches_CSC_4 = valid ? tau.muon_n_matches_CSC_4.at(idx) : 0;
+            out.muon_n_matches_RPC_1 = valid ? tau.muon_n_matches_RPC_1.at(idx) : 0;
+            out.muon_n_matches_RPC_2 = valid ? tau.muon_n_matches_RPC_2.at(idx) : 0;
+            out.muon_n_matches_RPC_3 = valid ? tau.muon_n_matches_RPC_3.at(idx) : 0;
+            out.muon_n_matches_RPC_4 = valid ? tau.muon_n_matches_RPC_4.at(idx) : 0;
+            out.muon_n_hits_DT_1 = valid ? tau.muon_n_hits_DT_1.at(idx) : 0;
+            out.muon_n_hits_DT_2 = valid ? tau.muon_n_hits_DT_2.at(idx) : 0;
+            out.muon_n_hits_DT_3 = valid ? tau.muon_n_hits_DT_3.at(idx) : 0;
+            out.muon_n_hits_DT_4 = valid ? tau.muon_n_hits_DT_4.at(idx) : 0;
+            out.muon_n_hits_CSC_1 = valid ? tau.muon_n_hits_CSC_1.at(idx) : 0;
+            out.muon_n_hits_CSC_2 = valid ? tau.muon_n_hits_CSC_2.at(idx) : 0;
+            out.muon_n_hits_CSC_3 = valid ? tau.muon_n_hits_CSC_3.at(idx) : 0;
+            out.muon_n_hits_CSC_4 = valid ? tau.muon_n_hits_CSC_4.at(idx) : 0;
+            out.muon_n_hits_RPC_1 = valid ? tau.muon_n_hits_RPC_1.at(idx) : 0;
+            out.muon_n_hits_RPC_2 = valid ? tau.muon_n_hits_RPC_2.at(idx) : 0;
+            out.muon_n_hits_RPC_3 = valid ? tau.muon_n_hits_RPC_3.at(idx) : 0;
+            out.muon_n_hits_RPC_4 = valid ? tau.muon_n_hits_RPC_4.at(idx) : 0;
+        }
     }
 
     static double getInnerSignalConeRadius(double pt)
@@ -758,56 +1591,62 @@ private:
 
     static CellObjectType GetCellObjectType(int pdgId)
     {
-        static const std::map<int, CellObjectType> obj_types = {
-            { 11, CellObjectType::PfCand_electron },
-            { 13, CellObjectType::PfCand_muon },
-            { 22, CellObjectType::PfCand_gamma },
-            { 130, CellObjectType::PfCand_neutralHadron },
-            { 211, CellObjectType::PfCand_chargedHadron }
-        };
-
-        auto iter = obj_types.find(std::abs(pdgId));
-        if(iter == obj_types.end())
-            throw exception("Unknown object pdg id = %1%.") % pdgId;
-        return iter->second;
+        switch(std::abs(pdgId)) {
+            case 11: return CellObjectType::PfCand_electron;
+            case 13: return CellObjectType::PfCand_muon;
+            case 22: return CellObjectType::PfCand_gamma;
+            case 130: return CellObjectType::PfCand_neutralHadron;
+            case 211: return CellObjectType::PfCand_chargedHadron;
+        }
+        throw exception("Unknown object pdg id = %1%.") % pdgId;
     }
 
-    CellGrid CreateCellGrid(const Tau& tau, const CellGrid& cellGridRef, bool inner) const
+    // Computes the positions of all objects of the tau relative to the tau with the batch kernels and classifies the
+    // objects inside the isolation cone. Objects outside of it are skipped, since no grid accepts them.
+    static void FillCellCandidates(const Tau& tau, CellCandidateWorkspace& workspace,
+                                   std::vector<CellCandidate>& candidates)
     {
-        static constexpr double iso_cone = 0.5;
-
-        CellGrid grid = cellGridRef;
-        const double tau_pt = tau.tau_pt, tau_eta = tau.tau_eta, tau_phi = tau.tau_phi;
+        candidates.clear();
 
-        const auto fillGrid = [&](CellObjectType type, const std::vector<float>& eta_vec,
-                                  const std::vector<float>& phi_vec, const std::vector<int>& pdgId = {}) {
-            if(eta_vec.size() != phi_vec.size())
+        const auto addCandidates = [&](const std::vector<float>& pt_vec, const std::vector<float>& eta_vec,
+                                       const std::vector<float>& phi_vec, auto getType) {
+            const size_t n_objects = pt_vec.size();
+            if(eta_vec.size() != n_objects || phi_vec.size() != n_objects)
                 throw exception("Inconsistent cell inputs.");
-            for(size_t n = 0; n < eta_vec.size(); ++n) {
-                if(pdgId.size() && GetCellObjectType(pdgId.at(n)) != type) continue;
-                const double eta = eta_vec.at(n), phi = phi_vec.at(n);
-                const double deta = eta - tau_eta, dphi = DeltaPhi(phi, tau_phi);
-                const double dR = std::hypot(deta, dphi);
-                const bool inside_signal_cone = dR < getInnerSignalConeRadius(tau_pt);
-                const bool inside_iso_cone = dR < iso_cone;
-                if(inner && !inside_signal_cone) continue;
-                // if(!inner && (inside_signal_cone || !inside_iso_cone)) continue;
-                if(!inner && !inside_iso_cone) continue;
-                CellIndex cellIndex;
-                if(grid.TryGetCellIndex(deta, dphi, cellIndex))
-                    grid.at(cellIndex)[type].insert(n);
+            workspace.Resize(n_objects);
+            kinematics::DeltaR2(eta_vec.data(), phi_vec.data(), n_objects, tau.tau_eta, tau.tau_phi,
+                                workspace.deta.data(), workspace.dphi.data(), workspace.dR2.data());
+            const size_t n_selected = kinematics::ConeIndices(workspace.dR2.data(), n_objects, iso_cone_dR2,
+                                                              workspace.selected.data());
+            for(size_t k = 0; k < n_selected; ++k) {
+                const size_t n = workspace.selected[k];
+                candidates.push_back(CellCandidate{getType(n), n, pt_vec[n], workspace.deta[n], workspace.dphi[n],
+                                                   workspace.dR2[n]});
             }
         };
 
-        fillGrid(CellObjectType::PfCand_electron, tau.pfCand_eta, tau.pfCand_phi, tau.pfCand_pdgId);
-        fillGrid(CellObjectType::PfCand_muon, tau.pfCand_eta, tau.pfCand_phi, tau.pfCand_pdgId);
-        fillGrid(CellObjectType::PfCand_chargedHadron, tau.pfCand_eta, tau.pfCand_phi, tau.pfCand_pdgId);
-        fillGrid(CellObjectType::PfCand_neutralHadron, tau.pfCand_eta, tau.pfCand_phi, tau.pfCand_pdgId);
-        fillGrid(CellObjectType::PfCand_gamma, tau.pfCand_eta, tau.pfCand_phi, tau.pfCand_pdgId);
-        fillGrid(CellObjectType::Electron, tau.ele_eta, tau.ele_phi);
-        fillGrid(CellObjectType::Muon, tau.muon_eta, tau.muon_phi);
+        if(tau.pfCand_pdgId.size() != tau.pfCand_pt.size())
+            throw exception("Inconsistent cell inputs.");
+        addCandidates(tau.pfCand_pt, tau.pfCand_eta, tau.pfCand_phi,
+                      [&](size_t n) { return GetCellObjectType(tau.pfCand_pdgId[n]); });
+        addCandidates(tau.ele_pt, tau.ele_eta, tau.ele_phi, [](size_t) { return CellObjectType::Electron; });
+        addCandidates(tau.muon_pt, tau.muon_eta, tau.muon_phi, [](size_t) { return CellObjectType::Muon; });
+    }
 
-        return grid;
+    template<typename Grid>
+    void FillCellObjects(const Tau& tau, const std::vector<CellCandidate>& candidates, Grid& grid,
+                         bool inner) const
+    {
+        const float signal_cone_radius = static_cast<float>(getInnerSignalConeRadius(tau.tau_pt));
+        const float max_dR2 = inner ? signal_cone_radius * signal_cone_radius : iso_cone_dR2;
+
+        grid.Reset();
+        for(const CellCandidate& cand : candidates) {
+            if(cand.dR2 >= max_dR2) continue;
+            size_t flatIndex;
+            if(grid.TryGetFlatIndex(cand.deta, cand.dphi, flatIndex))
+                grid.Add(flatIndex, cand.type, cand.index, cand.pt);
+        }
     }
 
     static std::pair<LorentzVectorXYZ, double> SumP4(const std::vector<float>& pt, const std::vector<float>& eta,
@@ -838,12 +1677,16 @@ private:
 
 private:
     const Arguments args;
-    std::shared_ptr<TFile> inputFile, outputFile;
-    TauTuple tauTuple;
-    TrainingTauTuple trainingTauTuple;
-    TrainingCellTuple innerCellTuple, outerCellTuple;
-    const CellGrid innerCellGridRef, outerCellGridRef;
+    TwoPhaseTauTupleReader tauReader;
+    const std::vector<CellGridConfig> extraGridConfigs;
+    const std::vector<ExtraCellGrids> extraCellGridRefs;
+    std::unique_ptr<TrainingTupleManifest> outputManifest;
+    std::unique_ptr<TrainingTupleWriter> writer;
+    const FeatureNormalizationSpec normalizationSpec;
+    const FeatureNormalizer<TrainingTau> tauNormalizer;
+    const FeatureNormalizer<TrainingCell> innerCellNormalizer, outerCellNormalizer;
     const float trainingWeightFactor;
+    Long64_t startEntry, endEntry;
 };
 
 } // namespace analysis
@@ -0,0 +1,89 @@
+/*! Checks that the compact encoding of the cell features saturates the counts beyond the range of the code tables.
+*/
+
+#include <iostream>
+#include "TauML/Analysis/include/FeatureEncoding.h"
+
+namespace {
+
+using namespace analysis;
+
+struct Row {
+    float valid, n_total, n_matches;
+};
+
+void Check(bool condition, const std::string& message)
+{
+    if(!condition)
+        throw exception("Check failed: %1%.") % message;
+}
+
+using Encoder = CompactFeatureEncoder<Row>;
+
+Encoder MakeEncoder()
+{
+    FeatureColumns<Row> columns;
+    columns.Add("valid", &Row::valid);
+    columns.Add("n_total", &Row::n_total);
+    columns.Add("n_matches", &Row::n_matches);
+    FeatureNormalizationSpec::FeatureMap features;
+    features["n_matches"].transform = FeatureTransform::Linear;
+    features["n_matches"].max_value = 2.f;
+    return Encoder(columns, features, { { "valid" } }, { { "n_total", 0, 254 }, { "n_matches", 0, 254 } });
+}
+
+void TestSaturation()
+{
+    const Encoder encoder = MakeEncoder();
+    // n_matches is already normalized: raw counts above 2 are clamped to 1.
+    const std::vector<Row> rows = {
+        { 1.f, 0.f, 0.f },
+        { 1.f, 17.f, 0.5f },
+        { 1.f, 254.f, 1.f },
+        { 0.f, 255.f, 1.f },
+        { 1.f, 1000.f, 7.f },
+        { 1.f, -3.f, -1.f },
+    };
+    const std::vector<uint8_t> expected = {
+        1, 0, 0,
+        1, 18, 2,
+        1, 255, 3,
+        0, 255, 3,
+        1, 255, 3,
+        1, 0, 0,
+    };
+    std::vector<float> workspace;
+    std::vector<uint8_t> encoded(rows.size() * encoder.NumberOfBytes());
+    encoder.Encode(rows.data(), rows.size(), workspace, encoded.data());
+    Check(encoded == expected, "encoded bytes");
+}
+
+void TestInvalidValue()
+{
+    const Encoder encoder = MakeEncoder();
+    const std::vector<Row> rows = { { 1.f, 2.5f, 0.f } };
+    std::vector<float> workspace;
+    std::vector<uint8_t> encoded(rows.size() * encoder.NumberOfBytes());
+    bool thrown = false;
+    try {
+        encoder.Encode(rows.data(), rows.size(), workspace, encoded.data());
+    } catch(exception&) {
+        thrown = true;
+    }
+    Check(thrown, "value inside the range of the table that has no code");
+}
+
+} // anonymous namespace
+
+int main()
+{
+    try {
+        TestSaturation();
+        TestInvalidValue();
+    } catch(std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return 1;
+    }
+    std::cout << "CompactFeatureEncoderTest: OK" << std::endl;
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*! Checks that the features without a bounded normalized range are stored exactly by the reduced precision storages
+of the dense training tuple.
+*/
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include "TauML/Analysis/include/FeatureEncoding.h"
+
+namespace {
+
+using namespace analysis;
+
+// Data of the npy file written by NpyFileWriter.
+template<typename T>
+std::vector<T> ReadNpyData(const std::string& file_name)
+{
+    std::ifstream file(file_name, std::ios::binary);
+    if(!file.is_open())
+        throw exception("Unable to open '%1%'.") % file_name;
+    char preamble[10];
+    file.read(preamble, sizeof(preamble));
+    const size_t header_size = sizeof(preamble) + static_cast<uint8_t>(preamble[8])
+                               + (static_cast<size_t>(static_cast<uint8_t>(preamble[9])) << 8);
+    file.seekg(0, std::ios::end);
+    const size_t data_size = static_cast<size_t>(file.tellg()) - header_size;
+    std::vector<T> data(data_size / sizeof(T));
+    file.seekg(static_cast<std::streamoff>(header_size));
+    file.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(data_size));
+    if(!file.good())
+        throw exception("Error while reading '%1%'.") % file_name;
+    return data;
+}
+
+void Check(bool condition, const std::string& message)
+{
+    if(!condition)
+        throw exception("Check failed: %1%.") % message;
+}
+
+void TestStorage(FeatureStorage storage)
+{
+    // Weights and indices are not normalized, the pt is normalized into [0, 1].
+    const std::vector<std::string> names = { "genEventWeight", "tau_pt", "tau_index" };
+    FeatureNormalizationSpec::FeatureMap features;
+    features["tau_pt"].transform = FeatureTransform::Linear;
+    const std::vector<float> rows = {
+        0.123456789f, 0.5f, 123457.f,
+        1.5e6f, 1.f, 70001.f,
+        -3.33333333f, 0.f, -1.f,
+    };
+    const std::string file_name = "DenseFeatureFileTest_" + ToString(storage) + ".npy";
+    const std::string float_file_name = DenseFeatureFile::GetFloatFileName(file_name);
+    {
+        DenseFeatureFile file(file_name, { names.size() }, storage, FeatureEncoder::GetScales(names, features));
+        Check(file.FloatColumns() == std::vector<size_t>({ 0, 2 }), "unbounded features are stored as float32");
+        file.Write(rows);
+        file.Close();
+    }
+    const auto float_data = ReadNpyData<float>(float_file_name);
+    Check(float_data.size() == 6, "number of float32 values");
+    for(size_t row = 0; row < 3; ++row) {
+        Check(float_data.at(row * 2) == rows.at(row * 3), "genEventWeight round trip");
+        Check(float_data.at(row * 2 + 1) == rows.at(row * 3 + 2), "tau_index round trip");
+    }
+    const auto main_data = ReadNpyData<uint16_t>(file_name);
+    Check(main_data.size() == 3, "number of reduced precision values");
+    for(size_t row = 0; row < 3; ++row) {
+        const float pt = storage == FeatureStorage::Half ? HalfToFloat(main_data.at(row))
+                       : static_cast<int16_t>(main_data.at(row)) * FixedPointScale(1.f);
+        Check(pt == rows.at(row * 3 + 1), "tau_pt round trip");
+    }
+    std::remove(file_name.c_str());
+    std::remove(float_file_name.c_str());
+}
+
+} // anonymous namespace
+
+int main()
+{
+    try {
+        TestStorage(FeatureStorage::Half);
+        TestStorage(FeatureStorage::Fixed);
+    } catch(std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return 1;
+    }
+    std::cout << "DenseFeatureFileTest: OK" << std::endl;
+    return 0;
+}
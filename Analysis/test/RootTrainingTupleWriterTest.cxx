@@ -0,0 +1,105 @@
+/*! Checks that the root training tuple writer appends taus to an existing output: the trees get the new entries, the
+cell ranges continue from the existing cells and the cluster index continues from the existing clusters.
+*/
+
+#include <cstdio>
+#include <iostream>
+#include "TauML/Analysis/include/TrainingTupleWriter.h"
+
+namespace {
+
+using namespace analysis;
+
+constexpr Long64_t n_inner_cells_per_tau = 2, n_outer_cells_per_tau = 1, cluster_size = 2;
+
+void Check(bool condition, const std::string& message)
+{
+    if(!condition)
+        throw exception("Check failed: %1%.") % message;
+}
+
+// Chunk with the given number of taus. Events are numbered starting from first_evt.
+TrainingTupleChunk MakeChunk(size_t n_taus, ULong64_t first_evt)
+{
+    TrainingTupleChunk chunk;
+    for(size_t n = 0; n < n_taus; ++n) {
+        tau_tuple::TrainingTau tau{};
+        tau.evt = first_evt + n;
+        tau.innerCells_begin = static_cast<Long64_t>(chunk.innerCells.size());
+        chunk.innerCells.resize(chunk.innerCells.size() + n_inner_cells_per_tau);
+        tau.innerCells_end = static_cast<Long64_t>(chunk.innerCells.size());
+        tau.outerCells_begin = static_cast<Long64_t>(chunk.outerCells.size());
+        chunk.outerCells.resize(chunk.outerCells.size() + n_outer_cells_per_tau);
+        tau.outerCells_end = static_cast<Long64_t>(chunk.outerCells.size());
+        chunk.taus.push_back(tau);
+    }
+    chunk.n_processed = n_taus;
+    return chunk;
+}
+
+void WriteChunk(const std::string& file_name, const TrainingTupleChunk& chunk, bool append)
+{
+    RootTrainingTupleWriter writer(file_name, {}, RootCellLayout(), cluster_size, nullptr, append);
+    writer.Write(chunk);
+    writer.Finalize();
+}
+
+void TestAppend()
+{
+    const std::string file_name = "RootTrainingTupleWriterTest.root";
+    const std::string index_name = file_name + ".index.json";
+    WriteChunk(file_name, MakeChunk(3, 0), false);
+    WriteChunk(file_name, MakeChunk(2, 3), true);
+
+    {
+        auto file = root_ext::OpenRootFile(file_name);
+        tau_tuple::TrainingTauTuple tauTuple(file.get(), true);
+        tau_tuple::TrainingCellTuple innerCellTuple("inner_cells", file.get(), true);
+        tau_tuple::TrainingCellTuple outerCellTuple("outer_cells", file.get(), true);
+        Check(tauTuple.GetEntries() == 5, "number of taus");
+        Check(innerCellTuple.GetEntries() == 5 * n_inner_cells_per_tau, "number of inner cells");
+        Check(outerCellTuple.GetEntries() == 5 * n_outer_cells_per_tau, "number of outer cells");
+        Long64_t n = 0;
+        for(const auto& tau : tauTuple) {
+            Check(tau.evt == static_cast<ULong64_t>(n), "order of the taus");
+            Check(tau.innerCells_begin == n * n_inner_cells_per_tau
+                  && tau.innerCells_end == (n + 1) * n_inner_cells_per_tau, "inner cell range");
+            Check(tau.outerCells_begin == n * n_outer_cells_per_tau
+                  && tau.outerCells_end == (n + 1) * n_outer_cells_per_tau, "outer cell range");
+            ++n;
+        }
+        Check(n == 5, "number of read taus");
+    }
+
+    boost::property_tree::ptree index;
+    boost::property_tree::read_json(index_name, index);
+    const std::vector<std::pair<Long64_t, Long64_t>> expected_taus = { { 0, 2 }, { 2, 3 }, { 3, 5 } };
+    size_t id = 0;
+    for(const auto& item : index.get_child("clusters")) {
+        Check(id < expected_taus.size(), "number of clusters");
+        Check(item.second.get<size_t>("id") == id, "cluster id");
+        std::vector<Long64_t> taus;
+        for(const auto& value : item.second.get_child("entries").front().second)
+            taus.push_back(value.second.get_value<Long64_t>());
+        Check(taus == std::vector<Long64_t>({ expected_taus.at(id).first, expected_taus.at(id).second }),
+              "tau range of the cluster");
+        ++id;
+    }
+    Check(id == expected_taus.size(), "number of clusters");
+    std::remove(file_name.c_str());
+    std::remove(index_name.c_str());
+}
+
+} // anonymous namespace
+
+int main()
+{
+    try {
+        TestAppend();
+    } catch(std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return 1;
+    }
+    std::cout << "RootTrainingTupleWriterTest: OK" << std::endl;
+    return 0;
+}
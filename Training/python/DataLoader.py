@@ -1,5 +1,7 @@
 import glob
+import json
 import math
+import os
 import gc
 from queue import Queue
 from threading import Thread, Lock
@@ -7,6 +9,7 @@ import numpy as np
 import pandas
 import uproot
 from common import *
+from FeatureNormalization import CreateNormalizers
 from fill_grid import FillGrid, FillSequence
 
 read_hdf_lock = Lock()
@@ -28,11 +31,244 @@ def read_root(tree, branches, start, stop):
     read_root_lock.release()
     return data
 
-def LoaderThread(file_entries, queue, net_config, batch_size, chunk_size, return_truth, return_weights, return_grid):
+def read_root_vectors(tree, branch, start, stop, dtype):
+    """Vector branch with the same number of items in each entry as a 2D array."""
+    read_root_lock.acquire()
+    items = tree.array(branch, entrystart=start, entrystop=stop)
+    read_root_lock.release()
+    return np.asarray(items.content, dtype=dtype).reshape(len(items), -1)
+
+def HasTree(root_file, tree_name):
+    return any(key.split(b';')[0] == tree_name.encode() for key in root_file.keys())
+
+def CellTraversalOrder(n_cells_eta, n_cells_phi):
+    """Flat (eta, phi) indices of the cells in the order in which TrainingTupleProducer stores them:
+       by increasing |eta_index| + |phi_index|, then by eta_index, then by phi_index."""
+    max_eta, max_phi = (n_cells_eta - 1) // 2, (n_cells_phi - 1) // 2
+    order = []
+    for distance in range(max_eta + max_phi + 1):
+        max_eta_distance = min(max_eta, distance)
+        for eta in range(-max_eta_distance, max_eta_distance + 1):
+            max_phi_distance = distance - abs(eta)
+            if max_phi_distance > max_phi: continue
+            for phi in ([ -max_phi_distance, max_phi_distance ] if max_phi_distance else [ 0 ]):
+                order.append((eta + max_eta) * n_cells_phi + phi + max_phi)
+    return np.array(order, dtype=np.int64)
+
+def FillFromOccupancy(occupancy_words, traversal_order, n_cells_eta, n_cells_phi, packed_cells, other_inputs,
+                      return_grid):
+    """Same output as FillGrid or FillSequence for cells stored with --cell-encoding bitmap. Bit n of the occupancy
+       bitmap of a tau is set if the n-th cell in the traversal order is stored. The packed cells of all taus are
+       consecutive, so they are scattered into the output with a single boolean mask."""
+    n_taus, n_cells = occupancy_words.shape[0], n_cells_eta * n_cells_phi
+    n_other_inputs = other_inputs.shape[1]
+    bits = np.unpackbits(occupancy_words.astype('<u8').view(np.uint8).reshape(n_taus, -1), axis=1,
+                         bitorder='little')
+    occupied = bits[:, :n_cells].astype(bool)
+    if not return_grid:
+        occupied = np.arange(n_cells)[np.newaxis, :] < np.count_nonzero(occupied, axis=1)[:, np.newaxis]
+    cells = np.zeros((n_taus, n_cells, n_other_inputs + packed_cells.shape[1]), dtype=np.float32)
+    cells[occupied, n_other_inputs:] = packed_cells
+    cells[..., :n_other_inputs] = np.where(occupied[..., np.newaxis], other_inputs[:, np.newaxis, :], 0)
+    if not return_grid:
+        return cells
+    grid = np.empty_like(cells)
+    grid[:, traversal_order] = cells
+    return grid.reshape((n_taus, n_cells_eta, n_cells_phi, cells.shape[2]))
+
+class CompactCellLayout:
+    """Flags and small integer cell features stored with TrainingTupleProducer --cell-schema compact. Each flag group
+       is stored in one byte, bit n corresponds to the n-th flag of the group. Each coded feature is stored in one
+       byte, which is the index in the table of its values."""
+
+    object_name = 'compact_cell_layout'
+
+    @staticmethod
+    def Load(root_file):
+        """Layouts of the inner and outer cells, or None if the cells are stored with the full schema."""
+        if not HasTree(root_file, CompactCellLayout.object_name):
+            return None
+        layouts = json.loads(root_file[CompactCellLayout.object_name]._fTitle.decode())
+        return { loc: CompactCellLayout(layout) for loc, layout in layouts.items() }
+
+    def __init__(self, layout):
+        self.n_bytes = layout['n_bytes']
+        self.flags = layout['flags']
+        self.codes = [ (code['name'], np.array(code['values'], dtype=np.float32)) for code in layout['codes'] ]
+        self.names = set(name for group in self.flags for name in group) | set(name for name, _ in self.codes)
+
+    def Expand(self, features, df):
+        """Adds the columns decoded from the (n_cells, n_bytes) array to the data frame."""
+        if features.shape[1] != self.n_bytes:
+            raise RuntimeError('Unexpected size of the compact cell features.')
+        for index, group in enumerate(self.flags):
+            for bit, name in enumerate(group):
+                df[name] = ((features[:, index] >> bit) & 1).astype(np.float32)
+        for index, (name, values) in enumerate(self.codes, len(self.flags)):
+            df[name] = values[features[:, index]]
+
+def MakeItem(X_all, Y, weights, return_truth, return_weights):
+    if return_weights:
+        X_all.append(weights)
+    if return_truth and return_weights:
+        return (X_all, Y, weights)
+    if return_truth:
+        return (X_all, Y)
+    if return_weights:
+        return (X_all, weights)
+    return X_all
+
+cell_occupancy_branches = [ 'pfCand_ele_valid', 'pfCand_muon_valid', 'pfCand_chHad_valid', 'pfCand_nHad_valid',
+                            'pfCand_gamma_valid', 'ele_valid', 'muon_valid' ]
+
+class DenseTuple:
+    """Directory with the fixed-shape arrays produced by TrainingTupleProducer --format dense."""
+
+    array_names = [ 'taus', 'truth', 'weights', 'inner_cells', 'outer_cells' ]
+
+    @staticmethod
+    def IsDenseTuple(path):
+        return os.path.isdir(path) and os.path.isfile(os.path.join(path, 'columns.json'))
+
+    def __init__(self, path):
+        self.path = path
+        with open(os.path.join(path, 'columns.json')) as f:
+            self.columns = json.load(f)
+        self.arrays = { name: np.load(os.path.join(path, name + '.npy'), mmap_mode='r')
+                        for name in DenseTuple.array_names }
+        self.scales = { name: np.array(scales, dtype=np.float32)
+                        for name, scales in self.columns.get('scales', {}).items() }
+        self.float_masks = { }
+        for name, float_columns in self.columns.get('float32_columns', {}).items():
+            self.arrays[name + '_float'] = np.load(os.path.join(path, name + '_float.npy'), mmap_mode='r')
+            self.float_masks[name] = np.isin(self.columns[name], float_columns)
+
+    def Read(self, array_name, begin, end):
+        """Features of the entries [begin, end) converted into float32. Fixed-point features are multiplied by their
+           scales. Features stored in the float32 array are placed back into their columns."""
+        values = self.arrays[array_name][begin:end]
+        if values.dtype == np.int16:
+            values = values.astype(np.float32) * self.scales[array_name]
+        else:
+            values = np.asarray(values, dtype=np.float32)
+        if array_name not in self.float_masks:
+            return values
+        float_mask = self.float_masks[array_name]
+        features = np.empty(values.shape[:-1] + (len(float_mask),), dtype=np.float32)
+        features[..., ~float_mask] = values
+        features[..., float_mask] = self.arrays[array_name + '_float'][begin:end]
+        return features
+
+    def ColumnIndices(self, array_name, branches):
+        return [ self.columns[array_name].index(br) for br in branches ]
+
+    def GetNormalizers(self, normalizers):
+        """Normalizers to apply to the arrays, or None if the stored features are already normalized."""
+        if 'normalization' not in self.columns:
+            if normalizers is not None:
+                raise RuntimeError("Features in '{}' are already normalized.".format(self.path))
+            return None
+        if normalizers is not None:
+            return normalizers
+        return CreateNormalizers(os.path.join(self.path, self.columns['normalization']))
+
+class ClusterIndex:
+    """Sidecar index <file>.index.json written by TrainingTupleProducer next to the root output. Clusters of the cell
+       trees end at the same taus as the clusters of the taus tree."""
+
+    @staticmethod
+    def Load(file_name):
+        index_file = file_name + '.index.json'
+        return ClusterIndex(index_file) if os.path.isfile(index_file) else None
+
+    def __init__(self, index_file):
+        with open(index_file) as f:
+            index = json.load(f)
+        tau_tree = index['trees'].index('taus')
+        self.tau_ends = np.array([ cluster['entries'][tau_tree][1] for cluster in index['clusters'] ], dtype=np.int64)
+
+    def AlignedStop(self, start, stop, step):
+        """The last cluster end in (start, stop] that is a multiple of step entries away from start.
+           If there is no such cluster end, stop is returned."""
+        ends = self.tau_ends[(self.tau_ends > start) & (self.tau_ends <= stop)]
+        ends = ends[(ends - start) % step == 0]
+        return int(ends[-1]) if len(ends) else stop
+
+class ChunkIndex:
+    """Index <output>.chunks.json written by TrainingTupleProducer with worker processes. Each worker writes its own
+       output, the index lists these outputs and the output and the tau range of each chunk of input entries."""
+
+    @staticmethod
+    def IsChunkIndex(file_name):
+        return file_name.endswith('.chunks.json')
+
+    def __init__(self, index_file):
+        with open(index_file) as f:
+            index = json.load(f)
+        index_dir = os.path.dirname(index_file)
+        self.files = [ os.path.join(index_dir, name) for name in index['files'] ]
+        self.chunks = [ (self.files[chunk['file']], chunk['taus'][0], chunk['taus'][1])
+                        for chunk in index['chunks'] ]
+
+def LoadDenseTuple(path, tau_begin, tau_end, queue, net_config, batch_size, return_truth, return_weights,
+                   return_grid, normalizers):
+    if not return_grid:
+        raise RuntimeError("Dense tuples can be loaded only as grids.")
+    data = DenseTuple(path)
+    normalizers = data.GetNormalizers(normalizers)
+    tau_indices = data.ColumnIndices('taus', net_config.tau_branches)
+    truth_indices = data.ColumnIndices('truth', truth_branches)
+    external_indices = data.ColumnIndices('taus', input_cell_external_branches)
+    occupancy_indices = {}
+    comp_indices = {}
+    for loc in net_config.cell_locations:
+        occupancy_indices[loc] = data.ColumnIndices(loc + '_cells', cell_occupancy_branches)
+        comp_indices[loc] = [ data.ColumnIndices(loc + '_cells', cmp_branches)
+                              for cmp_branches in net_config.comp_branches ]
+
+    for b_tau_begin in range(tau_begin, tau_end, batch_size):
+        b_tau_end = min(b_tau_begin + batch_size, tau_end)
+        taus = data.Read('taus', b_tau_begin, b_tau_end)
+        if normalizers is not None:
+            taus = normalizers['tau'].ApplyArray(taus, data.columns['taus'])
+        X_all = [ ]
+        if len(tau_indices):
+            X_all.append(np.ascontiguousarray(taus[:, tau_indices], dtype=np.float32))
+
+        Y = np.empty((b_tau_end - b_tau_begin, n_outputs), dtype=np.int)
+        Y[:, :] = data.arrays['truth'][b_tau_begin:b_tau_end, truth_indices]
+
+        # Same layout as FillGrid: external tau inputs are set only for the cells that contain objects.
+        external = taus[:, external_indices][:, np.newaxis, np.newaxis, :]
+        for loc in net_config.cell_locations:
+            cells = data.Read(loc + '_cells', b_tau_begin, b_tau_end)
+            if normalizers is not None:
+                cells = normalizers[loc].ApplyArray(cells, data.columns[loc + '_cells'])
+            occupied = np.any(cells[..., occupancy_indices[loc]] > 0, axis=-1, keepdims=True)
+            X_external = np.where(occupied, external, 0).astype(np.float32)
+            for indices in comp_indices[loc]:
+                X_all.append(np.concatenate([ X_external, cells[..., indices] ], axis=-1))
+
+        weights = None
+        if return_weights:
+            weights = np.array(data.arrays['weights'][b_tau_begin:b_tau_end], dtype=np.float32)
+        queue.put(MakeItem(X_all, Y, weights, return_truth, return_weights))
+
+def LoaderThread(file_entries, queue, net_config, batch_size, chunk_size, return_truth, return_weights, return_grid,
+                 normalizers):
     FillFn = FillGrid if return_grid else FillSequence
     for file_name, tau_begin, tau_end in file_entries:
+        if DenseTuple.IsDenseTuple(file_name):
+            LoadDenseTuple(file_name, tau_begin, tau_end, queue, net_config, batch_size, return_truth,
+                           return_weights, return_grid, normalizers)
+            continue
         root_input = file_name.endswith('.root')
+        cluster_index = None
+        occupancy_tree = None
+        compact_layout = None
+        cell_branches = df_cell_branches
         if root_input:
+            cluster_index = ClusterIndex.Load(file_name)
             root_file = uproot.open(file_name)
             taus_tree = root_file['taus']
             taus_tree._recover()
@@ -41,26 +277,52 @@ def LoaderThread(file_entries, queue, net_config, batch_size, chunk_size, return
             for loc in net_config.cell_locations:
                 cells_tree[loc] = root_file[loc + '_cells']
                 cells_tree[loc]._recover()
+            if HasTree(root_file, 'cell_occupancy'):
+                occupancy_tree = root_file['cell_occupancy']
+                occupancy_tree._recover()
+                cell_branches = [ br for br in df_cell_branches if br not in cell_index_branches ]
+                traversal_order = { loc: CellTraversalOrder(n_cells_eta[loc], n_cells_phi[loc])
+                                    for loc in net_config.cell_locations }
+            compact_layout = CompactCellLayout.Load(root_file)
+            if compact_layout is not None:
+                compact_tree = {}
+                for loc in net_config.cell_locations:
+                    compact_tree[loc] = root_file['compact_' + loc + '_cells']
+                    compact_tree[loc]._recover()
+                    cell_branches = [ br for br in cell_branches if br not in compact_layout[loc].names ]
 
         expected_n_batches = int(math.ceil((tau_end - tau_begin) / float(batch_size)))
         tau_current = tau_begin
         global_batch_id = 0
         while tau_current < tau_end:
             entry_stop = min(tau_current + chunk_size, tau_end)
+            if cluster_index is not None:
+                entry_stop = cluster_index.AlignedStop(tau_current, entry_stop, batch_size)
             if root_input:
                 df_taus = read_root(taus_tree, df_tau_branches, tau_current, entry_stop)
             else:
                 df_taus = read_hdf(file_name, 'taus', df_tau_branches, tau_current, entry_stop)
+            if normalizers is not None:
+                normalizers['tau'].ApplyDataFrame(df_taus)
 
             df_cells = {}
             cells_begin_ref = {}
+            occupancy = {}
             for loc in net_config.cell_locations:
                 cells_begin = df_taus[loc + 'Cells_begin'].values[0]
                 cells_end = df_taus[loc + 'Cells_end'].values[-1]
+                if occupancy_tree is not None:
+                    occupancy[loc] = read_root_vectors(occupancy_tree, loc + 'Cells_occupancy', tau_current,
+                                                       entry_stop, np.uint64)
                 if root_input:
-                    df_cells[loc] = read_root(cells_tree[loc], df_cell_branches, cells_begin, cells_end)
+                    df_cells[loc] = read_root(cells_tree[loc], cell_branches, cells_begin, cells_end)
+                    if compact_layout is not None:
+                        compact_layout[loc].Expand(read_root_vectors(compact_tree[loc], 'features', cells_begin,
+                                                                     cells_end, np.uint8), df_cells[loc])
                 else:
                     df_cells[loc] = read_hdf(file_name, loc + '_cells', df_cell_branches, cells_begin, cells_end)
+                if normalizers is not None:
+                    normalizers[loc].ApplyDataFrame(df_cells[loc])
                 cells_begin_ref[loc] = cells_begin
             current_chunk_size = entry_stop - tau_current
             n_batches = int(math.ceil(current_chunk_size / float(batch_size)))
@@ -87,26 +349,23 @@ def LoaderThread(file_entries, queue, net_config, batch_size, chunk_size, return
                     b_cells_begin = b_cells_begins[0] - cells_begin_ref[loc]
                     b_cells_end = b_cells_ends[-1] - cells_begin_ref[loc]
                     for cmp_branches in net_config.comp_branches:
-                        X_cells_comp = FillFn(b_cells_begins, b_cells_ends, n_cells_eta[loc], n_cells_phi[loc],
-                            df_cells[loc][cell_index_branches].values[b_cells_begin:b_cells_end, :],
-                            df_cells[loc][cmp_branches].values[b_cells_begin:b_cells_end, :],
-                            df_taus[input_cell_external_branches].values[b_tau_begin:b_tau_end, :])
+                        if occupancy_tree is not None:
+                            X_cells_comp = FillFromOccupancy(occupancy[loc][b_tau_begin:b_tau_end, :],
+                                traversal_order[loc], n_cells_eta[loc], n_cells_phi[loc],
+                                df_cells[loc][cmp_branches].values[b_cells_begin:b_cells_end, :],
+                                df_taus[input_cell_external_branches].values[b_tau_begin:b_tau_end, :], return_grid)
+                        else:
+                            X_cells_comp = FillFn(b_cells_begins, b_cells_ends, n_cells_eta[loc], n_cells_phi[loc],
+                                df_cells[loc][cell_index_branches].values[b_cells_begin:b_cells_end, :],
+                                df_cells[loc][cmp_branches].values[b_cells_begin:b_cells_end, :],
+                                df_taus[input_cell_external_branches].values[b_tau_begin:b_tau_end, :])
                         X_all.append(X_cells_comp)
 
+                weights = None
                 if return_weights:
                     weights = np.empty(b_size, dtype=np.float32)
                     weights[:] = df_taus[weight_branches[0]].values[b_tau_begin:b_tau_end]
-                    X_all.append(weights)
-
-                if return_truth and return_weights:
-                    item = (X_all, Y, weights)
-                elif return_truth:
-                    item = (X_all, Y)
-                elif return_weights:
-                    item = (X_all, weights)
-                else:
-                    item = X_all
-                queue.put(item)
+                queue.put(MakeItem(X_all, Y, weights, return_truth, return_weights))
             tau_current = entry_stop
             del df_taus
             for loc in net_config.cell_locations:
@@ -148,6 +407,8 @@ class FileEntry:
 class DataLoader:
     @staticmethod
     def GetNumberOfEntries(file_name, tree_name):
+        if DenseTuple.IsDenseTuple(file_name):
+            return np.load(os.path.join(file_name, tree_name + '.npy'), mmap_mode='r').shape[0]
         if file_name.endswith('.root'):
             with uproot.open(file_name) as file:
                 tree = file[tree_name]
@@ -157,7 +418,10 @@ class DataLoader:
                 return h5.get_storer('taus').nrows
 
     def __init__(self, file_name_pattern, net_config, batch_size, chunk_size, validation_size = None,
-                 max_data_size = None, max_queue_size = 8, n_passes = -1, return_grid = True):
+                 max_data_size = None, max_queue_size = 8, n_passes = -1, return_grid = True, normalization = None):
+        """file_name_pattern: pattern of the input files or the chunk index of the outputs of worker processes.
+           normalization: configuration file used to normalize tuples produced with --raw-features. Dense tuples
+           with raw features are normalized with the configuration stored next to them by default."""
         if type(batch_size) != int or type(chunk_size) != int or batch_size <= 0 or chunk_size <= 0:
             raise RuntimeError("batch_size and chunk_size should be positive integer numbers")
         if batch_size > chunk_size or chunk_size % batch_size != 0:
@@ -170,9 +434,13 @@ class DataLoader:
         self.n_passes = n_passes
         self.max_queue_size = max_queue_size
         self.return_grid = return_grid
+        self.normalizers = CreateNormalizers(normalization) if normalization is not None else None
         self.has_validation_set = validation_size is not None
 
-        all_files = [ f.replace('\\', '/') for f in sorted(glob.glob(file_name_pattern)) ]
+        if ChunkIndex.IsChunkIndex(file_name_pattern):
+            all_files = ChunkIndex(file_name_pattern).files
+        else:
+            all_files = [ f.replace('\\', '/') for f in sorted(glob.glob(file_name_pattern)) ]
         evt_left = max_data_size
         val_evt_left = validation_size
         self.file_entries = []
@@ -217,7 +485,7 @@ class DataLoader:
         while self.n_passes < 0 or current_pass < self.n_passes:
             thread = Thread(target=LoaderThread,
                      args=( file_entries, queue, self.net_config, self.batch_size, self.chunk_size,
-                            return_truth, return_weights, self.return_grid ))
+                            return_truth, return_weights, self.return_grid, self.normalizers ))
             thread.daemon = True
             thread.start()
             for step_id in range(steps_per_epoch):
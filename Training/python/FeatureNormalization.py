@@ -0,0 +1,100 @@
+import re
+import numpy as np
+
+class FeatureNormalization:
+    """Normalization of a single feature, identical to the one applied by TrainingTupleProducer."""
+
+    inf = np.float32(np.inf)
+
+    def __init__(self, transform, mean=0., sigma=1., max_sigma=5., min_value=0., max_value=1., gate=None):
+        self.transform = transform
+        self.gate = gate
+        f = np.float32
+        # y = clip((clip(x, in_min, in_max) - shift) / scale, out_min, out_max) * post_factor - post_shift
+        if transform == 'value':
+            self.coefficients = (-self.inf, self.inf, f(0), f(1), -self.inf, self.inf, f(1), f(0))
+        elif transform == 'norm':
+            self.coefficients = (-self.inf, self.inf, f(mean), f(sigma), -f(max_sigma), f(max_sigma), f(1), f(0))
+        elif transform == 'linear':
+            self.coefficients = (f(min_value), f(max_value), f(min_value), f(max_value) - f(min_value),
+                                 -self.inf, self.inf, f(1), f(0))
+        elif transform == 'linear_symmetric':
+            self.coefficients = (f(min_value), f(max_value), f(min_value), f(max_value) - f(min_value),
+                                 -self.inf, self.inf, f(2), f(1))
+        else:
+            raise RuntimeError('Unknown feature transform "{}".'.format(transform))
+
+    def Apply(self, values, gate_values=None):
+        in_min, in_max, shift, scale, out_min, out_max, post_factor, post_shift = self.coefficients
+        y = np.array(values, dtype=np.float32)
+        y[~np.isfinite(y) | (np.abs(y) < np.finfo(np.float32).tiny)] = 0
+        y = np.clip(y, in_min, in_max)
+        y = np.clip((y - shift) / scale, out_min, out_max) * post_factor - post_shift
+        if gate_values is not None:
+            y[~(np.asarray(gate_values) > 0)] = 0
+        return y
+
+class FeatureNormalizationSpec:
+    """Normalization configuration in the format of Analysis/config/training_normalization.cfg."""
+
+    def __init__(self, cfg_file_name):
+        self.scopes = {}
+        item_regex = re.compile(r'^([^:\s]+)\.([^:\s]+)\s*:\s*(.*)$')
+        with open(cfg_file_name) as f:
+            for line in f:
+                line = line.split('#')[0].strip()
+                if len(line) == 0: continue
+                match = item_regex.match(line)
+                if match is None:
+                    raise RuntimeError('Invalid line "{}" in "{}".'.format(line, cfg_file_name))
+                scope, feature, params_str = match.groups()
+                params = dict(param.split('=', 1) for param in params_str.split())
+                if 'transform' not in params:
+                    raise RuntimeError('Transform is not specified for "{}.{}".'.format(scope, feature))
+                norm = FeatureNormalization(params['transform'], mean=float(params.get('mean', 0)),
+                                            sigma=float(params.get('sigma', 1)),
+                                            max_sigma=float(params.get('max_sigma', 5)),
+                                            min_value=float(params.get('min', 0)),
+                                            max_value=float(params.get('max', 1)), gate=params.get('valid'))
+                self.scopes.setdefault(scope, {})[feature] = norm
+
+    def GetFeatures(self, scope, fallback_scope=None):
+        features = {}
+        if fallback_scope is not None:
+            features.update(self.scopes.get(fallback_scope, {}))
+        features.update(self.scopes.get(scope, {}))
+        return features
+
+class FeatureNormalizer:
+    """Normalizes raw features stored with TrainingTupleProducer --raw-features.
+       Gates are read before any column is modified."""
+
+    def __init__(self, features):
+        self.features = features
+
+    def ApplyDataFrame(self, df):
+        gates = { norm.gate: df[norm.gate].values.copy() for name, norm in self.features.items()
+                  if name in df.columns and norm.gate is not None }
+        for name, norm in self.features.items():
+            if name in df.columns:
+                df[name] = norm.Apply(df[name].values, gates.get(norm.gate))
+
+    def ApplyArray(self, array, columns):
+        """Normalizes the last axis of the array, where columns are the names of the features along it."""
+        output = np.array(array, dtype=np.float32)
+        indices = { name: n for n, name in enumerate(columns) }
+        gates = { norm.gate: array[..., indices[norm.gate]] for name, norm in self.features.items()
+                  if name in indices and norm.gate is not None }
+        for name, norm in self.features.items():
+            if name in indices:
+                output[..., indices[name]] = norm.Apply(array[..., indices[name]], gates.get(norm.gate))
+        return output
+
+def CreateNormalizers(cfg_file_name):
+    """Normalizers of the tau features and of the inner and outer cell features."""
+    spec = FeatureNormalizationSpec(cfg_file_name)
+    return {
+        'tau': FeatureNormalizer(spec.GetFeatures('tau')),
+        'inner': FeatureNormalizer(spec.GetFeatures('inner_cell', 'cell')),
+        'outer': FeatureNormalizer(spec.GetFeatures('outer_cell', 'cell')),
+    }
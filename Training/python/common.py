@@ -49,6 +49,7 @@ input_tau_branches = [ 'tau_pt', 'tau_eta', 'tau_phi', 'tau_mass', 'tau_E_over_p
                        'tau_inside_ecal_crack', 'leadChargedCand_etaAtEcalEntrance_minus_tau_eta' ]
 
 
+# Tau-level inputs of the cells, read from the taus tree and broadcast to all non-empty cells of the tau.
 input_cell_external_branches = [ 'rho', 'tau_pt', 'tau_eta', 'tau_inside_ecal_crack' ]
 
 cell_index_branches = [ 'eta_index', 'phi_index' ]